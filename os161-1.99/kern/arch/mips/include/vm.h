@@ -66,6 +66,7 @@
  * a valid address, and will make a *huge* mess if you scribble on it.
  */
 #define PADDR_TO_KVADDR(paddr) ((paddr)+MIPS_KSEG0)
+#define KVADDR_TO_PADDR(vaddr) ((vaddr)-MIPS_KSEG0)
 
 /*
  * The top of user space. (Actually, the address immediately above the
@@ -112,11 +113,17 @@ struct tlbshootdown {
 	/*
 	 * Change this to what you need for your VM design.
 	 */
-	struct addrspace *ts_addrspace;
+	uint64_t ts_as_id;	/* as_id of the address space, or 0 for kseg2 */
 	vaddr_t ts_vaddr;
 };
 
 #define TLBSHOOTDOWN_MAX 16
 
+/*
+ * Number of hardware address space IDs (TLBHI_PID values). ASID 0 is
+ * never given to an address space.
+ */
+#define NUM_ASID 64
+
 
 #endif /* _MIPS_VM_H_ */
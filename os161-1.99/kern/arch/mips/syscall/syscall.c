@@ -137,6 +137,63 @@ syscall(struct trapframe *tf)
       err = sys_execv((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
       break;
 #endif
+#if OPT_A3
+	case SYS_open:
+	  err = sys_open((userptr_t)tf->tf_a0,
+			 (int)tf->tf_a1,
+			 (mode_t)tf->tf_a2,
+			 (int *)&retval);
+	  break;
+	case SYS_close:
+	  err = sys_close((int)tf->tf_a0);
+	  break;
+	case SYS_fsync:
+	  err = sys_fsync((int)tf->tf_a0);
+	  break;
+	case SYS_read:
+	  err = sys_read((int)tf->tf_a0,
+			 (userptr_t)tf->tf_a1,
+			 (int)tf->tf_a2,
+			 (int *)&retval);
+	  break;
+	case SYS_remove:
+	  err = sys_remove((userptr_t)tf->tf_a0);
+	  break;
+	case SYS_sbrk:
+	  err = sys_sbrk((intptr_t)tf->tf_a0, (vaddr_t *)&retval);
+	  break;
+	case SYS_mmap:
+	  /* fd and offset are on the user stack */
+	  err = sys_mmap((userptr_t)tf->tf_a0,
+			 (size_t)tf->tf_a1,
+			 (int)tf->tf_a2,
+			 (int)tf->tf_a3,
+			 (userptr_t)tf->tf_sp,
+			 (vaddr_t *)&retval);
+	  break;
+	case SYS_munmap:
+	  err = sys_munmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1);
+	  break;
+	case SYS_madvise:
+	  err = sys_madvise((userptr_t)tf->tf_a0,
+			    (size_t)tf->tf_a1,
+			    (int)tf->tf_a2);
+	  break;
+	case SYS_mincore:
+	  err = sys_mincore((userptr_t)tf->tf_a0,
+			    (size_t)tf->tf_a1,
+			    (userptr_t)tf->tf_a2);
+	  break;
+	case SYS_getrusage:
+	  err = sys_getrusage((int)tf->tf_a0, (userptr_t)tf->tf_a1);
+	  break;
+	case SYS_getrlimit:
+	  err = sys_getrlimit((int)tf->tf_a0, (userptr_t)tf->tf_a1);
+	  break;
+	case SYS_setrlimit:
+	  err = sys_setrlimit((int)tf->tf_a0, (const_userptr_t)tf->tf_a1);
+	  break;
+#endif
 #endif // UW
 
 	    /* Add stuff here */
@@ -189,7 +246,7 @@ enter_forked_process(void *data1, unsigned long data2)
 {
     (void)data2;
     struct trapframe stack_tf = *(struct trapframe *)data1;
-    kfree(data1);
+    fork_tffree(data1);
 
     stack_tf.tf_v0 = 0;
     stack_tf.tf_a3 = 0;
@@ -29,6 +29,9 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
@@ -39,6 +42,19 @@
 #include <vm.h>
 #include <limits.h>
 #include <copyinout.h>
+#include <coremap.h>
+#include <swap.h>
+#include <pagecache.h>
+#include <zeropool.h>
+#include <reclaim.h>
+#include <kmemcache.h>
+#include <synch.h>
+#include <wchan.h>
+#include <thread.h>
+#include <cpu.h>
+#include <uw-vmstats.h>
+#include <uio.h>
+#include <vnode.h>
 #include <opt-A2.h>
 #include <opt-A3.h>
 
@@ -47,137 +63,1908 @@
  * enough to struggle off the ground.
  */
 
-/* under dumbvm, always have 48k of user stack */
-#define DUMBVM_STACKPAGES    12
+/*
+ * The user stack starts out one page long and grows down on demand,
+ * up to as_stackmax pages (AS_STACKPAGES by default). It never grows
+ * to within VM_STACKGUARD pages of the region below it, so running
+ * off the end of the stack faults instead of scribbling on the heap.
+ */
+#define VM_STACKGUARD   16
+
+/*
+ * An address space's as_cpus has a bit for each cpu, by number.
+ */
+#define VM_MAXCPUS	32
+#define VM_CPUBIT(c)	((uint32_t)1 << (c)->c_number)
+
+/*
+ * Serializes every change to user page tables and regions: page-ins,
+ * eviction, copy-on-write breaks, fork and teardown. Reloading the TLB
+ * for a page that is already resident takes only the address space's
+ * as_lock, which is also held while a page table entry is rewritten.
+ *
+ * Pages are never read or written with vm_pagelock held. A page being
+ * read in,
+ * written out or copied is marked PTE_BUSY in its entry, and the lock
+ * is dropped for the I/O; anybody else who wants the page waits on
+ * vm_busycv until the bit is clear again, while faults on other pages
+ * go ahead. as_nbusy counts an address space's busy pages, so that
+ * unmapping and teardown can wait until none are. Code that calls a
+ * function that may drop the lock (vm_evict and the ones that call it)
+ * must not count on anything it looked at before: either it marks the
+ * page it is working on busy first, or it looks again afterwards.
+ *
+ * Lock order: vm_pagelock, then vfs_biglock and the filesystems' own
+ * locks (emufs's e_lock, a vnode's lock), then as_lock, then the
+ * coremap's lock. vm_pagelock does come before the filesystem locks,
+ * since dropping a vnode reference (VOP_DECREF in pagecache_free and
+ * region_destroy) can take them. So a thread holding any filesystem
+ * lock must never wait for vm_pagelock: kernel allocations don't
+ * evict (see alloc_kpages), and filesystems don't touch user memory,
+ * which could fault.
+ */
+static struct lock *vm_pagelock;
+static struct cv *vm_busycv;
+
+/*
+ * A frame of zeros, never freed. Reading a page that starts out zero
+ * maps this frame read-only instead of filling a new one; the first
+ * write gets a private frame through the copy-on-write path.
+ */
+static paddr_t vm_zeroframe;
+
+static void vm_pager_bootstrap(void);
+
+void
+vm_bootstrap(void)
+{
+	coremap_bootstrap();
+	vmstats_init();
+
+	vm_zeroframe = coremap_alloc(1);
+	if (vm_zeroframe == 0) {
+		panic("vm_bootstrap: Out of memory\n");
+	}
+	bzero((void *)PADDR_TO_KVADDR(vm_zeroframe), PAGE_SIZE);
+
+	KASSERT(cpu_count() <= VM_MAXCPUS);
+
+	vm_pagelock = lock_create("vm_pagelock");
+	vm_busycv = cv_create("vm_busy");
+	if (vm_pagelock == NULL || vm_busycv == NULL) {
+		panic("vm_bootstrap: Out of memory\n");
+	}
+	swap_bootstrap();
+	zeropool_bootstrap();
+	vm_pager_bootstrap();
+
+	/* Idle files' pages cost a read to bring back; kmalloc's don't. */
+	reclaim_register("kmalloc", kheap_reclaim, 5, 0);
+	reclaim_register("kmem_cache", kmem_cache_reclaim, 5, 0);
+	reclaim_register("pagecache", pagecache_reclaim, 10, RECLAIM_SLEEPS);
+}
+
+/* Most pages vm_evict takes at once. */
+#define VM_EVICTBATCH	8
+
+static int vm_evict(void);
+
+/*
+ * The pager thread. Kernel allocations can't evict, since whoever
+ * makes one may hold filesystem locks that paging out needs (see the
+ * lock order above), so the pager keeps some free frames on hand for
+ * them instead. It is woken when fewer than VM_PAGERLOW frames are
+ * free, and evicts until VM_PAGERHIGH are. User pages leave the last
+ * VM_PAGERLOW free frames alone for as long as evicting can keep them
+ * free (see vm_getframe).
+ */
+#define VM_PAGERLOW	16
+#define VM_PAGERHIGH	32
+
+static struct wchan *vm_pagerwchan;
+static volatile bool vm_pagerwanted;
+
+/*
+ * Wake the pager if memory is running low. Only a thread that could
+ * sleep itself wakes it, so that an allocation made in an interrupt
+ * handler, or with a spinlock held, never takes the wait channel's
+ * lock; the next allocation made elsewhere will.
+ */
+static
+void
+vm_pagerwake(void)
+{
+	if (vm_pagerwchan == NULL || vm_pagerwanted ||
+	    coremap_freeframes() >= VM_PAGERLOW ||
+	    curthread->t_in_interrupt || curthread->t_curspl != 0) {
+		return;
+	}
+	vm_pagerwanted = true;
+	wchan_wakeone(vm_pagerwchan);
+}
+
+static
+void
+vm_pager_thread(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		wchan_lock(vm_pagerwchan);
+		while (!vm_pagerwanted) {
+			wchan_sleep(vm_pagerwchan);
+			wchan_lock(vm_pagerwchan);
+		}
+		vm_pagerwanted = false;
+		wchan_unlock(vm_pagerwchan);
+
+		lock_acquire(vm_pagelock);
+		while (coremap_freeframes() < VM_PAGERHIGH) {
+			if (vm_evict()) {
+				break;
+			}
+		}
+		lock_release(vm_pagelock);
+	}
+}
+
+static
+void
+vm_pager_bootstrap(void)
+{
+	int result;
+
+	vm_pagerwchan = wchan_create("vm_pager");
+	if (vm_pagerwchan == NULL) {
+		panic("vm_bootstrap: Out of memory\n");
+	}
+	result = thread_fork("pager", NULL, vm_pager_thread, NULL, 0);
+	if (result) {
+		panic("vm_bootstrap: thread_fork: %s\n", strerror(result));
+	}
+}
+
+/*
+ * Allocate/free some kernel-space virtual pages. When memory is short
+ * only the reclaim callbacks that don't sleep are run; eviction is
+ * left to the pager, and if they free nothing the allocation fails.
+ */
+vaddr_t 
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+
+	pa = coremap_alloc(npages);
+	while (pa == 0 && reclaim_run(false) == 0) {
+		pa = coremap_alloc(npages);
+	}
+	vm_pagerwake();
+	if (pa==0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void 
+free_kpages(vaddr_t addr)
+{
+	coremap_free(KVADDR_TO_PADDR(addr));
+}
+
+/*
+ * Address space identities. Every address space gets an as_id that is
+ * never reused (0 means none), so TLB bookkeeping can name an address
+ * space without worrying that it has been freed and its memory
+ * recycled for another. The counter is 64 bits wide so that it can't
+ * wrap: at a million address spaces a second that would take over
+ * half a million years.
+ */
+static struct spinlock as_id_lock = SPINLOCK_INITIALIZER;
+static uint64_t as_next_id = 1;
+
+static
+uint64_t
+as_newid(void)
+{
+	uint64_t id;
+
+	spinlock_acquire(&as_id_lock);
+	id = as_next_id++;
+	spinlock_release(&as_id_lock);
+	KASSERT(id != 0);
+	return id;
+}
+
+/*
+ * Hardware ASIDs. Each cpu hands out ASIDs 1..NUM_ASID-1 round-robin
+ * and records which as_id owns each one. An address space keeps its
+ * ASID, and with it its TLB entries, across context switches until
+ * the cpu recycles the ASID for somebody else; only then are the old
+ * owner's entries flushed.
+ *
+ * Return the ASID C has given to address space ID, or 0 if none.
+ * Interrupts must be off.
+ */
+static
+unsigned
+vm_asid_lookup(struct cpu *c, uint64_t id)
+{
+	unsigned asid;
+
+	if (c->c_asid_owner[c->c_asid] == id) {
+		return c->c_asid;
+	}
+	for (asid=1; asid<NUM_ASID; asid++) {
+		if (c->c_asid_owner[asid] == id) {
+			return asid;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Invalidate this cpu's whole TLB, every entry tagged with ASID, or
+ * just the entry for VADDR in address space ID. Each leaves ENTRYHI
+ * holding the current ASID again.
+ */
+static
+void
+vm_tlbflush(void)
+{
+	int i, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		curcpu->c_tlb_ref[i] = false;
+	}
+	tlb_setpid(curcpu->c_asid);
+	vmstats_inc(VMSTAT_TLB_INVALIDATE);
+
+	splx(spl);
+}
+
+static
+void
+vm_tlbflush_asid(unsigned asid)
+{
+	uint32_t ehi, elo;
+	int i, spl;
+
+	spl = splhigh();
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_read(&ehi, &elo, i);
+		if ((ehi & TLBHI_PID) >> TLBHI_PIDSHIFT == asid) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+	}
+	tlb_setpid(curcpu->c_asid);
+	vmstats_inc(VMSTAT_TLB_INVALIDATE);
+
+	splx(spl);
+}
+
+static
+void
+vm_tlbinvalidate(uint64_t id, vaddr_t vaddr)
+{
+	unsigned asid;
+	int i, spl;
+
+	spl = splhigh();
+
+	if (id == 0) {
+		/* A global kseg2 entry; it matches whatever the ASID. */
+		i = tlb_probe(vaddr & PAGE_FRAME, 0);
+		if (i >= 0) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+		tlb_setpid(curcpu->c_asid);
+		splx(spl);
+		return;
+	}
+
+	asid = vm_asid_lookup(curcpu->c_self, id);
+	if (asid != 0) {
+		i = tlb_probe((vaddr & PAGE_FRAME) |
+			      (asid << TLBHI_PIDSHIFT), 0);
+		if (i >= 0) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+		tlb_setpid(curcpu->c_asid);
+	}
+
+	splx(spl);
+}
+
+void
+vm_tlbshootdown_all(void)
+{
+	vm_tlbflush();
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	vm_tlbinvalidate(ts->ts_as_id, ts->ts_vaddr);
+}
+
+/*
+ * Batched TLB shootdowns. Translations that other cpus may hold are
+ * collected in a struct vm_shootdown as page table entries change, and
+ * vm_shootdown_flush then sends each cpu that has run one of the
+ * address spaces involved (see as_cpus) the entries that concern it,
+ * in a single IPI, and waits until every one of them has acted on
+ * them. A batch of more than TLBSHOOTDOWN_MAX entries turns into a
+ * full flush on each target instead.
+ */
+struct vm_shootdown {
+	unsigned sd_count;
+	struct tlbshootdown sd_ts[TLBSHOOTDOWN_MAX];
+	uint32_t sd_cpus[TLBSHOOTDOWN_MAX];	/* as_cpus for each entry */
+	uint32_t sd_allcpus;			/* all of them together */
+};
+
+static
+void
+vm_shootdown_init(struct vm_shootdown *sd)
+{
+	sd->sd_count = 0;
+	sd->sd_allcpus = 0;
+}
+
+/*
+ * Add the translation for VADDR in AS to SD. The caller holds as_lock,
+ * and has already changed the page table entry.
+ */
+static
+void
+vm_shootdown_add(struct vm_shootdown *sd, struct addrspace *as,
+		 vaddr_t vaddr)
+{
+	KASSERT(spinlock_do_i_hold(&as->as_lock));
+
+	if (sd->sd_count < TLBSHOOTDOWN_MAX) {
+		sd->sd_ts[sd->sd_count].ts_as_id = as->as_id;
+		sd->sd_ts[sd->sd_count].ts_vaddr = vaddr;
+		sd->sd_cpus[sd->sd_count] = as->as_cpus;
+	}
+	sd->sd_count++;
+	sd->sd_allcpus |= as->as_cpus;
+}
+
+/*
+ * Add the kernel (kseg2) translation for VADDR to SD. Those are global,
+ * and any cpu may hold one; they go by an as_id of 0.
+ */
+static
+void
+vm_shootdown_addkernel(struct vm_shootdown *sd, vaddr_t vaddr)
+{
+	if (sd->sd_count < TLBSHOOTDOWN_MAX) {
+		sd->sd_ts[sd->sd_count].ts_as_id = 0;
+		sd->sd_ts[sd->sd_count].ts_vaddr = vaddr;
+		sd->sd_cpus[sd->sd_count] = ~(uint32_t)0;
+	}
+	sd->sd_count++;
+	sd->sd_allcpus = ~(uint32_t)0;
+}
+
+/*
+ * Invalidate everything in SD on this cpu and on every other cpu that
+ * may hold it, and wait until they have. No spinlocks may be held.
+ */
+static
+void
+vm_shootdown_flush(struct vm_shootdown *sd)
+{
+	struct tlbshootdown ts[TLBSHOOTDOWN_MAX];
+	unsigned tickets[VM_MAXCPUS];
+	struct cpu *self, *c;
+	unsigned i, j, n;
+	int spl;
+
+	if (sd->sd_count == 0) {
+		return;
+	}
+
+	/* Look at curcpu only with interrupts off, in case we move. */
+	spl = splhigh();
+	self = curcpu->c_self;
+	if (sd->sd_count > TLBSHOOTDOWN_MAX) {
+		vm_tlbflush();
+	}
+	else {
+		for (i=0; i<sd->sd_count; i++) {
+			vm_tlbshootdown(&sd->sd_ts[i]);
+		}
+	}
+	splx(spl);
+
+	for (i=0; i<cpu_count(); i++) {
+		c = cpu_get(i);
+		tickets[i] = 0;
+		if (c == self || !(sd->sd_allcpus & VM_CPUBIT(c))) {
+			continue;
+		}
+		if (sd->sd_count > TLBSHOOTDOWN_MAX) {
+			tickets[i] = ipi_tlbshootdown_batch(c, NULL,
+							    sd->sd_count);
+			continue;
+		}
+		n = 0;
+		for (j=0; j<sd->sd_count; j++) {
+			if (sd->sd_cpus[j] & VM_CPUBIT(c)) {
+				ts[n++] = sd->sd_ts[j];
+			}
+		}
+		tickets[i] = ipi_tlbshootdown_batch(c, ts, n);
+	}
+	for (i=0; i<cpu_count(); i++) {
+		if (tickets[i] != 0) {
+			ipi_tlbshootdown_wait(cpu_get(i), tickets[i]);
+		}
+	}
+}
+
+/*
+ * Print the shootdown counters (kernel menu "ts"). They are read
+ * without locking and may be slightly stale.
+ */
+void
+vm_tlbprintstats(void)
+{
+	struct cpu *c;
+	unsigned i;
+
+	for (i=0; i<cpu_count(); i++) {
+		c = cpu_get(i);
+		kprintf("cpu%u: %u shootdown IPIs sent; %u taken, "
+			"%u entries, %u full flushes\n",
+			c->c_number, c->c_ipi_tlbsent, c->c_ipi_tlbtaken,
+			c->c_ipi_tlbentries, c->c_ipi_tlbflushall);
+	}
+}
+
+/*
+ * Orphan every TLB entry of AS on every cpu at once, by giving it a
+ * new identity. If AS is the current address space it gets an ASID
+ * for the new identity right away.
+ */
+static
+void
+as_retire(struct addrspace *as)
+{
+	spinlock_acquire(&as->as_lock);
+	as->as_id = as_newid();
+	/* Nobody holds translations for the new identity yet. */
+	as->as_cpus = 0;
+	spinlock_release(&as->as_lock);
+	if (as == curproc_getas()) {
+		as_activate();
+	}
+}
+
+/*
+ * Return the page table entry for VADDR in AS, or NULL if the leaf
+ * table that would hold it doesn't exist yet, in which case the page
+ * has never been touched. The caller holds as_lock or vm_pagelock;
+ * leaves are never freed while the address space is in use.
+ */
+static
+uint32_t *
+as_pte(struct addrspace *as, vaddr_t vaddr)
+{
+	uint32_t *leaf;
+
+	KASSERT(vaddr < USERSPACETOP);
+
+	leaf = as->as_pgdir[PT_DIRINDEX(vaddr)];
+	if (leaf == NULL) {
+		return NULL;
+	}
+	return &leaf[PT_LEAFINDEX(vaddr)];
+}
+
+/*
+ * Like as_pte, but allocate the leaf table if there isn't one yet. The
+ * caller holds vm_pagelock, so nobody else can be installing the same
+ * leaf meanwhile. If memory is short this evicts, which may drop
+ * vm_pagelock for a while.
+ */
+static
+int
+as_pte_alloc(struct addrspace *as, vaddr_t vaddr, uint32_t **ret)
+{
+	uint32_t *leaf;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(vm_pagelock));
+
+	while (1) {
+		*ret = as_pte(as, vaddr);
+		if (*ret != NULL) {
+			return 0;
+		}
+		leaf = kmalloc(PT_NLEAF * sizeof(uint32_t));
+		if (leaf != NULL) {
+			break;
+		}
+		if (vm_evict()) {
+			return ENOMEM;
+		}
+	}
+	for (i=0; i<PT_NLEAF; i++) {
+		leaf[i] = 0;
+	}
+
+	spinlock_acquire(&as->as_lock);
+	as->as_pgdir[PT_DIRINDEX(vaddr)] = leaf;
+	spinlock_release(&as->as_lock);
+
+	*ret = &leaf[PT_LEAFINDEX(vaddr)];
+	return 0;
+}
+
+/*
+ * Find the region of AS containing VADDR, or NULL if it is not mapped.
+ */
+static
+struct region *
+as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg;
+	unsigned i, num;
+
+	num = array_num(as->as_regions);
+	for (i=0; i<num; i++) {
+		rg = array_get(as->as_regions, i);
+		if (vaddr >= rg->rg_vbase &&
+		    vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+			return rg;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+as_zero_region(paddr_t paddr, unsigned npages)
+{
+	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
+}
+
+/*
+ * Count pages of AS becoming resident (DELTA > 0) or going away. The
+ * zero frame isn't counted, since mapping it costs nothing. The caller
+ * holds as_lock.
+ */
+static
+void
+as_rssadjust(struct addrspace *as, int delta)
+{
+	KASSERT(spinlock_do_i_hold(&as->as_lock));
+
+	as->as_rss += delta;
+	if (as->as_rss > as->as_maxrss) {
+		as->as_maxrss = as->as_rss;
+	}
+}
+
+/*
+ * Busy pages (see vm_pagelock). vm_setbusy marks the entry PTEP of AS
+ * busy; vm_unbusy replaces it with PTE, adjusting AS's resident size
+ * by RSSDELTA, and wakes whoever is waiting for it. vm_busywait waits
+ * until the entry PTEP is not busy, and vm_idlewait until no page of
+ * AS is. All are called with vm_pagelock held; the waits drop it while
+ * they sleep.
+ */
+static
+void
+vm_setbusy(struct addrspace *as, uint32_t *ptep)
+{
+	KASSERT(lock_do_i_hold(vm_pagelock));
+
+	spinlock_acquire(&as->as_lock);
+	KASSERT(!(*ptep & PTE_BUSY));
+	*ptep |= PTE_BUSY;
+	spinlock_release(&as->as_lock);
+	as->as_nbusy++;
+}
+
+static
+void
+vm_unbusy(struct addrspace *as, uint32_t *ptep, uint32_t pte, int rssdelta)
+{
+	KASSERT(lock_do_i_hold(vm_pagelock));
+	KASSERT(!(pte & PTE_BUSY));
+
+	spinlock_acquire(&as->as_lock);
+	KASSERT(*ptep & PTE_BUSY);
+	*ptep = pte;
+	if (rssdelta != 0) {
+		as_rssadjust(as, rssdelta);
+	}
+	spinlock_release(&as->as_lock);
+	KASSERT(as->as_nbusy > 0);
+	as->as_nbusy--;
+	cv_broadcast(vm_busycv, vm_pagelock);
+}
+
+static
+void
+vm_busywait(uint32_t *ptep)
+{
+	KASSERT(lock_do_i_hold(vm_pagelock));
+
+	while (*ptep & PTE_BUSY) {
+		cv_wait(vm_busycv, vm_pagelock);
+	}
+}
+
+static
+void
+vm_idlewait(struct addrspace *as)
+{
+	KASSERT(lock_do_i_hold(vm_pagelock));
+
+	while (as->as_nbusy > 0) {
+		cv_wait(vm_busycv, vm_pagelock);
+	}
+}
+
+/*
+ * A page chosen for eviction. The caller fills in AS, VADDR and PADDR,
+ * and PCFILE and OFFSET if the page is the page cache's own frame for
+ * OFFSET in PCFILE (and not a private copy of it).
+ */
+struct vm_victim {
+	struct addrspace *as;
+	vaddr_t vaddr;
+	paddr_t paddr;
+	struct pcfile *pcfile;
+	off_t offset;
+	uint32_t oldpte;
+	unsigned slot;
+	int result;
+};
+
+/*
+ * Unmap the N pages in V and drop their references to their frames.
+ * A private page is pushed out to swap first. A page cache page is
+ * just unmapped, since the file has it; if it was written through a
+ * shared mapping it is written back first. Either way the pages are
+ * all unmapped, and their translations shot down on every cpu in one
+ * round, before any is written, so their owners can't change them
+ * under us. The pages being written are left busy, and vm_pagelock is
+ * dropped while they are written; an owner that touches one meanwhile
+ * waits for the write and then reads it back in. Pages that can't be
+ * written out are mapped again and handed back to the coremap's
+ * clock, which forgot their owners when it picked them. A frame is
+ * only freed with its last reference, which for a page cache page is
+ * the cache's (see pagecache_reclaim). Returns 0 if at least one page
+ * was unmapped. The caller holds vm_pagelock.
+ */
+static
+int
+vm_pageout(struct vm_victim *v, unsigned n)
+{
+	struct vm_shootdown sd;
+	struct addrspace *as;
+	uint32_t *pte;
+	unsigned i, nout, nio, ndone;
+	int result, ret;
+
+	KASSERT(lock_do_i_hold(vm_pagelock));
+
+	ret = ENOMEM;
+	nio = 0;
+	vm_shootdown_init(&sd);
+	for (nout=0; nout<n; nout++) {
+		if (v[nout].pcfile == NULL) {
+			result = swap_alloc(&v[nout].slot);
+			if (result) {
+				ret = result;
+				break;
+			}
+		}
+
+		as = v[nout].as;
+		spinlock_acquire(&as->as_lock);
+		pte = as_pte(as, v[nout].vaddr);
+		KASSERT(pte != NULL && (*pte & PTE_VALID));
+		KASSERT(PTE_FRAME(*pte) == v[nout].paddr);
+		KASSERT(!(*pte & PTE_BUSY));
+		v[nout].oldpte = *pte;
+		if (v[nout].pcfile == NULL) {
+			KASSERT(!(*pte & PTE_DIRTY));
+			*pte = PTE_MKSLOT(v[nout].slot) | (*pte & PTE_ATTRS) |
+				PTE_BUSY;
+		}
+		else if (*pte & PTE_DIRTY) {
+			/* Nothing may read it back before it is written. */
+			*pte = PTE_BUSY;
+		}
+		else {
+			/* The next touch finds it in the cache again. */
+			*pte = 0;
+		}
+		if (*pte & PTE_BUSY) {
+			as->as_nbusy++;
+			nio++;
+		}
+		as_rssadjust(as, -1);
+		vm_shootdown_add(&sd, as, v[nout].vaddr);
+		spinlock_release(&as->as_lock);
+	}
+	vm_shootdown_flush(&sd);
+
+	/* Out of swap: the rest stay where they are. */
+	for (i=nout; i<n; i++) {
+		coremap_claim(v[i].paddr, v[i].as, v[i].vaddr);
+	}
+
+	/*
+	 * Clean page cache pages are done with. The others' address
+	 * spaces can't go away while their pages are busy, but these
+	 * ones' can once vm_pagelock is dropped.
+	 */
+	ndone = 0;
+	for (i=0; i<nout; i++) {
+		if (v[i].pcfile != NULL && !(v[i].oldpte & PTE_DIRTY)) {
+			coremap_decref(v[i].paddr);
+			v[i].as = NULL;
+			ndone++;
+		}
+	}
+
+	if (nio > 0) {
+		lock_release(vm_pagelock);
+	}
+	for (i=0; i<nout; i++) {
+		if (v[i].as == NULL) {
+			continue;
+		}
+		if (v[i].pcfile == NULL) {
+			v[i].result = swap_pageout(v[i].paddr, v[i].slot);
+		}
+		else {
+			v[i].result = pagecache_writeback(v[i].pcfile,
+							  v[i].offset,
+							  v[i].paddr);
+		}
+	}
+	if (nio > 0) {
+		lock_acquire(vm_pagelock);
+	}
+
+	for (i=0; i<nout; i++) {
+		as = v[i].as;
+		if (as == NULL) {
+			continue;
+		}
+		pte = as_pte(as, v[i].vaddr);
+		if (v[i].result) {
+			vm_unbusy(as, pte, v[i].oldpte, 1);
+			if (v[i].pcfile == NULL) {
+				swap_free(v[i].slot);
+			}
+			coremap_claim(v[i].paddr, v[i].as, v[i].vaddr);
+			ret = v[i].result;
+			continue;
+		}
+		if (v[i].pcfile == NULL) {
+			vm_unbusy(as, pte, PTE_MKSLOT(v[i].slot) |
+				  (v[i].oldpte & PTE_ATTRS), 0);
+		}
+		else {
+			vm_unbusy(as, pte, 0, 0);
+		}
+		coremap_decref(v[i].paddr);
+		ndone++;
+	}
+	return ndone > 0 ? 0 : ret;
+}
+
+/*
+ * Drop mappings of shared frames, which the coremap's clock passes
+ * over because it only knows one owner per frame. This is a clock of
+ * its own over the page tables of every address space (vm_aslist),
+ * which passes over pages with PTE_REFERENCED set, clearing it, and
+ * collects up to VM_EVICTBATCH mappings of frames with more than one
+ * reference for vm_pageout: copy-on-write frames still shared after
+ * fork, which each mapping gives up by swapping out a copy of its own,
+ * and page cache frames behind mapped files and program text, which
+ * each mapping gives up by just unmapping them. A frame is freed when
+ * its last mapping goes (for page cache frames, by pagecache_reclaim
+ * once only the cache holds them).
+ *
+ * A private frame that is down to one mapping by then has no owner
+ * for the clock to find it by, since its owner was cleared when it
+ * became shared. Such frames are given back to the clock as they are
+ * passed. This is only called once the clock has found nothing to
+ * take, so no frame the clock is working on can be among them.
+ *
+ * Pages marked PTE_BUSY are left alone, as are pages as_munmap has
+ * already taken out of their address space's regions. Returns 0 if at
+ * least one mapping was dropped. The caller holds vm_pagelock, which
+ * may be dropped meanwhile (see vm_pageout).
+ */
+static struct addrspace *vm_aslist;	/* every address space */
+static struct addrspace *vm_sharedhand_as;	/* where the clock is */
+static vaddr_t vm_sharedhand_va;
+
+static
+int
+vm_evict_shared(void)
+{
+	struct vm_victim victims[VM_EVICTBATCH];
+	struct addrspace *as;
+	struct region *rg;
+	uint32_t *leaf, *ptep, pte;
+	paddr_t paddr;
+	off_t offset;
+	vaddr_t va;
+	unsigned n, wraps;
+
+	KASSERT(lock_do_i_hold(vm_pagelock));
+
+	/*
+	 * Wherever the hand starts, it has made two full rounds by the
+	 * third time it runs off the end of the list. The first round
+	 * may only clear reference bits.
+	 */
+	n = 0;
+	wraps = 0;
+	as = vm_sharedhand_as;
+	va = vm_sharedhand_va;
+	while (n < VM_EVICTBATCH) {
+		if (as == NULL) {
+			if (++wraps == 3 || vm_aslist == NULL) {
+				break;
+			}
+			as = vm_aslist;
+			va = 0;
+		}
+		if (va >= USERSPACETOP) {
+			as = as->as_next;
+			va = 0;
+			continue;
+		}
+		leaf = as->as_pgdir[PT_DIRINDEX(va)];
+		if (leaf == NULL) {
+			/* Skip the rest of this 4M. */
+			va = (vaddr_t)(PT_DIRINDEX(va) + 1) << 22;
+			continue;
+		}
+		ptep = &leaf[PT_LEAFINDEX(va)];
+		va += PAGE_SIZE;
+
+		pte = *ptep;
+		if (!(pte & PTE_VALID) || (pte & PTE_BUSY) ||
+		    PTE_FRAME(pte) == vm_zeroframe) {
+			continue;
+		}
+		paddr = PTE_FRAME(pte);
+		if (coremap_refcount(paddr) == 1) {
+			coremap_claim(paddr, as, va - PAGE_SIZE);
+			continue;
+		}
+		if (pte & PTE_REFERENCED) {
+			spinlock_acquire(&as->as_lock);
+			*ptep &= ~PTE_REFERENCED;
+			spinlock_release(&as->as_lock);
+			continue;
+		}
+
+		rg = as_find_region(as, va - PAGE_SIZE);
+		if (rg == NULL) {
+			continue;
+		}
+		victims[n].pcfile = NULL;
+		victims[n].offset = 0;
+		if (rg->rg_pcfile != NULL) {
+			offset = rg->rg_pcoffset +
+				(off_t)(va - PAGE_SIZE - rg->rg_vbase);
+			if (pagecache_peek(rg->rg_pcfile, offset) == paddr) {
+				victims[n].pcfile = rg->rg_pcfile;
+				victims[n].offset = offset;
+			}
+		}
+		if (victims[n].pcfile == NULL && !swap_enabled()) {
+			/* Nowhere to put a copy. */
+			continue;
+		}
+		victims[n].as = as;
+		victims[n].vaddr = va - PAGE_SIZE;
+		victims[n].paddr = paddr;
+		n++;
+	}
+	vm_sharedhand_as = as;
+	vm_sharedhand_va = va;
+
+	if (n == 0) {
+		return ENOMEM;
+	}
+	return vm_pageout(victims, n);
+}
+
+/*
+ * Free some memory. The reclaim callbacks go first, since what they
+ * hold (the zero pool, idle cached files, cached pages nobody maps)
+ * costs no I/O to drop. Otherwise push up to VM_EVICTBATCH pages,
+ * chosen by the coremap's clock, out to swap, or if it finds none,
+ * drop mappings of shared pages. The caller holds vm_pagelock, which
+ * may be dropped meanwhile (see vm_pageout).
+ */
+static
+int
+vm_evict(void)
+{
+	struct vm_victim victims[VM_EVICTBATCH];
+	unsigned n;
+
+	KASSERT(lock_do_i_hold(vm_pagelock));
+
+	if (reclaim_run(true) == 0) {
+		return 0;
+	}
+
+	n = 0;
+	if (swap_enabled()) {
+		for (; n<VM_EVICTBATCH; n++) {
+			victims[n].paddr = coremap_victim(&victims[n].as,
+							  &victims[n].vaddr);
+			if (victims[n].paddr == 0) {
+				break;
+			}
+			victims[n].pcfile = NULL;
+		}
+	}
+	if (n == 0) {
+		return vm_evict_shared();
+	}
+	return vm_pageout(victims, n);
+}
+
+/*
+ * Push one of AS's own pages out to swap, for a process at its RSS
+ * limit. A clock over its page table picks the victim, passing over
+ * pages with PTE_REFERENCED set and clearing it. Only pages nobody
+ * else maps are taken: shared mappings, and frames still shared after
+ * fork, are left to vm_evict. The clock gives up after looking at
+ * twice as many resident pages as the process has (the first time
+ * round may only clear reference bits), so as_lock isn't held for a
+ * walk of the whole page table. The caller holds vm_pagelock, which
+ * may be dropped meanwhile (see vm_pageout).
+ */
+static
+int
+vm_evict_own(struct addrspace *as)
+{
+	struct vm_victim v;
+	uint32_t *leaf, pte = 0;
+	unsigned hand, total, n;
+	size_t nvalid, limit;
+	bool found;
+
+	KASSERT(lock_do_i_hold(vm_pagelock));
+
+	if (!swap_enabled()) {
+		return ENOMEM;
+	}
+
+	total = PT_NDIR * PT_NLEAF;
+	hand = as->as_rsshand % total;
+	found = false;
+	nvalid = 0;
+	spinlock_acquire(&as->as_lock);
+	limit = 2 * as->as_rss;
+	for (n=0; n<2*total && nvalid<limit; n++, hand = (hand + 1) % total) {
+		leaf = as->as_pgdir[hand / PT_NLEAF];
+		if (leaf == NULL) {
+			/* Skip the rest of this 4M. */
+			n += PT_NLEAF - 1 - hand % PT_NLEAF;
+			hand += PT_NLEAF - 1 - hand % PT_NLEAF;
+			continue;
+		}
+		pte = leaf[hand % PT_NLEAF];
+		if (!(pte & PTE_VALID)) {
+			continue;
+		}
+		nvalid++;
+		if ((pte & (PTE_SHARED | PTE_BUSY)) ||
+		    coremap_refcount(PTE_FRAME(pte)) > 1) {
+			continue;
+		}
+		if (pte & PTE_REFERENCED) {
+			leaf[hand % PT_NLEAF] = pte & ~PTE_REFERENCED;
+			continue;
+		}
+		found = true;
+		break;
+	}
+	spinlock_release(&as->as_lock);
+
+	if (!found) {
+		as->as_rsshand = hand;
+		return ENOMEM;
+	}
+	as->as_rsshand = (hand + 1) % total;
+
+	v.as = as;
+	v.vaddr = (vaddr_t)hand * PAGE_SIZE;
+	v.paddr = PTE_FRAME(pte);
+	v.pcfile = NULL;
+	return vm_pageout(&v, 1);
+}
+
+/*
+ * Called before AS gets a new private frame. A process at its RSS
+ * limit first gives up one of its own pages; if it has nothing it can
+ * give up, it takes the frame anyway. Mapping the zero frame or a page
+ * cache page takes no private frame, so doesn't come here. The caller
+ * holds vm_pagelock, which may be dropped meanwhile.
+ */
+static
+void
+vm_rsscheck(struct addrspace *as)
+{
+	if (as->as_rss >= as->as_rsslimit) {
+		(void)vm_evict_own(as);
+	}
+}
+
+/*
+ * Allocate a frame for a user page, evicting other pages if memory is
+ * full. Once it is down to the pager's reserve for kernel allocations
+ * a batch is evicted first, so that user pages only eat into the
+ * reserve when there is nothing left to evict. The caller holds
+ * vm_pagelock, which may be dropped meanwhile.
+ */
+static
+paddr_t
+vm_getframe(void)
+{
+	paddr_t paddr;
+
+	KASSERT(lock_do_i_hold(vm_pagelock));
+
+	if (coremap_freeframes() < VM_PAGERLOW) {
+		(void)vm_evict();
+	}
+	paddr = coremap_alloc(1);
+	while (paddr == 0) {
+		if (vm_evict()) {
+			return 0;
+		}
+		paddr = coremap_alloc(1);
+	}
+	return paddr;
+}
+
+/*
+ * Allocate a frame of zeros for a user page: one the zeroing thread
+ * has cleared already if there is one, or else a frame cleared here.
+ * The caller holds vm_pagelock, which may be dropped meanwhile.
+ */
+static
+paddr_t
+vm_getzeroframe(void)
+{
+	paddr_t paddr;
+
+	paddr = zeropool_alloc();
+	if (paddr == 0) {
+		paddr = vm_getframe();
+		if (paddr != 0) {
+			as_zero_region(paddr, 1);
+		}
+	}
+	return paddr;
+}
+
+/*
+ * TLB replacement policies, chosen with vm_set_tlbpolicy (kernel menu
+ * "tlbpolicy", which can be given on the sys161 command line).
+ *
+ *    random - let the processor pick a slot (tlbwr).
+ *    rr     - round-robin over the slots.
+ *    lru    - clock approximation of LRU. The hand passes over slots
+ *             whose reference bit is set, clearing the bit and the
+ *             entry's valid bit. An entry that is used again after that
+ *             takes a cheap fault that just revalidates it and sets the
+ *             bit again; the first slot found with the bit clear is the
+ *             victim.
+ */
+#define TLBPOLICY_RANDOM 0
+#define TLBPOLICY_RR     1
+#define TLBPOLICY_LRU    2
+
+static int vm_tlbpolicy = TLBPOLICY_RR;
+
+int
+vm_set_tlbpolicy(const char *name)
+{
+	if (!strcmp(name, "random")) {
+		vm_tlbpolicy = TLBPOLICY_RANDOM;
+	}
+	else if (!strcmp(name, "rr")) {
+		vm_tlbpolicy = TLBPOLICY_RR;
+	}
+	else if (!strcmp(name, "lru")) {
+		vm_tlbpolicy = TLBPOLICY_LRU;
+	}
+	else {
+		return EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Choose a slot to replace under the rr or lru policy. Interrupts
+ * must be off.
+ */
+static
+int
+tlb_victim(struct cpu *c)
+{
+	uint32_t ehi, elo;
+	int i;
+
+	while (1) {
+		i = c->c_tlb_hand;
+		c->c_tlb_hand = (c->c_tlb_hand + 1) % NUM_TLB;
+		if (vm_tlbpolicy != TLBPOLICY_LRU || !c->c_tlb_ref[i]) {
+			return i;
+		}
+		c->c_tlb_ref[i] = false;
+		tlb_read(&ehi, &elo, i);
+		tlb_write(ehi, elo & ~TLBLO_VALID, i);
+	}
+}
+
+/*
+ * Load a translation into the TLB. If the page is already mapped (as
+ * it is when a read-only entry is being upgraded, or an entry the
+ * clock invalidated is used again) the existing slot is reused, since
+ * the TLB must never hold two entries for the same virtual page and
+ * ASID. Otherwise a free slot is used if there is one, and the
+ * replacement policy picks a victim if not. Interrupts must be off.
+ *
+ * A PREFETCH entry (see vm_faultaround) is not a fault and isn't
+ * counted as one. It is left alone if the page is already mapped, and
+ * to the lru policy it starts out unreferenced, so a prefetch that is
+ * never used is the first thing to go.
+ */
+static
+void
+tlb_install(uint32_t ehi, uint32_t elo, bool prefetch)
+{
+	struct cpu *c = curcpu->c_self;
+	uint32_t oldehi, oldelo;
+	int i;
+
+	i = tlb_probe(ehi, 0);
+	if (i >= 0 && prefetch) {
+		return;
+	}
+	if (i < 0) {
+		for (i=0; i<NUM_TLB; i++) {
+			tlb_read(&oldehi, &oldelo, i);
+			if (!(oldelo & TLBLO_VALID)) {
+				break;
+			}
+		}
+	}
+
+	if (i < NUM_TLB) {
+		if (!prefetch) {
+			vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+		}
+	}
+	else {
+		if (!prefetch) {
+			vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+		}
+		if (vm_tlbpolicy == TLBPOLICY_RANDOM) {
+			tlb_random(ehi, elo);
+			return;
+		}
+		i = tlb_victim(c);
+	}
+	tlb_write(ehi, elo, i);
+	c->c_tlb_ref[i] = !prefetch;
+}
+
+/*
+ * Mapped kernel memory (kvmalloc).
+ *
+ * alloc_kvpages gives out pages that are contiguous in kseg2, which
+ * unlike kseg0 goes through the TLB, backed by frames from anywhere,
+ * so big kernel buffers needn't wait for a run of free frames.
+ * kva_map has an entry for each page of the KVA_NPAGES-page arena at
+ * the bottom of kseg2: 0 if the page is free, KVA_BUSY while it is
+ * being set up or torn down, and once mapped its frame with KVA_VALID,
+ * plus KVA_LAST on the last page of an allocation. vm_kvfault reads it
+ * without locking, from whatever context took the fault, and loads
+ * global TLB entries, which match any ASID. kva_lock covers claiming
+ * and releasing pages of the arena, and the counters.
+ */
+#define KVA_BASE	MIPS_KSEG2
+#define KVA_NPAGES	1024		/* 4M of kseg2 */
+#define KVA_VALID	0x1
+#define KVA_LAST	0x2
+#define KVA_BUSY	0x4
+#define KVA_FRAME(e)	((e) & PAGE_FRAME)
+
+static uint32_t kva_map[KVA_NPAGES];
+static struct spinlock kva_lock = SPINLOCK_INITIALIZER;
+static unsigned kva_npages;		/* pages allocated */
+static unsigned kva_nallocs;		/* allocations */
+static unsigned kva_failed;		/* allocations that failed */
+
+/* Give back the first NMAPPED frames of a failed allocation at START. */
+static
+void
+kva_undo(unsigned start, unsigned npages, unsigned nmapped)
+{
+	unsigned i;
+
+	/* The address was never handed out, so no TLB can have it. */
+	for (i=0; i<nmapped; i++) {
+		free_kpages(PADDR_TO_KVADDR(KVA_FRAME(kva_map[start + i])));
+	}
+	spinlock_acquire(&kva_lock);
+	for (i=0; i<npages; i++) {
+		kva_map[start + i] = 0;
+	}
+	kva_failed++;
+	spinlock_release(&kva_lock);
+}
+
+vaddr_t
+alloc_kvpages(unsigned npages)
+{
+	unsigned i, start, run;
+	vaddr_t va;
+
+	KASSERT(npages > 0);
+
+	/* First fit. */
+	spinlock_acquire(&kva_lock);
+	run = 0;
+	for (i=0; i<KVA_NPAGES && run < npages; i++) {
+		run = (kva_map[i] == 0) ? run + 1 : 0;
+	}
+	if (run < npages) {
+		kva_failed++;
+		spinlock_release(&kva_lock);
+		return 0;
+	}
+	start = i - npages;
+	for (i=start; i<start + npages; i++) {
+		kva_map[i] = KVA_BUSY;
+	}
+	spinlock_release(&kva_lock);
+
+	for (i=0; i<npages; i++) {
+		va = alloc_kpages(1);
+		if (va == 0) {
+			kva_undo(start, npages, i);
+			return 0;
+		}
+		kva_map[start + i] = KVADDR_TO_PADDR(va) | KVA_VALID |
+			(i == npages - 1 ? KVA_LAST : 0);
+	}
+
+	spinlock_acquire(&kva_lock);
+	kva_npages += npages;
+	kva_nallocs++;
+	spinlock_release(&kva_lock);
+
+	return KVA_BASE + start * PAGE_SIZE;
+}
+
+/*
+ * Free an allocation from alloc_kvpages. The pages are unmapped first,
+ * so no cpu can load them again, then shot down everywhere, and only
+ * then are the frames given back. No spinlocks may be held.
+ */
+void
+free_kvpages(vaddr_t addr)
+{
+	struct vm_shootdown sd;
+	unsigned i, start, end;
+	uint32_t e;
+
+	KASSERT(addr >= KVA_BASE && addr % PAGE_SIZE == 0);
+	start = (addr - KVA_BASE) / PAGE_SIZE;
+	KASSERT(start < KVA_NPAGES);
+
+	vm_shootdown_init(&sd);
+	for (i=start; ; i++) {
+		KASSERT(i < KVA_NPAGES);
+		e = kva_map[i];
+		if (!(e & KVA_VALID)) {
+			panic("kvfree: %p is not a kvmalloc block\n",
+			      (void *)(KVA_BASE + i * PAGE_SIZE));
+		}
+		kva_map[i] = KVA_FRAME(e) | KVA_BUSY;
+		vm_shootdown_addkernel(&sd, KVA_BASE + i * PAGE_SIZE);
+		if (e & KVA_LAST) {
+			break;
+		}
+	}
+	end = i + 1;
+	vm_shootdown_flush(&sd);
+
+	for (i=start; i<end; i++) {
+		free_kpages(PADDR_TO_KVADDR(KVA_FRAME(kva_map[i])));
+	}
+	spinlock_acquire(&kva_lock);
+	for (i=start; i<end; i++) {
+		kva_map[i] = 0;
+	}
+	kva_npages -= end - start;
+	kva_nallocs--;
+	spinlock_release(&kva_lock);
+}
+
+/*
+ * Print how much of the arena is in use (kernel menu "kh"). The
+ * counters are read without locking.
+ */
+void
+kvpages_printstats(void)
+{
+	kprintf("Mapped (kvmalloc) memory: %u pages in %u blocks, "
+		"of %u; %u failed\n", kva_npages, kva_nallocs,
+		KVA_NPAGES, kva_failed);
+}
+
+/*
+ * Load the translation for a TLB miss at VADDR in kseg2.
+ */
+static
+int
+vm_kvfault(int faulttype, vaddr_t vaddr)
+{
+	uint32_t e, ehi, elo;
+	int spl;
+
+	if (faulttype == VM_FAULT_READONLY ||
+	    vaddr >= KVA_BASE + KVA_NPAGES * PAGE_SIZE) {
+		return EFAULT;
+	}
+	e = kva_map[(vaddr - KVA_BASE) / PAGE_SIZE];
+	if (!(e & KVA_VALID)) {
+		return EFAULT;
+	}
+
+	vmstats_inc(VMSTAT_TLB_FAULT);
+	vmstats_inc(VMSTAT_TLB_RELOAD);
+
+	spl = splhigh();
+	ehi = vaddr | (curcpu->c_asid << TLBHI_PIDSHIFT);
+	elo = KVA_FRAME(e) | TLBLO_VALID | TLBLO_DIRTY | TLBLO_GLOBAL;
+	tlb_install(ehi, elo, false);
+	splx(spl);
+
+	return 0;
+}
+
+/*
+ * Map the resident page at VADDR in the TLB, going by nothing but its
+ * page table entry. Frames shared with another address space are
+ * mapped read-only so that the first write comes back here as
+ * VM_FAULT_READONLY and gets a private copy. In a MAP_SHARED region the
+ * frame is the page cache's own, and it is mapped read-only until the
+ * first write marks it dirty. The caller holds as_lock, which keeps the
+ * page from being evicted until the entry is in. A PREFETCH load
+ * doesn't count as a use of the page.
+ */
+static
+void
+vm_tlbload(struct addrspace *as, vaddr_t vaddr, bool prefetch)
+{
+	uint32_t *pte;
+	paddr_t paddr;
+	uint32_t ehi, elo;
+	bool writeable;
+
+	KASSERT(spinlock_do_i_hold(&as->as_lock));
+	KASSERT(curcpu->c_asid_owner[curcpu->c_asid] == as->as_id);
+
+	pte = as_pte(as, vaddr);
+	KASSERT(pte != NULL && (*pte & PTE_VALID));
+
+	paddr = PTE_FRAME(*pte);
+	writeable = (*pte & PTE_WRITE) || !as->elf_finished;
+	if (*pte & PTE_SHARED) {
+		writeable = writeable && (*pte & PTE_DIRTY);
+	}
+	else if (writeable && coremap_refcount(paddr) > 1) {
+		writeable = false;
+	}
+	if (!prefetch) {
+		coremap_claim(paddr, as, vaddr);
+		*pte |= PTE_REFERENCED;
+	}
+
+	ehi = vaddr | (curcpu->c_asid << TLBHI_PIDSHIFT);
+	elo = paddr | TLBLO_VALID;
+	if (writeable) {
+		elo |= TLBLO_DIRTY;
+	}
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", vaddr, paddr);
+	tlb_install(ehi, elo, prefetch);
+}
+
+/*
+ * Fault-around, turned on with vm_set_faultaround (kernel menu
+ * "faultaround"). After a TLB miss at VADDR, the pages that follow it
+ * are loaded into the TLB too, up to the first one that isn't resident,
+ * so a sequential scan takes one miss per window instead of one per
+ * page. Nothing is paged in.
+ *
+ * The window adapts per address space. If the next miss is on the page
+ * just past the previous window, the program walked through it and the
+ * window doubles, up to VM_FAMAX pages. Any other miss means the
+ * prefetched entries were wasted or evicted unused, and it halves,
+ * down to VM_FAMIN.
+ *
+ * madvise overrides this per region, through the advice bits in the
+ * faulting page's entry. MADV_RANDOM turns fault-around off.
+ * MADV_SEQUENTIAL always uses the largest window, whether or not
+ * fault-around is on, and marks the window of pages behind the miss
+ * unreferenced, so the clock evicts what the scan has finished with
+ * before anything else. The caller holds as_lock, and loads the
+ * faulting page itself afterwards so that no prefetch can push it out.
+ */
+#define VM_FAMIN	1
+#define VM_FAMAX	8
+
+static bool vm_faultaround_on = false;
+
+void
+vm_set_faultaround(bool on)
+{
+	vm_faultaround_on = on;
+}
+
+static
+void
+vm_faultaround(struct addrspace *as, vaddr_t vaddr)
+{
+	const uint32_t seq = PTE_VALID | PTE_SEQUENTIAL;
+	uint32_t *pte;
+	vaddr_t va;
+	unsigned i, window;
+
+	KASSERT(spinlock_do_i_hold(&as->as_lock));
+
+	pte = as_pte(as, vaddr);
+	if (*pte & PTE_SEQUENTIAL) {
+		window = VM_FAMAX;
+		for (i=1; i<=VM_FAMAX && i * PAGE_SIZE <= vaddr; i++) {
+			pte = as_pte(as, vaddr - i * PAGE_SIZE);
+			if (pte != NULL && (*pte & seq) == seq) {
+				coremap_unreference(PTE_FRAME(*pte));
+			}
+		}
+	}
+	else if ((*pte & PTE_RANDOM) || !vm_faultaround_on) {
+		return;
+	}
+	else {
+		if (as->as_fa_end != 0) {
+			if (vaddr == as->as_fa_end) {
+				if (as->as_fa_window < VM_FAMAX) {
+					as->as_fa_window *= 2;
+				}
+			}
+			else if (as->as_fa_window > VM_FAMIN) {
+				as->as_fa_window /= 2;
+			}
+		}
+		window = as->as_fa_window;
+	}
+
+	for (i=1; i<=window; i++) {
+		va = vaddr + i * PAGE_SIZE;
+		if (va >= USERSPACETOP) {
+			break;
+		}
+		pte = as_pte(as, va);
+		if (pte == NULL || !(*pte & PTE_VALID)) {
+			break;
+		}
+		vm_tlbload(as, va, true);
+	}
+	as->as_fa_end = (i > 1) ? vaddr + i * PAGE_SIZE : 0;
+}
 
 /*
- * Wrap rma_stealmem in a spinlock.
+ * Give AS a private copy of the copy-on-write frame that PTE maps. If
+ * every other sharer has already broken away the frame is simply kept.
+ * The page is busy while a frame is found for the copy, so that
+ * evicting to make room can't take the page being copied. The caller
+ * holds vm_pagelock, which may be dropped meanwhile.
  */
-static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
-static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
-paddr_t start, end;
-bool coremap_initialized = false;
-int *coremap = NULL;
-int num_frames = 0;
+static
+int
+vm_cow_break(struct addrspace *as, uint32_t *pte)
+{
+	paddr_t oldpa, newpa;
+
+	oldpa = PTE_FRAME(*pte);
+	if (coremap_refcount(oldpa) == 1) {
+		return 0;
+	}
+
+	vm_setbusy(as, pte);
+	if (oldpa == vm_zeroframe) {
+		/* The only case where the process gets bigger. */
+		vm_rsscheck(as);
+		newpa = vm_getzeroframe();
+	}
+	else {
+		newpa = vm_getframe();
+		if (newpa != 0) {
+			memmove((void *)PADDR_TO_KVADDR(newpa),
+				(const void *)PADDR_TO_KVADDR(oldpa),
+				PAGE_SIZE);
+		}
+	}
+
+	if (newpa == 0) {
+		vm_unbusy(as, pte, *pte & ~PTE_BUSY, 0);
+		return ENOMEM;
+	}
+	vm_unbusy(as, pte,
+		  PTE_MKFRAME(newpa) | (*pte & ~(PAGE_FRAME | PTE_BUSY)),
+		  oldpa == vm_zeroframe ? 1 : 0);
+	coremap_decref(oldpa);
+	return 0;
+}
 
+/*
+ * Find the part [*START, *END) of page PAGENO of RG that the executable
+ * supplies. Returns false if none of it does, so the page starts out
+ * all zeros.
+ */
 static
-paddr_t
-getppages(unsigned long npages)
+bool
+vm_filerange(struct region *rg, unsigned pageno, vaddr_t *start,
+	     vaddr_t *end)
 {
-	paddr_t addr;
+	vaddr_t pagestart;
 
-	spinlock_acquire(&stealmem_lock);
+	pagestart = rg->rg_vbase + pageno * PAGE_SIZE;
+	*start = pagestart;
+	if (*start < rg->rg_filevaddr) {
+		*start = rg->rg_filevaddr;
+	}
+	*end = pagestart + PAGE_SIZE;
+	if (*end > rg->rg_filevaddr + rg->rg_filesize) {
+		*end = rg->rg_filevaddr + rg->rg_filesize;
+	}
+	return rg->rg_vnode != NULL && *start < *end;
+}
 
-    if (coremap_initialized) {
-        spinlock_acquire(&coremap_lock);
-        unsigned long section = 0;
-        int section_begin = -1;
-        for (int i = 0; i < num_frames; ++i) {
-            if (coremap[i] == 0) {
-                section += 1;
-            } else {
-                section = 0;
-            }
-            if (section == npages) {
-                section_begin = i-npages+1;
-                break;
-            }
-        }
-        if (section_begin == -1) {
-            kprintf("Cannot find a size %d contiguous segment\n", (int)npages);
-            return 0;
-        } else {
-            addr = start+(section_begin * PAGE_SIZE);
-            for(unsigned long i = 0; i < npages; ++i) {
-                coremap[section_begin+i] = i+1;
-            }
-        }
-        spinlock_release(&coremap_lock);
-    } else {
-        addr = ram_stealmem(npages);
-    }
-	
-	spinlock_release(&stealmem_lock);
-	return addr;
+/*
+ * Fill the frame at PADDR with the initial contents of page PAGENO of
+ * RG, at least part of which the executable supplies: that part from
+ * the file, and zeros around it.
+ */
+static
+int
+vm_readfile(struct region *rg, unsigned pageno, paddr_t paddr)
+{
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t kva, pagestart, start, end;
+	bool fromfile;
+	int result;
+
+	pagestart = rg->rg_vbase + pageno * PAGE_SIZE;
+	fromfile = vm_filerange(rg, pageno, &start, &end);
+	KASSERT(fromfile);
+
+	kva = PADDR_TO_KVADDR(paddr);
+	bzero((void *)kva, start - pagestart);
+	bzero((void *)(kva + (end - pagestart)), pagestart + PAGE_SIZE - end);
+
+	uio_kinit(&iov, &ku,
+		  (void *)(kva + (start - pagestart)),
+		  end - start,
+		  rg->rg_fileoffset + (start - rg->rg_filevaddr), UIO_READ);
+	result = VOP_READ(rg->rg_vnode, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		/* short read; problem with executable? */
+		kprintf("ELF: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
+	vmstats_inc(VMSTAT_ELF_FILE_READ);
+	return 0;
 }
 
-void
-vm_bootstrap(void)
+/*
+ * The attribute bits (PTE_ATTRS) for the pages of RG.
+ */
+static
+uint32_t
+region_ptebits(struct region *rg)
 {
-    ram_getsize(&start, &end);
+	uint32_t bits = 0;
 
-    num_frames = (end-start)/PAGE_SIZE;
-    int coremap_size = num_frames * sizeof(int);
-    coremap = (int *)PADDR_TO_KVADDR(start);
-    int coremap_frames = (coremap_size + PAGE_SIZE - 1) / PAGE_SIZE;
-    num_frames -= coremap_frames;
+	if (rg->rg_writeable) {
+		bits |= PTE_WRITE;
+	}
+	if (rg->rg_shared) {
+		bits |= PTE_SHARED;
+	}
+	if (rg->rg_advice == MADV_SEQUENTIAL) {
+		bits |= PTE_SEQUENTIAL;
+	}
+	else if (rg->rg_advice == MADV_RANDOM) {
+		bits |= PTE_RANDOM;
+	}
+	return bits;
+}
 
-    start += coremap_frames * PAGE_SIZE;
+/*
+ * Get the page cache's frame for page PAGENO of the mapped-file region
+ * RG, with a reference for the mapping, reading the page in if nobody
+ * has yet. If somebody else is reading it in, wait for them.
+ */
+static
+int
+vm_pagein_cache(struct addrspace *as, struct region *rg, unsigned pageno,
+		paddr_t *ret)
+{
+	off_t offset;
+	paddr_t paddr, newpa = 0;
+	int result;
+
+	offset = rg->rg_pcoffset + (off_t)pageno * PAGE_SIZE;
+	while (1) {
+		result = pagecache_lookup(rg->rg_pcfile, offset, &paddr);
+		if (result == 0) {
+			/* Somebody else already brought it in. */
+			if (newpa != 0) {
+				coremap_decref(newpa);
+			}
+			vmstats_inc(VMSTAT_TLB_RELOAD);
+			as->as_minflt++;
+			*ret = paddr;
+			return 0;
+		}
+		if (result == EBUSY) {
+			cv_wait(vm_busycv, vm_pagelock);
+		}
+		else if (newpa == 0) {
+			/* That may drop vm_pagelock, so look again. */
+			newpa = vm_getframe();
+			if (newpa == 0) {
+				return ENOMEM;
+			}
+		}
+		else {
+			break;
+		}
+	}
 
-    spinlock_acquire(&coremap_lock);
-    for(int i = 0; i < num_frames; ++i) {
-        coremap[i] = 0;
-    }
-    spinlock_release(&coremap_lock);
+	result = pagecache_add(rg->rg_pcfile, offset, newpa);
+	if (result) {
+		coremap_decref(newpa);
+		return result;
+	}
+	lock_release(vm_pagelock);
+	result = pagecache_read(rg->rg_pcfile, offset, newpa);
+	lock_acquire(vm_pagelock);
+	pagecache_done(rg->rg_pcfile, offset, result);
+	cv_broadcast(vm_busycv, vm_pagelock);
+	if (result) {
+		coremap_decref(newpa);
+		return result;
+	}
 
-    coremap_initialized = true;
+	if (rg->rg_vnode != NULL) {
+		vmstats_inc(VMSTAT_ELF_FILE_READ);
+	}
+	vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	as->as_majflt++;
+	*ret = newpa;
+	return 0;
 }
 
-/* Allocate/free some kernel-space virtual pages */
-vaddr_t 
-alloc_kpages(int npages)
+/*
+ * Get a frame holding page PAGENO of RG, whose entry PTE is clear or
+ * holds a swap slot: the page cache's frame, a frame filled from the
+ * executable or read back from swap, or a frame of zeros (for a read,
+ * the shared zero frame). The caller has marked the entry busy, and
+ * holds vm_pagelock, which is dropped for the disk read.
+ */
+static
+int
+vm_pagefill(struct addrspace *as, struct region *rg, unsigned pageno,
+	    int faulttype, uint32_t pte, paddr_t *ret)
 {
-	paddr_t pa;
-	pa = getppages(npages);
-	if (pa==0) {
+	paddr_t paddr;
+	vaddr_t start, end;
+	int result;
+
+	if (pte == 0 && rg->rg_pcfile != NULL) {
+		return vm_pagein_cache(as, rg, pageno, ret);
+	}
+
+	if (pte == 0 && !vm_filerange(rg, pageno, &start, &end)) {
+		/* All zeros: a read shares the zero frame. */
+		if (faulttype == VM_FAULT_READ) {
+			coremap_incref(vm_zeroframe);
+			paddr = vm_zeroframe;
+		}
+		else {
+			vm_rsscheck(as);
+			paddr = vm_getzeroframe();
+			if (paddr == 0) {
+				return ENOMEM;
+			}
+		}
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+		as->as_minflt++;
+		*ret = paddr;
 		return 0;
-    }
-    return PADDR_TO_KVADDR(pa);
+	}
+
+	vm_rsscheck(as);
+	paddr = vm_getframe();
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+	lock_release(vm_pagelock);
+	if (pte == 0) {
+		result = vm_readfile(rg, pageno, paddr);
+	}
+	else {
+		result = swap_pagein(paddr, PTE_SLOT(pte));
+	}
+	lock_acquire(vm_pagelock);
+	if (result) {
+		coremap_decref(paddr);
+		return result;
+	}
+	if (pte != 0) {
+		swap_free(PTE_SLOT(pte));
+	}
+	vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	as->as_majflt++;
+	*ret = paddr;
+	return 0;
 }
 
-void 
-free_kpages(vaddr_t addr)
+/*
+ * Make page PAGENO of RG resident: on first touch fill a frame from
+ * the executable, the page cache or with zeros (or for a read, map the
+ * shared zero frame), or read the page back from swap. For a write to
+ * a read-only mapping (FAULTTYPE VM_FAULT_READONLY) also break
+ * copy-on-write sharing, or for a shared mapping mark the page dirty.
+ * A process at its RSS limit first gives up one of its own pages for
+ * each private frame it takes (vm_rsscheck). If the page is busy this
+ * waits until it isn't. The caller holds vm_pagelock, which is dropped
+ * while the page is read in; the page is busy meanwhile.
+ */
+static
+int
+vm_pagein(struct addrspace *as, struct region *rg, unsigned pageno,
+	  int faulttype)
 {
-    spinlock_acquire(&coremap_lock);
-    paddr_t translation = PADDR_TO_KVADDR(addr);
-    int start_index = (translation - start) / PAGE_SIZE;
-    int *start_here = coremap + start_index;
-    int expecting = *start_here;
-    while (*start_here == expecting) {
-        *start_here = 0;
-        start_here += 1;
-        expecting += 1;
-    }
-//    for(int i = 0; i < num_frames; ++i) {
-//        kprintf("Key: %d, Value: %d\n", i, coremap[i]);
-//    }
-    spinlock_release(&coremap_lock);
-}
+	uint32_t *ptep, pte;
+	paddr_t paddr;
+	int result;
 
+	KASSERT(lock_do_i_hold(vm_pagelock));
 
-void
-vm_tlbshootdown_all(void)
-{
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	result = as_pte_alloc(as, rg->rg_vbase + pageno * PAGE_SIZE, &ptep);
+	if (result) {
+		return result;
+	}
+	vm_busywait(ptep);
+
+	pte = *ptep;
+	if (pte & PTE_VALID) {
+		/* Already resident: a copy-on-write break, or a race. */
+		vmstats_inc(VMSTAT_TLB_RELOAD);
+		as->as_minflt++;
+	}
+	else {
+		vm_setbusy(as, ptep);
+		result = vm_pagefill(as, rg, pageno, faulttype, pte, &paddr);
+		if (result) {
+			vm_unbusy(as, ptep, pte, 0);
+			return result;
+		}
+		vm_unbusy(as, ptep, PTE_MKFRAME(paddr) | region_ptebits(rg),
+			  paddr != vm_zeroframe ? 1 : 0);
+	}
+
+	if (rg->rg_shared) {
+		if (faulttype != VM_FAULT_READ && rg->rg_writeable) {
+			spinlock_acquire(&as->as_lock);
+			*ptep |= PTE_DIRTY;
+			spinlock_release(&as->as_lock);
+		}
+		return 0;
+	}
+	if (faulttype == VM_FAULT_READONLY) {
+		return vm_cow_break(as, ptep);
+	}
+	return 0;
 }
 
-void
-vm_tlbshootdown(const struct tlbshootdown *ts)
+/*
+ * Grow the stack of AS down to cover VADDR, if that is allowed. The
+ * entries for the new pages are already there, and clear, since
+ * nothing else is mapped below the stack. The caller holds
+ * vm_pagelock.
+ */
+static
+int
+vm_stack_grow(struct addrspace *as, vaddr_t vaddr)
 {
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	struct region *stack, *rg;
+	vaddr_t newbase;
+	size_t npages;
+	unsigned i, num;
+
+	KASSERT(lock_do_i_hold(vm_pagelock));
+
+	stack = as->as_stack;
+	if (stack == NULL || vaddr >= stack->rg_vbase) {
+		return EFAULT;
+	}
+	newbase = vaddr & PAGE_FRAME;
+	npages = (USERSTACK - newbase) / PAGE_SIZE;
+	if (npages > as->as_stackmax) {
+		return EFAULT;
+	}
+
+	num = array_num(as->as_regions);
+	for (i=0; i<num; i++) {
+		rg = array_get(as->as_regions, i);
+		if (rg != stack && rg->rg_vbase < USERSTACK &&
+		    rg->rg_vbase + (rg->rg_npages + VM_STACKGUARD) * PAGE_SIZE
+		    > newbase) {
+			return EFAULT;
+		}
+	}
+
+	spinlock_acquire(&as->as_lock);
+	as->as_vsize += npages - stack->rg_npages;
+	stack->rg_vbase = newbase;
+	stack->rg_npages = npages;
+	spinlock_release(&as->as_lock);
+	return 0;
 }
 
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
-	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
-	paddr_t paddr;
-	int i;
-	uint32_t ehi, elo;
+	struct region *rg;
+	unsigned pageno;
 	struct addrspace *as;
-	int spl;
-    bool is_text_segment = false;
+	uint32_t *pte;
+	bool writeable;
+	int result;
 
 	faultaddress &= PAGE_FRAME;
 
@@ -185,9 +1972,6 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
-		/* We always create pages read-write, so we can't get this */
-        //	panic("dumbvm: got VM_FAULT_READONLY\n");
-            return EFAULT;
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
@@ -195,6 +1979,11 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EINVAL;
 	}
 
+	if (faultaddress >= MIPS_KSEG2) {
+		/* Kernel memory; may be in any context, even early in boot. */
+		return vm_kvfault(faulttype, faultaddress);
+	}
+
 	if (curproc == NULL) {
 		/*
 		 * No process. This is probably a kernel fault early
@@ -213,95 +2002,410 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
-	/* Assert that the address space has been set up properly. */
-	KASSERT(as->as_vbase1 != 0);
-	KASSERT(as->as_pbase1 != 0);
-	KASSERT(as->as_npages1 != 0);
-	KASSERT(as->as_vbase2 != 0);
-	KASSERT(as->as_pbase2 != 0);
-	KASSERT(as->as_npages2 != 0);
-	KASSERT(as->as_stackpbase != 0);
-	KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
-	KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
-	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
-	KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
-	KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
-
-	vbase1 = as->as_vbase1;
-	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
-	vbase2 = as->as_vbase2;
-	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
-	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
-	stacktop = USERSTACK;
-
-	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-		paddr = (faultaddress - vbase1) + as->as_pbase1;
-        is_text_segment = true;
-	}
-	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
-		paddr = (faultaddress - vbase2) + as->as_pbase2;
-	}
-	else if (faultaddress >= stackbase && faultaddress < stacktop) {
-		paddr = (faultaddress - stackbase) + as->as_stackpbase;
+	if (faultaddress >= USERSPACETOP) {
+		return EFAULT;
 	}
-	else {
+
+	/*
+	 * Common case: the page is resident and only the TLB entry is
+	 * missing. Its page table entry has everything needed to reload
+	 * it, so this takes two array lookups and no region search.
+	 */
+	if (faulttype != VM_FAULT_READONLY) {
+		spinlock_acquire(&as->as_lock);
+		pte = as_pte(as, faultaddress);
+		if (pte != NULL && (*pte & PTE_VALID)) {
+			vmstats_inc(VMSTAT_TLB_FAULT);
+			vmstats_inc(VMSTAT_TLB_RELOAD);
+			vm_faultaround(as, faultaddress);
+			vm_tlbload(as, faultaddress, false);
+			spinlock_release(&as->as_lock);
+			return 0;
+		}
+		spinlock_release(&as->as_lock);
+	}
+
+	rg = as_find_region(as, faultaddress);
+	if (rg == NULL) {
+		/* Maybe the stack needs to grow. */
+		lock_acquire(vm_pagelock);
+		result = vm_stack_grow(as, faultaddress);
+		lock_release(vm_pagelock);
+		if (result) {
+			return result;
+		}
+		rg = as->as_stack;
+	}
+	writeable = rg->rg_writeable || !as->elf_finished;
+	pageno = (faultaddress - rg->rg_vbase) / PAGE_SIZE;
+
+	/*
+	 * A write hit a page mapped read-only. That is fatal for text;
+	 * otherwise the page is copy-on-write.
+	 */
+	if (faulttype == VM_FAULT_READONLY && !writeable) {
 		return EFAULT;
 	}
 
-	/* make sure it's page-aligned */
-	KASSERT((paddr & PAGE_FRAME) == paddr);
+	vmstats_inc(VMSTAT_TLB_FAULT);
+
+	lock_acquire(vm_pagelock);
+	result = vm_pagein(as, rg, pageno, faulttype);
+	if (result == 0) {
+		spinlock_acquire(&as->as_lock);
+		if (faulttype != VM_FAULT_READONLY) {
+			vm_faultaround(as, faultaddress);
+		}
+		vm_tlbload(as, faultaddress, false);
+		spinlock_release(&as->as_lock);
+	}
+	lock_release(vm_pagelock);
+	return result;
+}
+
+/*
+ * Create a region covering NPAGES pages from VBASE, none of them
+ * touched yet.
+ */
+static
+struct region *
+region_create(vaddr_t vbase, size_t npages, bool writeable)
+{
+	struct region *rg;
+
+	rg = kmalloc(sizeof(struct region));
+	if (rg == NULL) {
+		return NULL;
+	}
+
+	rg->rg_vbase = vbase;
+	rg->rg_npages = npages;
+	rg->rg_writeable = writeable;
+	rg->rg_vnode = NULL;
+	rg->rg_fileoffset = 0;
+	rg->rg_filevaddr = vbase;
+	rg->rg_filesize = 0;
+	rg->rg_pcfile = NULL;
+	rg->rg_pcoffset = 0;
+	rg->rg_shared = false;
+	rg->rg_advice = MADV_NORMAL;
+	return rg;
+}
+
+/*
+ * Is RG a mapping made by mmap? Text mapped from the page cache has a
+ * pcfile too, but also its executable.
+ */
+static
+bool
+region_ismapping(struct region *rg)
+{
+	return rg->rg_pcfile != NULL && rg->rg_vnode == NULL;
+}
+
+/*
+ * Clear the page table entry PTE of AS and let go of whatever it held:
+ * a frame reference or a swap slot. The page must not be busy.
+ */
+static
+void
+pte_release(struct addrspace *as, uint32_t *ptep)
+{
+	uint32_t pte;
+
+	spinlock_acquire(&as->as_lock);
+	pte = *ptep;
+	KASSERT(!(pte & PTE_BUSY));
+	*ptep = 0;
+	if ((pte & PTE_VALID) && PTE_FRAME(pte) != vm_zeroframe) {
+		as_rssadjust(as, -1);
+	}
+	spinlock_release(&as->as_lock);
+
+	if (pte & PTE_VALID) {
+		coremap_decref(PTE_FRAME(pte));
+	}
+	else if (pte & PTE_SWAPPED) {
+		swap_free(PTE_SLOT(pte));
+	}
+}
+
+/*
+ * Write page PAGENO of the shared mapping RG, whose entry is PTEP, back
+ * to the file if it has been written since it was last written back,
+ * and mark it clean; if that fails it stays dirty. The page is busy
+ * while it is written, with vm_pagelock dropped. The caller holds
+ * vm_pagelock, and must retire the address space afterwards so that
+ * the next write to a cleaned page faults and marks it dirty again.
+ */
+static
+int
+vm_writeback(struct addrspace *as, struct region *rg, unsigned pageno,
+	     uint32_t *ptep)
+{
+	uint32_t pte;
+	off_t offset;
+	int result;
+
+	KASSERT(lock_do_i_hold(vm_pagelock));
+
+	vm_busywait(ptep);
+	pte = *ptep;
+	if (!(pte & PTE_DIRTY)) {
+		return 0;
+	}
+	KASSERT(pte & PTE_VALID);
+
+	vm_setbusy(as, ptep);
+	offset = rg->rg_pcoffset + (off_t)pageno * PAGE_SIZE;
+	lock_release(vm_pagelock);
+	result = pagecache_writeback(rg->rg_pcfile, offset, PTE_FRAME(pte));
+	lock_acquire(vm_pagelock);
+	vm_unbusy(as, ptep, result ? pte : pte & ~PTE_DIRTY, 0);
+	return result;
+}
+
+/*
+ * Release pages FIRST to LAST-1 of RG: clear their entries, dropping
+ * the frames and swap slots they held. Nothing is written back. The
+ * caller holds vm_pagelock, which is dropped while waiting for busy
+ * pages, since nothing may be in transit while the entries are
+ * cleared.
+ */
+static
+void
+region_release(struct addrspace *as, struct region *rg, size_t first,
+	       size_t last)
+{
+	uint32_t *pte;
+	size_t i;
+
+	KASSERT(lock_do_i_hold(vm_pagelock));
+
+	vm_idlewait(as);
+	for (i=first; i<last; i++) {
+		pte = as_pte(as, rg->rg_vbase + i * PAGE_SIZE);
+		if (pte == NULL || *pte == 0) {
+			continue;
+		}
+		pte_release(as, pte);
+	}
+}
+
+/*
+ * Drop the region's reference to each frame it maps, release its swap
+ * slots, and free the region itself. Pages written through a shared
+ * mapping are not written back; callers that want that use
+ * region_sync first. The caller holds vm_pagelock, which is dropped
+ * while waiting for busy pages.
+ */
+static
+void
+region_destroy(struct addrspace *as, struct region *rg)
+{
+	KASSERT(lock_do_i_hold(vm_pagelock));
+
+	region_release(as, rg, 0, rg->rg_npages);
+	if (rg->rg_vnode != NULL) {
+		VOP_DECREF(rg->rg_vnode);
+	}
+	if (rg->rg_pcfile != NULL) {
+		pagecache_put(rg->rg_pcfile);
+	}
+	kfree(rg);
+}
+
+/*
+ * Write back every page of the shared mapping RG that has been written
+ * since it was last synced, and mark it clean. The caller holds
+ * vm_pagelock, which is dropped for the writes, and must retire the
+ * address space afterwards (see vm_writeback).
+ */
+static
+int
+region_sync(struct addrspace *as, struct region *rg)
+{
+	uint32_t *pte;
+	size_t i;
+	int result, ret = 0;
+
+	KASSERT(lock_do_i_hold(vm_pagelock));
+
+	for (i=0; i<rg->rg_npages; i++) {
+		pte = as_pte(as, rg->rg_vbase + i * PAGE_SIZE);
+		if (pte == NULL) {
+			continue;
+		}
+		result = vm_writeback(as, rg, i, pte);
+		/* Report the first failure. */
+		if (result && ret == 0) {
+			ret = result;
+		}
+	}
+	return ret;
+}
+
+/*
+ * Return a region of AS other than EXCEPT that overlaps the range
+ * [START, END), or NULL if the range is free.
+ */
+static
+struct region *
+as_overlap(struct addrspace *as, vaddr_t start, vaddr_t end,
+	   struct region *except)
+{
+	struct region *rg;
+	unsigned i, num;
+
+	num = array_num(as->as_regions);
+	for (i=0; i<num; i++) {
+		rg = array_get(as->as_regions, i);
+		if (rg != except && rg->rg_npages > 0 &&
+		    rg->rg_vbase < end &&
+		    rg->rg_vbase + rg->rg_npages * PAGE_SIZE > start) {
+			return rg;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Change the length of RG to NPAGES, keeping its base. Pages cut off
+ * the end are released. The caller holds vm_pagelock, which is dropped
+ * while waiting for busy pages, and flushes the TLB if the region
+ * shrank.
+ */
+static
+void
+region_setsize(struct addrspace *as, struct region *rg, size_t npages)
+{
+	size_t oldnpages;
+
+	KASSERT(lock_do_i_hold(vm_pagelock));
+
+	spinlock_acquire(&as->as_lock);
+	oldnpages = rg->rg_npages;
+	rg->rg_npages = npages;
+	as->as_vsize += npages - oldnpages;
+	spinlock_release(&as->as_lock);
+
+	region_release(as, rg, npages, oldnpages);
+}
+
+/*
+ * Split the mapping RG in two at page PAGENO: RG keeps the pages before
+ * it, and a new region the rest. The pages themselves, and their page
+ * table entries, are untouched. Returns ENOMEM, leaving RG whole, if
+ * there is no memory for the new region. The caller holds vm_pagelock.
+ */
+static
+int
+region_split(struct addrspace *as, struct region *rg, size_t pageno)
+{
+	struct region *tail;
+	int result;
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
+	KASSERT(lock_do_i_hold(vm_pagelock));
+	KASSERT(rg->rg_pcfile != NULL && rg->rg_vnode == NULL);
+	KASSERT(pageno > 0 && pageno < rg->rg_npages);
 
+	tail = region_create(rg->rg_vbase + pageno * PAGE_SIZE,
+			     rg->rg_npages - pageno, rg->rg_writeable);
+	if (tail == NULL) {
+		return ENOMEM;
+	}
+	pagecache_incref(rg->rg_pcfile);
+	tail->rg_pcfile = rg->rg_pcfile;
+	tail->rg_pcoffset = rg->rg_pcoffset + (off_t)pageno * PAGE_SIZE;
+	tail->rg_shared = rg->rg_shared;
+	tail->rg_advice = rg->rg_advice;
+
+	/* Until RG shrinks, the two overlap; nobody else can look. */
+	result = array_add(as->as_regions, tail, NULL);
+	if (result) {
+		tail->rg_npages = 0;
+		region_destroy(as, tail);
+		return result;
+	}
+	spinlock_acquire(&as->as_lock);
+	rg->rg_npages = pageno;
+	spinlock_release(&as->as_lock);
+	return 0;
+}
 
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_read(&ehi, &elo, i);
-		if (elo & TLBLO_VALID) {
-			continue;
+/*
+ * Give RG the access-pattern advice ADVICE, and copy it into the
+ * entries of the pages it has already touched. The caller holds
+ * vm_pagelock, which is dropped while waiting for busy pages.
+ */
+static
+void
+region_setadvice(struct addrspace *as, struct region *rg, int advice)
+{
+	uint32_t *pte;
+	size_t i;
+
+	KASSERT(lock_do_i_hold(vm_pagelock));
+
+	vm_idlewait(as);
+	rg->rg_advice = advice;
+	spinlock_acquire(&as->as_lock);
+	for (i=0; i<rg->rg_npages; i++) {
+		pte = as_pte(as, rg->rg_vbase + i * PAGE_SIZE);
+		if (pte != NULL && *pte != 0) {
+			*pte = (*pte & ~PTE_ATTRS) | region_ptebits(rg);
 		}
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-        if (as->elf_finished && is_text_segment) {
-            elo &= ~TLBLO_DIRTY;
-        }
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-		tlb_write(ehi, elo, i);
-		splx(spl);
-		return 0;
 	}
-#if OPT_A3
-    ehi = faultaddress;
-    elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-    if (as->elf_finished && is_text_segment) {
-        elo &= ~TLBLO_DIRTY;
-    }
-    tlb_random(ehi, elo);
-    splx(spl);
-    return 0;
-#else
-	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
-	splx(spl);
-	return EFAULT;
-#endif
+	spinlock_release(&as->as_lock);
 }
 
 struct addrspace *
 as_create(void)
 {
 	struct addrspace *as = kmalloc(sizeof(struct addrspace));
+	unsigned i;
+
 	if (as==NULL) {
 		return NULL;
 	}
 
-	as->as_vbase1 = 0;
-	as->as_pbase1 = 0;
-	as->as_npages1 = 0;
-	as->as_vbase2 = 0;
-	as->as_pbase2 = 0;
-	as->as_npages2 = 0;
-	as->as_stackpbase = 0;
+	as->as_regions = array_create();
+	if (as->as_regions == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	as->as_pgdir = kmalloc(PT_NDIR * sizeof(uint32_t *));
+	if (as->as_pgdir == NULL) {
+		array_destroy(as->as_regions);
+		kfree(as);
+		return NULL;
+	}
+	for (i=0; i<PT_NDIR; i++) {
+		as->as_pgdir[i] = NULL;
+	}
     as->elf_finished = false;
+	as->as_heap = NULL;
+	as->as_heapbreak = 0;
+	as->as_stack = NULL;
+	as->as_stackmax = AS_STACKPAGES;
+	as->as_fa_window = VM_FAMIN;
+	as->as_fa_end = 0;
+	spinlock_init(&as->as_lock);
+	as->as_id = as_newid();
+	as->as_cpus = 0;
+	as->as_rss = 0;
+	as->as_maxrss = 0;
+	as->as_vsize = 0;
+	as->as_rsslimit = AS_NOLIMIT;
+	as->as_rsshand = 0;
+	as->as_nbusy = 0;
+	as->as_minflt = 0;
+	as->as_majflt = 0;
+
+	lock_acquire(vm_pagelock);
+	as->as_next = vm_aslist;
+	vm_aslist = as;
+	lock_release(vm_pagelock);
 
 	return as;
 }
@@ -309,17 +2413,60 @@ as_create(void)
 void
 as_destroy(struct addrspace *as)
 {
-    kfree((void *)PADDR_TO_KVADDR(as->as_pbase1));
-    kfree((void *)PADDR_TO_KVADDR(as->as_pbase2));
-    kfree((void *)PADDR_TO_KVADDR(as->as_stackpbase));
+	struct addrspace **asp;
+	struct region *rg;
+	unsigned i, num;
+
+	/*
+	 * Let the pager finish with any of its pages it is writing out,
+	 * and take the address space off vm_aslist first, since its
+	 * regions go away one by one.
+	 */
+	lock_acquire(vm_pagelock);
+	vm_idlewait(as);
+	for (asp = &vm_aslist; *asp != as; asp = &(*asp)->as_next) {
+		KASSERT(*asp != NULL);
+	}
+	*asp = as->as_next;
+	if (vm_sharedhand_as == as) {
+		vm_sharedhand_as = as->as_next;
+		vm_sharedhand_va = 0;
+	}
+	num = array_num(as->as_regions);
+	for (i=0; i<num; i++) {
+		rg = array_get(as->as_regions, i);
+		if (rg->rg_shared) {
+			/* There is nobody left to tell if this fails. */
+			(void)region_sync(as, rg);
+		}
+	}
+	for (i=0; i<num; i++) {
+		region_destroy(as, array_get(as->as_regions, i));
+	}
+	lock_release(vm_pagelock);
+
+	for (i=0; i<PT_NDIR; i++) {
+		kfree(as->as_pgdir[i]);
+	}
+	kfree(as->as_pgdir);
+	array_setsize(as->as_regions, 0);
+	array_destroy(as->as_regions);
+	spinlock_cleanup(&as->as_lock);
 	kfree(as);
 }
 
+/*
+ * Switch the TLB over to the current address space. Nothing needs to
+ * be flushed unless this cpu has to recycle an ASID for it, and then
+ * only the previous owner's entries go.
+ */
 void
 as_activate(void)
 {
-	int i, spl;
 	struct addrspace *as;
+	struct cpu *c;
+	unsigned asid;
+	int spl;
 
 	as = curproc_getas();
 #ifdef UW
@@ -329,13 +2476,21 @@ as_activate(void)
 		return;
 	}
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	c = curcpu->c_self;
+	asid = vm_asid_lookup(c, as->as_id);
+	if (asid == 0) {
+		asid = c->c_asid_next;
+		c->c_asid_next = asid % (NUM_ASID - 1) + 1;
+		c->c_asid_owner[asid] = as->as_id;
+		vm_tlbflush_asid(asid);
 	}
+	c->c_asid = asid;
+	tlb_setpid(asid);
 
+	spinlock_acquire(&as->as_lock);
+	as->as_cpus |= VM_CPUBIT(c);
+	spinlock_release(&as->as_lock);
 	splx(spl);
 }
 
@@ -349,7 +2504,9 @@ int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		 int readable, int writeable, int executable)
 {
+	struct region *rg;
 	size_t npages; 
+	int result;
 
 	/* Align the region. First, the base... */
 	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
@@ -358,81 +2515,153 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	/* ...and now the length. */
 	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
 
+	/*
+	 * Nothing is copied in at load time any more, so nothing else
+	 * catches a segment that reaches into kernel space.
+	 */
+	if (vaddr >= USERSPACETOP || sz > USERSPACETOP - vaddr) {
+		return EFAULT;
+	}
+
 	npages = sz / PAGE_SIZE;
 
-	/* We don't use these - all pages are read-write */
+	/* MIPS can't enforce these separately; only writes are checked. */
 	(void)readable;
-	(void)writeable;
 	(void)executable;
 
-	if (as->as_vbase1 == 0) {
-		as->as_vbase1 = vaddr;
-		as->as_npages1 = npages;
-		return 0;
-	}
+	/* The pager may be looking at the regions (vm_evict_shared). */
+	lock_acquire(vm_pagelock);
 
-	if (as->as_vbase2 == 0) {
-		as->as_vbase2 = vaddr;
-		as->as_npages2 = npages;
-		return 0;
+	/* Regions share one page table, so they can't overlap. */
+	if (as_overlap(as, vaddr, vaddr + sz, NULL) != NULL) {
+		lock_release(vm_pagelock);
+		return EINVAL;
 	}
 
-	/*
-	 * Support for more than two regions is not available.
-	 */
-	kprintf("dumbvm: Warning: too many regions\n");
-	return EUNIMP;
-}
+	rg = region_create(vaddr, npages, writeable != 0);
+	if (rg == NULL) {
+		lock_release(vm_pagelock);
+		return ENOMEM;
+	}
 
-static
-void
-as_zero_region(paddr_t paddr, unsigned npages)
-{
-	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
+	result = array_add(as->as_regions, rg, NULL);
+	if (result) {
+		region_destroy(as, rg);
+		lock_release(vm_pagelock);
+		return result;
+	}
+	as->as_vsize += npages;
+	lock_release(vm_pagelock);
+	return 0;
 }
 
 int
-as_prepare_load(struct addrspace *as)
+as_define_file(struct addrspace *as, struct vnode *v, off_t offset,
+	       vaddr_t vaddr, size_t memsize, size_t filesize)
 {
-	KASSERT(as->as_pbase1 == 0);
-	KASSERT(as->as_pbase2 == 0);
-	KASSERT(as->as_stackpbase == 0);
+	struct region *rg;
 
-	as->as_pbase1 = getppages(as->as_npages1);
-	if (as->as_pbase1 == 0) {
-		return ENOMEM;
+	rg = as_find_region(as, vaddr);
+	if (rg == NULL || rg->rg_vnode != NULL) {
+		return EINVAL;
 	}
-
-	as->as_pbase2 = getppages(as->as_npages2);
-	if (as->as_pbase2 == 0) {
-		return ENOMEM;
+	if (filesize > memsize ||
+	    memsize > rg->rg_vbase + rg->rg_npages * PAGE_SIZE - vaddr) {
+		return EINVAL;
 	}
 
-	as->as_stackpbase = getppages(DUMBVM_STACKPAGES);
-	if (as->as_stackpbase == 0) {
-		return ENOMEM;
+	VOP_INCREF(v);
+	rg->rg_vnode = v;
+	rg->rg_fileoffset = offset;
+	rg->rg_filevaddr = vaddr;
+	rg->rg_filesize = filesize;
+
+	/*
+	 * A read-only segment (text) whose pages line up with pages of
+	 * the file, and that has no zero-fill pages, is mapped from the
+	 * page cache instead, so every process running this program
+	 * shares one copy of it. The part of the last page past the end
+	 * of the segment then shows whatever follows it in the file. That
+	 * is only allowed past MEMSIZE: zero-fill bytes must read as
+	 * zeros, so a segment whose zero fill starts partway into its
+	 * last page is read privately, which clears them.
+	 */
+	if (!rg->rg_writeable &&
+	    (vaddr - rg->rg_vbase) == (vaddr_t)(offset % PAGE_SIZE) &&
+	    rg->rg_vbase + rg->rg_npages * PAGE_SIZE ==
+	    ROUNDUP(vaddr + filesize, PAGE_SIZE) &&
+	    (memsize == filesize || (vaddr + filesize) % PAGE_SIZE == 0)) {
+		lock_acquire(vm_pagelock);
+		rg->rg_pcfile = pagecache_get(v);
+		lock_release(vm_pagelock);
+		/* If that failed the pages are just read privately. */
+		rg->rg_pcoffset = offset - (vaddr - rg->rg_vbase);
 	}
-	
-	as_zero_region(as->as_pbase1, as->as_npages1);
-	as_zero_region(as->as_pbase2, as->as_npages2);
-	as_zero_region(as->as_stackpbase, DUMBVM_STACKPAGES);
+	return 0;
+}
 
+int
+as_prepare_load(struct addrspace *as)
+{
+	/*
+	 * Nothing to do: frames are allocated, and zeroed, one at a
+	 * time in vm_fault as the loader touches each page.
+	 */
+	(void)as;
 	return 0;
 }
 
 int
 as_complete_load(struct addrspace *as)
 {
+	struct region *rg;
+	vaddr_t heapbase;
+	unsigned i, num;
+	int result;
+
+	/* The heap starts out empty, just past the end of the data. */
+	heapbase = 0;
+	num = array_num(as->as_regions);
+	for (i=0; i<num; i++) {
+		rg = array_get(as->as_regions, i);
+		if (rg->rg_vbase + rg->rg_npages * PAGE_SIZE > heapbase) {
+			heapbase = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		}
+	}
+	rg = region_create(heapbase, 0, true);
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+	lock_acquire(vm_pagelock);
+	result = array_add(as->as_regions, rg, NULL);
+	if (result) {
+		region_destroy(as, rg);
+		lock_release(vm_pagelock);
+		return result;
+	}
+	lock_release(vm_pagelock);
+	as->as_heap = rg;
+	as->as_heapbreak = heapbase;
+
     as->elf_finished = true;
-    as_activate();
+    /* Drop the writeable text mappings the loader left in the TLB. */
+    as_retire(as);
 	return 0;
 }
 
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr, int argc, char **argv)
 {
-	KASSERT(as->as_stackpbase != 0);
     int result = 0;
+
+	/* One page to start with; vm_fault grows it as it is used. */
+	result = as_define_region(as, USERSTACK - PAGE_SIZE, PAGE_SIZE,
+				  1, 1, 0);
+	if (result) {
+		return result;
+	}
+	as->as_stack = as_find_region(as, USERSTACK - PAGE_SIZE);
+
     size_t actual = 0;
 #if OPT_A2
 	*stackptr = USERSTACK;
@@ -469,43 +2698,543 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr, int argc, char **argv)
 	return 0;
 }
 
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	struct region *heap = as->as_heap;
+	vaddr_t newbreak, limit;
+	size_t npages;
+	bool shrinking;
+
+	if (heap == NULL) {
+		return ENOMEM;
+	}
+
+	newbreak = as->as_heapbreak + amount;
+	if (amount < 0 && newbreak > as->as_heapbreak) {
+		return EINVAL;
+	}
+	if (newbreak < heap->rg_vbase) {
+		return EINVAL;
+	}
+
+	/* Leave room for the stack to grow to its limit. */
+	limit = USERSTACK - (as->as_stackmax + VM_STACKGUARD) * PAGE_SIZE;
+	if (amount > 0 && (newbreak < as->as_heapbreak || newbreak > limit)) {
+		return ENOMEM;
+	}
+	/* ...and don't run into a mapped file. */
+	if (amount > 0 &&
+	    as_overlap(as, heap->rg_vbase + heap->rg_npages * PAGE_SIZE,
+		       ROUNDUP(newbreak, PAGE_SIZE), heap) != NULL) {
+		return ENOMEM;
+	}
+
+	npages = (ROUNDUP(newbreak, PAGE_SIZE) - heap->rg_vbase) / PAGE_SIZE;
+	if (npages != heap->rg_npages) {
+		lock_acquire(vm_pagelock);
+		shrinking = npages < heap->rg_npages;
+		region_setsize(as, heap, npages);
+		if (shrinking) {
+			/* Stale translations may still point at released frames. */
+			as_retire(as);
+		}
+		lock_release(vm_pagelock);
+	}
+
+	*oldbreak = as->as_heapbreak;
+	as->as_heapbreak = newbreak;
+	return 0;
+}
+
+/*
+ * Find NPAGES of unused address space for a mapping. Mappings go below
+ * the stack's reserved extent and work down towards the heap.
+ */
+static
+int
+as_findgap(struct addrspace *as, size_t npages, vaddr_t *base)
+{
+	struct region *rg;
+	vaddr_t top, floor, len;
+
+	top = USERSTACK - (as->as_stackmax + VM_STACKGUARD) * PAGE_SIZE;
+	floor = as->as_heap != NULL ? ROUNDUP(as->as_heapbreak, PAGE_SIZE) :
+		PAGE_SIZE;
+	len = npages * PAGE_SIZE;
+
+	while (top >= floor && top - floor >= len) {
+		rg = as_overlap(as, top - len, top, NULL);
+		if (rg == NULL) {
+			*base = top - len;
+			return 0;
+		}
+		top = rg->rg_vbase;
+	}
+	return ENOMEM;
+}
+
+int
+as_mmap(struct addrspace *as, struct vnode *v, off_t offset, size_t len,
+	int prot, int flags, vaddr_t *addr)
+{
+	struct region *rg;
+	vaddr_t base;
+	size_t npages;
+	int result;
+
+	if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if (flags != MAP_SHARED && flags != MAP_PRIVATE) {
+		return EINVAL;
+	}
+	if (len > USERSPACETOP) {
+		return ENOMEM;
+	}
+	npages = ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE;
+
+	lock_acquire(vm_pagelock);
+	result = as_findgap(as, npages, &base);
+	if (result) {
+		lock_release(vm_pagelock);
+		return result;
+	}
+
+	/* Nothing is read until the pages are touched. */
+	rg = region_create(base, npages, (prot & PROT_WRITE) != 0);
+	if (rg == NULL) {
+		lock_release(vm_pagelock);
+		return ENOMEM;
+	}
+	rg->rg_pcfile = pagecache_get(v);
+	if (rg->rg_pcfile == NULL) {
+		region_destroy(as, rg);
+		lock_release(vm_pagelock);
+		return ENOMEM;
+	}
+	rg->rg_pcoffset = offset;
+	rg->rg_shared = (flags == MAP_SHARED);
+
+	result = array_add(as->as_regions, rg, NULL);
+	if (result) {
+		region_destroy(as, rg);
+		lock_release(vm_pagelock);
+		return result;
+	}
+	as->as_vsize += npages;
+	lock_release(vm_pagelock);
+
+	*addr = base;
+	return 0;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t addr, size_t len)
+{
+	struct region *rg;
+	vaddr_t end;
+	unsigned i;
+	int result, ret = 0;
+
+	if (addr % PAGE_SIZE != 0 || len == 0 || len > USERSPACETOP ||
+	    addr > USERSPACETOP - ROUNDUP(len, PAGE_SIZE)) {
+		return EINVAL;
+	}
+	end = addr + ROUNDUP(len, PAGE_SIZE);
+
+	lock_acquire(vm_pagelock);
+
+	/* Only mappings can be unmapped; pages between them are skipped. */
+	for (i=0; i<array_num(as->as_regions); i++) {
+		rg = array_get(as->as_regions, i);
+		if (rg->rg_npages > 0 && rg->rg_vbase < end &&
+		    rg->rg_vbase + rg->rg_npages * PAGE_SIZE > addr &&
+		    !region_ismapping(rg)) {
+			lock_release(vm_pagelock);
+			return EINVAL;
+		}
+	}
+
+	/* Split mappings that straddle either end, so only whole ones go. */
+	rg = as_find_region(as, addr);
+	if (rg != NULL && rg->rg_vbase < addr) {
+		result = region_split(as, rg, (addr - rg->rg_vbase) / PAGE_SIZE);
+		if (result) {
+			lock_release(vm_pagelock);
+			return result;
+		}
+	}
+	rg = end < USERSPACETOP ? as_find_region(as, end) : NULL;
+	if (rg != NULL && rg->rg_vbase < end) {
+		result = region_split(as, rg, (end - rg->rg_vbase) / PAGE_SIZE);
+		if (result) {
+			lock_release(vm_pagelock);
+			return result;
+		}
+	}
+
+	i = 0;
+	while (i < array_num(as->as_regions)) {
+		rg = array_get(as->as_regions, i);
+		if (rg->rg_npages == 0 || rg->rg_vbase < addr ||
+		    rg->rg_vbase >= end) {
+			i++;
+			continue;
+		}
+
+		/*
+		 * Write it back while it is still a region, so the pager
+		 * can find the pages' region meanwhile, and report the
+		 * first failure; the mapping goes anyway. Only this
+		 * process changes its regions, so it is still at index
+		 * I afterwards.
+		 */
+		result = region_sync(as, rg);
+		if (result && ret == 0) {
+			ret = result;
+		}
+		array_remove(as->as_regions, i);
+		as->as_vsize -= rg->rg_npages;
+		as_retire(as);
+		region_destroy(as, rg);
+	}
+	lock_release(vm_pagelock);
+	return ret;
+}
+
+void
+vm_filewritten(struct vnode *vn)
+{
+	lock_acquire(vm_pagelock);
+	pagecache_forget(vn);
+	lock_release(vm_pagelock);
+}
+
+int
+as_sync(struct addrspace *as, struct vnode *v)
+{
+	struct region *rg;
+	unsigned i, num;
+	int result, ret = 0;
+
+	lock_acquire(vm_pagelock);
+	num = array_num(as->as_regions);
+	for (i=0; i<num; i++) {
+		rg = array_get(as->as_regions, i);
+		if (rg->rg_shared && pagecache_vnode(rg->rg_pcfile) == v) {
+			result = region_sync(as, rg);
+			if (result && ret == 0) {
+				ret = result;
+			}
+		}
+	}
+	as_retire(as);
+	lock_release(vm_pagelock);
+	return ret;
+}
+
+/*
+ * Drop page PAGENO of RG, so that the next touch fills it again from
+ * scratch: from the file, or with zeros. A page written through a
+ * shared mapping is written back first. The caller holds vm_pagelock,
+ * which is dropped for the write and while waiting for a busy page,
+ * and retires the address space afterwards.
+ */
+static
+int
+vm_pagedrop(struct addrspace *as, struct region *rg, unsigned pageno)
+{
+	uint32_t *pte;
+	int result;
+
+	pte = as_pte(as, rg->rg_vbase + pageno * PAGE_SIZE);
+	if (pte == NULL) {
+		return 0;
+	}
+	result = vm_writeback(as, rg, pageno, pte);
+	if (result) {
+		return result;
+	}
+	vm_busywait(pte);
+	if (*pte != 0) {
+		pte_release(as, pte);
+	}
+	return 0;
+}
+
+int
+as_madvise(struct addrspace *as, vaddr_t addr, size_t len, int advice)
+{
+	struct region *rg;
+	uint32_t *pte;
+	vaddr_t va, end;
+	unsigned pageno;
+	int result = 0;
+
+	if (addr % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	switch (advice) {
+	    case MADV_NORMAL:
+	    case MADV_RANDOM:
+	    case MADV_SEQUENTIAL:
+	    case MADV_WILLNEED:
+	    case MADV_DONTNEED:
+		break;
+	    default:
+		return EINVAL;
+	}
+	if (addr >= USERSPACETOP || len > USERSPACETOP - addr) {
+		return ENOMEM;
+	}
+	end = ROUNDUP(addr + len, PAGE_SIZE);
+
+	/* The whole range must be mapped. */
+	for (va = addr; va < end; va += PAGE_SIZE) {
+		if (as_find_region(as, va) == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	lock_acquire(vm_pagelock);
+	for (va = addr; va < end && result == 0; va += PAGE_SIZE) {
+		rg = as_find_region(as, va);
+		pageno = (va - rg->rg_vbase) / PAGE_SIZE;
+		switch (advice) {
+		    case MADV_NORMAL:
+		    case MADV_RANDOM:
+		    case MADV_SEQUENTIAL:
+			/* Applies to the whole region. */
+			if (rg->rg_advice != advice) {
+				region_setadvice(as, rg, advice);
+			}
+			break;
+		    case MADV_WILLNEED:
+			pte = as_pte(as, va);
+			if (pte == NULL || !(*pte & PTE_VALID)) {
+				result = vm_pagein(as, rg, pageno,
+						   VM_FAULT_READ);
+			}
+			break;
+		    case MADV_DONTNEED:
+			result = vm_pagedrop(as, rg, pageno);
+			break;
+		}
+	}
+	if (advice == MADV_DONTNEED) {
+		as_retire(as);
+	}
+	lock_release(vm_pagelock);
+	return result;
+}
+
+int
+as_mincore(struct addrspace *as, vaddr_t addr, size_t npages, char *vec)
+{
+	uint32_t *pte;
+	vaddr_t va;
+	size_t i;
+
+	KASSERT(addr % PAGE_SIZE == 0);
+
+	spinlock_acquire(&as->as_lock);
+	for (i=0; i<npages; i++) {
+		va = addr + i * PAGE_SIZE;
+		if (as_find_region(as, va) == NULL) {
+			spinlock_release(&as->as_lock);
+			return ENOMEM;
+		}
+		vec[i] = 0;
+		pte = as_pte(as, va);
+		if (pte == NULL || !(*pte & PTE_VALID)) {
+			continue;
+		}
+		vec[i] = MINCORE_INCORE;
+		if (*pte & PTE_REFERENCED) {
+			vec[i] |= MINCORE_REFERENCED;
+		}
+		if (*pte & PTE_DIRTY) {
+			vec[i] |= MINCORE_MODIFIED;
+		}
+	}
+	spinlock_release(&as->as_lock);
+	return 0;
+}
+
+int
+as_getlimit(struct addrspace *as, int resource, rlim_t *limit)
+{
+	switch (resource) {
+	    case RLIMIT_RSS:
+		if (as->as_rsslimit == AS_NOLIMIT) {
+			*limit = RLIM_INFINITY;
+		}
+		else {
+			*limit = (rlim_t)as->as_rsslimit * PAGE_SIZE;
+		}
+		return 0;
+	    case RLIMIT_STACK:
+		*limit = (rlim_t)as->as_stackmax * PAGE_SIZE;
+		return 0;
+	}
+	return EINVAL;
+}
+
+int
+as_setlimit(struct addrspace *as, int resource, rlim_t limit)
+{
+	size_t npages;
+	vaddr_t base;
+
+	switch (resource) {
+	    case RLIMIT_RSS:
+		/* No process could reach a limit this big anyway. */
+		if (limit >= USERSPACETOP) {
+			as->as_rsslimit = AS_NOLIMIT;
+		}
+		else {
+			as->as_rsslimit = ROUNDUP(limit, PAGE_SIZE) / PAGE_SIZE;
+		}
+		return 0;
+	    case RLIMIT_STACK:
+		if (limit == 0 ||
+		    limit > USERSTACK - VM_STACKGUARD * PAGE_SIZE) {
+			return EINVAL;
+		}
+		npages = ROUNDUP(limit, PAGE_SIZE) / PAGE_SIZE;
+		base = USERSTACK - (npages + VM_STACKGUARD) * PAGE_SIZE;
+
+		/* The stack's whole reach has to be free. */
+		lock_acquire(vm_pagelock);
+		if ((as->as_stack != NULL &&
+		     npages < as->as_stack->rg_npages) ||
+		    as_overlap(as, base, USERSTACK, as->as_stack) != NULL) {
+			lock_release(vm_pagelock);
+			return EINVAL;
+		}
+		as->as_stackmax = npages;
+		lock_release(vm_pagelock);
+		return 0;
+	}
+	return EINVAL;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *new;
+	struct region *oldrg, *newrg;
+	uint32_t *oldpte, *newpte;
+	vaddr_t va;
+	unsigned i, num;
+	size_t j;
+	int result;
 
 	new = as_create();
 	if (new==NULL) {
 		return ENOMEM;
 	}
 
-	new->as_vbase1 = old->as_vbase1;
-	new->as_npages1 = old->as_npages1;
-	new->as_vbase2 = old->as_vbase2;
-	new->as_npages2 = old->as_npages2;
+	/* Hold off the pager so the parent's pages stay where they are. */
+	lock_acquire(vm_pagelock);
+
+	num = array_num(old->as_regions);
+	for (i=0; i<num; i++) {
+		oldrg = array_get(old->as_regions, i);
+		newrg = region_create(oldrg->rg_vbase, oldrg->rg_npages,
+				      oldrg->rg_writeable);
+		if (newrg == NULL) {
+			lock_release(vm_pagelock);
+			as_destroy(new);
+			return ENOMEM;
+		}
+		result = array_add(new->as_regions, newrg, NULL);
+		if (result) {
+			region_destroy(new, newrg);
+			lock_release(vm_pagelock);
+			as_destroy(new);
+			return result;
+		}
+		if (oldrg == old->as_stack) {
+			new->as_stack = newrg;
+		}
+		if (oldrg == old->as_heap) {
+			new->as_heap = newrg;
+		}
+		if (oldrg->rg_vnode != NULL) {
+			VOP_INCREF(oldrg->rg_vnode);
+			newrg->rg_vnode = oldrg->rg_vnode;
+			newrg->rg_fileoffset = oldrg->rg_fileoffset;
+			newrg->rg_filevaddr = oldrg->rg_filevaddr;
+			newrg->rg_filesize = oldrg->rg_filesize;
+		}
+		if (oldrg->rg_pcfile != NULL) {
+			pagecache_incref(oldrg->rg_pcfile);
+			newrg->rg_pcfile = oldrg->rg_pcfile;
+			newrg->rg_pcoffset = oldrg->rg_pcoffset;
+			newrg->rg_shared = oldrg->rg_shared;
+		}
+		newrg->rg_advice = oldrg->rg_advice;
 
-	/* (Mis)use as_prepare_load to allocate some physical memory. */
-	if (as_prepare_load(new)) {
-		as_destroy(new);
-		return ENOMEM;
+		/*
+		 * Share every frame the parent has touched instead of
+		 * copying it; vm_fault maps shared frames read-only and
+		 * copies them on the first write. Pages the parent has
+		 * out in swap are read back in first and shared too.
+		 */
+		for (j=0; j<oldrg->rg_npages; j++) {
+			va = oldrg->rg_vbase + j * PAGE_SIZE;
+			oldpte = as_pte(old, va);
+			if (oldpte == NULL || *oldpte == 0) {
+				continue;
+			}
+			/*
+			 * This may evict, so do it before any swap-in.
+			 * Either may drop vm_pagelock, and the pager may
+			 * be writing the parent's page out; wait for it.
+			 */
+			result = as_pte_alloc(new, va, &newpte);
+			if (result) {
+				lock_release(vm_pagelock);
+				as_destroy(new);
+				return result;
+			}
+			vm_busywait(oldpte);
+			if (*oldpte & PTE_SWAPPED) {
+				result = vm_pagein(old, oldrg, j,
+						   VM_FAULT_READ);
+				if (result) {
+					lock_release(vm_pagelock);
+					as_destroy(new);
+					return result;
+				}
+			}
+			if (*oldpte & PTE_VALID) {
+				coremap_incref(PTE_FRAME(*oldpte));
+				*newpte = *oldpte;
+				if (PTE_FRAME(*oldpte) != vm_zeroframe) {
+					new->as_rss++;
+				}
+			}
+		}
 	}
+	/*
+	 * The parent (the current process) may still have writeable
+	 * TLB entries, on this cpu or others it ran on, for frames that
+	 * are now shared. Drop them so its next write faults and breaks
+	 * the sharing.
+	 */
+	as_retire(old);
+	lock_release(vm_pagelock);
 
-	KASSERT(new->as_pbase1 != 0);
-	KASSERT(new->as_pbase2 != 0);
-	KASSERT(new->as_stackpbase != 0);
-
-	memmove((void *)PADDR_TO_KVADDR(new->as_pbase1),
-		(const void *)PADDR_TO_KVADDR(old->as_pbase1),
-		old->as_npages1*PAGE_SIZE);
-
-	memmove((void *)PADDR_TO_KVADDR(new->as_pbase2),
-		(const void *)PADDR_TO_KVADDR(old->as_pbase2),
-		old->as_npages2*PAGE_SIZE);
+	new->elf_finished = old->elf_finished;
+	new->as_stackmax = old->as_stackmax;
+	new->as_heapbreak = old->as_heapbreak;
+	new->as_maxrss = new->as_rss;
+	new->as_vsize = old->as_vsize;
+	new->as_rsslimit = old->as_rsslimit;
 
-	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
-		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
-		DUMBVM_STACKPAGES*PAGE_SIZE);
-	
 	*ret = new;
 	return 0;
 }
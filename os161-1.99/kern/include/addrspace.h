@@ -35,11 +35,97 @@
  */
 
 
+#include <array.h>
+#include <spinlock.h>
 #include <vm.h>
 
 struct vnode;
+struct pcfile;
 
 
+/*
+ * Region - a page-aligned range of user virtual memory (a program
+ * segment, the heap, the stack or a mapped file). Its pages' entries
+ * live in the address space's page table. Frames are allocated one at
+ * a time by vm_fault on first touch, and may later be evicted to swap.
+ * An address space may have any number of regions.
+ *
+ * A program segment also remembers where its contents live in the
+ * executable: RG_FILESIZE bytes at RG_FILEOFFSET in RG_VNODE belong at
+ * RG_FILEVADDR. vm_fault reads each page from there on first touch;
+ * the rest of the region is zero-filled.
+ *
+ * A region made by mmap instead maps the pages of a file from the page
+ * cache (RG_PCFILE), starting at file offset RG_PCOFFSET. Writes to a
+ * MAP_SHARED mapping (RG_SHARED) go straight to the cached frames and
+ * are written back to the file when it is synced or unmapped; writes
+ * to a MAP_PRIVATE one get private copies, as after fork.
+ */
+struct region {
+  vaddr_t rg_vbase;		/* first virtual address */
+  size_t rg_npages;		/* length in pages */
+  bool rg_writeable;		/* writes allowed once loaded */
+  struct vnode *rg_vnode;	/* backing executable, or NULL */
+  off_t rg_fileoffset;		/* where the file data starts on disk */
+  vaddr_t rg_filevaddr;		/* ...and in memory */
+  size_t rg_filesize;		/* length of the file data */
+  struct pcfile *rg_pcfile;	/* mapped file, or NULL */
+  off_t rg_pcoffset;		/* file offset of rg_vbase */
+  bool rg_shared;		/* MAP_SHARED */
+  int rg_advice;		/* MADV_NORMAL, _RANDOM or _SEQUENTIAL */
+};
+
+/*
+ * Page table. Each address space has a two-level table: a directory of
+ * PT_NDIR pointers, one per 4M of user space, to leaf tables of
+ * PT_NLEAF entries, one per page. Leaves are allocated the first time a
+ * page in their 4M is touched and kept until the address space is
+ * destroyed, so translating an address is two array lookups no matter
+ * how many regions there are.
+ */
+#define PT_NDIR		(USERSPACETOP >> 22)
+#define PT_NLEAF	(PAGE_SIZE / sizeof(uint32_t))
+#define PT_DIRINDEX(va)	((va) >> 22)
+#define PT_LEAFINDEX(va)	(((va) >> 12) & (PT_NLEAF - 1))
+
+/*
+ * Page table entries. An entry is 0 if the page has never been
+ * touched. Otherwise the PAGE_FRAME bits hold either the physical
+ * frame (PTE_VALID) or the swap slot number (PTE_SWAPPED), and the low
+ * bits describe the page:
+ *
+ *    PTE_DIRTY      in a MAP_SHARED region, written since it was last
+ *                   written back; only such pages are mapped writeable.
+ *    PTE_REFERENCED loaded into the TLB since it was brought in, or
+ *                   since the process last looked for one of its own
+ *                   pages to evict.
+ *    PTE_BUSY       being read in, written out or copied, with
+ *                   vm_pagelock dropped; nobody else may change the
+ *                   entry until the bit is clear (see dumbvm.c).
+ *    PTE_WRITE      its region allows writes once loading is done.
+ *    PTE_SHARED     its region is MAP_SHARED.
+ *    PTE_SEQUENTIAL/PTE_RANDOM
+ *                   its region's madvise access pattern.
+ *
+ * The last four (PTE_ATTRS) are copied from the region when the page
+ * is first touched and follow the page in and out of swap, so that a
+ * TLB miss on a resident page needs nothing but its entry.
+ */
+#define PTE_VALID	0x00000001
+#define PTE_SWAPPED	0x00000002
+#define PTE_DIRTY	0x00000004
+#define PTE_REFERENCED	0x00000008
+#define PTE_WRITE	0x00000010
+#define PTE_SHARED	0x00000020
+#define PTE_SEQUENTIAL	0x00000040
+#define PTE_RANDOM	0x00000080
+#define PTE_BUSY	0x00000100
+#define PTE_ATTRS	(PTE_WRITE | PTE_SHARED | PTE_SEQUENTIAL | PTE_RANDOM)
+#define PTE_FRAME(pte)	((paddr_t)((pte) & PAGE_FRAME))
+#define PTE_SLOT(pte)	((unsigned)((pte) / PAGE_SIZE))
+#define PTE_MKFRAME(paddr)	((uint32_t)(paddr) | PTE_VALID)
+#define PTE_MKSLOT(slot)	((uint32_t)(slot) * PAGE_SIZE | PTE_SWAPPED)
+
 /* 
  * Address space - data structure associated with the virtual memory
  * space of a process.
@@ -48,16 +134,37 @@ struct vnode;
  */
 
 struct addrspace {
-  vaddr_t as_vbase1;
-  paddr_t as_pbase1;
-  size_t as_npages1;
-  vaddr_t as_vbase2;
-  paddr_t as_pbase2;
-  size_t as_npages2;
-  paddr_t as_stackpbase;
+  struct array *as_regions;	/* struct region *, unordered */
+  uint32_t **as_pgdir;		/* page table directory, see above */
   bool elf_finished;
+  struct region *as_heap;	/* the heap, also in as_regions */
+  vaddr_t as_heapbreak;		/* current end of the heap */
+  struct region *as_stack;	/* the stack, also in as_regions */
+  size_t as_stackmax;		/* most pages the stack may grow to */
+  unsigned as_fa_window;	/* fault-around window, in pages */
+  vaddr_t as_fa_end;		/* just past the last window, or 0 */
+  struct spinlock as_lock;	/* protects the page table */
+  uint64_t as_id;		/* unique identity, for the TLB */
+  uint32_t as_cpus;		/* cpus that have run it as as_id */
+
+  /* Accounting, in pages; see as_setlimit. */
+  size_t as_rss;		/* resident pages, but not the zero frame */
+  size_t as_maxrss;		/* most ever resident at once */
+  size_t as_vsize;		/* pages in all regions */
+  size_t as_rsslimit;		/* soft limit on as_rss, or AS_NOLIMIT */
+  unsigned as_rsshand;		/* page number the own-page clock is at */
+  unsigned as_nbusy;		/* pages marked PTE_BUSY */
+  unsigned as_minflt;		/* page faults served without I/O */
+  unsigned as_majflt;		/* page faults that had to read */
+
+  struct addrspace *as_next;	/* on the list of all address spaces */
 };
 
+#define AS_NOLIMIT	((size_t)-1)
+
+/* Most pages the stack may grow to, unless RLIMIT_STACK says otherwise. */
+#define AS_STACKPAGES	1024
+
 /*
  * Functions in addrspace.c:
  *
@@ -83,15 +190,52 @@ struct addrspace {
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_define_file - note that FILESIZE bytes at OFFSET in vnode V are
+ *                the initial contents of the MEMSIZE-byte segment at
+ *                VADDR, and the rest of it is zeros. Nothing is read
+ *                until the pages are touched.
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
  *    as_complete_load - this is called when loading from an executable
  *                is complete.
  *
+ *    as_sbrk   - move the end of the heap by AMOUNT bytes, handing back
+ *                the old end. Shrinking releases the pages cut off.
+ *
+ *    as_mmap   - map LEN bytes of vnode V from OFFSET at an address of
+ *                the kernel's choosing, handed back in ADDR. PROT and
+ *                FLAGS are as for mmap.
+ *
+ *    as_munmap - remove the mappings, or the parts of them, in the LEN
+ *                bytes from ADDR, writing back what was written to
+ *                them. Pages in the range that aren't mapped are
+ *                skipped, but any other kind of region there makes it
+ *                fail with EINVAL.
+ *
+ *    as_sync   - write back every page written through a shared
+ *                mapping of V.
+ *
+ *    as_madvise - act on ADVICE (MADV_*) for the pages from ADDR to
+ *                ADDR+LEN. Access-pattern advice applies to the whole
+ *                regions those pages are in.
+ *
+ *    as_mincore - set VEC[i] to the MINCORE_* bits for the i'th of the
+ *                NPAGES pages from ADDR, or to 0 if it isn't resident.
+ *
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_getlimit/as_setlimit - get or set the RLIMIT_RSS or
+ *                RLIMIT_STACK limit of AS, in bytes (RLIM_INFINITY for
+ *                none). A process over its RSS limit pushes its own
+ *                pages out to swap to make room for new ones before it
+ *                takes frames from anybody else; without swap the limit
+ *                isn't enforced. The stack limit can't be lowered below
+ *                the stack's current size, or raised into the heap or a
+ *                mapping.
  */
 
 struct addrspace *as_create(void);
@@ -105,9 +249,27 @@ int               as_define_region(struct addrspace *as,
                                    int readable, 
                                    int writeable,
                                    int executable);
+int               as_define_file(struct addrspace *as, struct vnode *v,
+                                 off_t offset, vaddr_t vaddr,
+                                 size_t memsize, size_t filesize);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr, int argc, char **argv);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+int               as_mmap(struct addrspace *as, struct vnode *v,
+                          off_t offset, size_t len, int prot, int flags,
+                          vaddr_t *addr);
+int               as_munmap(struct addrspace *as, vaddr_t addr, size_t len);
+int               as_sync(struct addrspace *as, struct vnode *v);
+int               as_madvise(struct addrspace *as, vaddr_t addr,
+                             size_t len, int advice);
+int               as_mincore(struct addrspace *as, vaddr_t addr,
+                             size_t npages, char *vec);
+int               as_getlimit(struct addrspace *as, int resource,
+                              rlim_t *limit);
+int               as_setlimit(struct addrspace *as, int resource,
+                              rlim_t limit);
 
 
 /*
@@ -58,6 +58,9 @@
 
 void hardclock_bootstrap(void);
 
+/* Set how many hardclocks apart priorities are reset (kernel menu "boost"). */
+void hardclock_setschedule(unsigned hardclocks);
+
 void hardclock(void);
 void timerclock(void);
 
@@ -0,0 +1,95 @@
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * Physical frame allocator.
+ *
+ * Every frame of RAM left over after the kernel is loaded is tracked
+ * by an entry in the coremap. Free frames are kept by a binary buddy
+ * allocator: a free block of order k is 2^k frames long and starts on
+ * a frame index that is a multiple of 2^k, and there is one free list
+ * per order. Allocation splits the smallest block that is big enough
+ * and freeing merges a block with its buddy for as long as the buddy
+ * is also free, so both take O(log n) time in the number of frames.
+ *
+ * Single frames, by far the most common request, are served from a
+ * small per-cpu cache (c_framecache in struct cpu) that is refilled
+ * from and drained to the buddy allocator in batches, so they usually
+ * don't take the coremap lock at all.
+ *
+ * Before coremap_bootstrap is called, allocations are satisfied by
+ * ram_stealmem and can never be freed.
+ *
+ *    coremap_bootstrap - take over the rest of physical memory.
+ *
+ *    coremap_alloc     - allocate NPAGES physically contiguous frames.
+ *                        Returns 0 if no run that long is free.
+ *
+ *    coremap_free      - free a run returned by coremap_alloc.
+ *
+ *    coremap_freeframes - the number of free frames, not counting the
+ *                        per-cpu caches. Read without locking, so only
+ *                        a hint.
+ *
+ *    coremap_incref/coremap_decref/coremap_refcount
+ *                      - reference counts for single frames shared
+ *                        by several page tables. A frame starts with
+ *                        one reference; coremap_decref frees it when
+ *                        the count reaches zero.
+ *
+ *    coremap_claim     - note that AS maps the user frame at VADDR and
+ *                        has just used it. Only a frame with a single
+ *                        reference keeps an owner (coremap_incref
+ *                        clears it), since only such a frame can be
+ *                        evicted by rewriting one page table entry.
+ *                        The pager finds shared frames through their
+ *                        mappings instead (vm_evict_shared, dumbvm.c).
+ *
+ *    coremap_unreference - clear the frame's reference bit, so that the
+ *                        clock takes it as soon as it comes round.
+ *
+ *    coremap_victim    - choose a user frame to evict, by a clock
+ *                        (second chance) sweep over frames that have
+ *                        an owner. Returns 0 if there are none.
+ *                        The victim's owner is cleared, so it isn't
+ *                        chosen again before it is next claimed.
+ *                        The caller must hold vm_pagelock (dumbvm.c)
+ *                        so that the frame and its owner stay put.
+ *
+ *    coremap_settag/coremap_gettag
+ *                      - a word kept with each frame for the use of
+ *                        the kernel code that allocated it: kmalloc
+ *                        notes there which of its pages a frame is
+ *                        part of, so kfree needn't search for it. The
+ *                        frame's owner sets and reads the tag without
+ *                        locking. Frames come from coremap_alloc with
+ *                        tag 0 and must go back to coremap_free that
+ *                        way. Frames stolen before coremap_bootstrap
+ *                        have no entry: coremap_settag returns false
+ *                        for them, and coremap_gettag 0.
+ *
+ *    coremap_printstats - print the free lists, a fragmentation
+ *                        summary and the per-cpu cache hit rates
+ *                        (kernel menu "cm").
+ */
+
+void coremap_bootstrap(void);
+paddr_t coremap_alloc(unsigned long npages);
+void coremap_free(paddr_t paddr);
+unsigned coremap_freeframes(void);
+
+void coremap_incref(paddr_t paddr);
+void coremap_decref(paddr_t paddr);
+unsigned coremap_refcount(paddr_t paddr);
+
+struct addrspace;
+void coremap_claim(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+void coremap_unreference(paddr_t paddr);
+paddr_t coremap_victim(struct addrspace **as, vaddr_t *vaddr);
+
+bool coremap_settag(paddr_t paddr, unsigned npages, unsigned tag);
+unsigned coremap_gettag(paddr_t paddr);
+
+void coremap_printstats(void);
+
+#endif /* _COREMAP_H_ */
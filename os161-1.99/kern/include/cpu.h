@@ -34,8 +34,24 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include <machine/tlb.h> /* for NUM_TLB */
 
 
+/*
+ * Size of the per-cpu free frame cache, and the number of frames moved
+ * to or from the coremap at once when it runs empty or full.
+ */
+#define CPU_FRAMECACHE_SIZE   16
+#define CPU_FRAMECACHE_BATCH  8
+
+/*
+ * Number of kmalloc size classes the per-cpu block caches have room
+ * for, and the most free blocks cached per class (fewer for the big
+ * classes; see vm/kmalloc.c).
+ */
+#define CPU_KMCACHE_CLASSES   10
+#define CPU_KMCACHE_SIZE      16
+
 /*
  * Per-cpu structure
  *
@@ -61,6 +77,58 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 *
+	 * A small stack of free single frames taken from the coremap in
+	 * batches, so that most single-page allocations and frees don't
+	 * touch the coremap lock. See vm/coremap.c.
+	 */
+	paddr_t c_framecache[CPU_FRAMECACHE_SIZE];
+	unsigned c_framecache_count;	/* Frames currently cached */
+	unsigned c_framecache_hits;	/* Allocations served from the cache */
+	unsigned c_framecache_misses;	/* Allocations that had to refill */
+
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 *
+	 * Free kmalloc blocks of each size class, taken from and given
+	 * back to the subpage allocator in batches, so that most small
+	 * allocations and frees don't take its lock. See vm/kmalloc.c.
+	 */
+	void *c_kmcache[CPU_KMCACHE_CLASSES][CPU_KMCACHE_SIZE];
+	unsigned c_kmcache_count[CPU_KMCACHE_CLASSES];
+	unsigned c_kmcache_hits;	/* Allocations served from the cache */
+	unsigned c_kmcache_misses;	/* Allocations that had to refill */
+
+	/*
+	 * Set by any cpu, cleared by this one.
+	 *
+	 * kheap_reclaim can't empty another cpu's caches, so it sets
+	 * this instead; the cpu flushes them at its next kmalloc or kfree.
+	 */
+	volatile bool c_kmcache_flushreq;
+
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 *
+	 * Hardware address space IDs. c_asid_owner[i] is the as_id of
+	 * the address space whose TLB entries are tagged with ASID i,
+	 * or 0; c_asid is the ASID in use now and c_asid_next the next
+	 * one to recycle. See as_activate.
+	 */
+	uint64_t c_asid_owner[NUM_ASID];
+	unsigned c_asid;
+	unsigned c_asid_next;
+
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * TLB replacement state: the next slot the round-robin or clock
+	 * policy considers, and the clock's per-slot reference bits.
+	 */
+	unsigned c_tlb_hand;
+	bool c_tlb_ref[NUM_TLB];
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
@@ -86,7 +154,19 @@ struct cpu {
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	unsigned c_shootdown_ticket;	/* Shootdown batches queued */
+	unsigned c_shootdown_done;	/* ...and acted on */
 	struct spinlock c_ipi_lock;
+
+	/*
+	 * Shootdown counters. c_ipi_tlbsent is bumped by this cpu
+	 * while holding the target's IPI lock, the others by this cpu
+	 * while holding its own.
+	 */
+	unsigned c_ipi_tlbsent;		/* Shootdown IPIs sent */
+	unsigned c_ipi_tlbtaken;	/* Shootdown IPIs taken */
+	unsigned c_ipi_tlbentries;	/* Entries invalidated for them */
+	unsigned c_ipi_tlbflushall;	/* Taken as a full flush */
 };
 
 #define TLBSHOOTDOWN_ALL  (-1)
@@ -109,6 +189,12 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Look up cpus by software number, 0 .. cpu_count()-1.
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned software_number);
+
 /*
  * Return a string describing the CPU type.
  */
@@ -152,6 +238,12 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_batch queues N shootdowns on one CPU and sends it a
+ * single IPI; if that overflows the CPU's queue, or N is more than
+ * TLBSHOOTDOWN_MAX, the CPU flushes its whole TLB instead (and
+ * MAPPINGS is not looked at). It returns a ticket to pass to
+ * ipi_tlbshootdown_wait, which waits until the CPU has acted on the
+ * batch. Waiting needs interrupts on, so no spinlocks may be held.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -166,6 +258,10 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_batch(struct cpu *target,
+				const struct tlbshootdown *mappings,
+				unsigned n);
+void ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket);
 
 void interprocessor_interrupt(void);
 
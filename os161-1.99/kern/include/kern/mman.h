@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Definitions for mmap(), munmap() and madvise(), shared by the
+ * kernel and <sys/mman.h> in libc.
+ */
+
+/* Protection (the PROT argument to mmap) */
+#define PROT_NONE     0x0    /* Page may not be accessed */
+#define PROT_READ     0x1    /* Page may be read */
+#define PROT_WRITE    0x2    /* Page may be written */
+#define PROT_EXEC     0x4    /* Page may be executed */
+
+/* Sharing (the FLAGS argument to mmap); exactly one is required */
+#define MAP_SHARED    0x1    /* Writes go to the file */
+#define MAP_PRIVATE   0x2    /* Writes are private copies */
+
+/* Paging advice (the ADVICE argument to madvise) */
+#define MADV_NORMAL     0    /* No particular pattern */
+#define MADV_RANDOM     1    /* Random access; don't prefetch */
+#define MADV_SEQUENTIAL 2    /* Sequential access; prefetch hard */
+#define MADV_WILLNEED   3    /* Bring the pages in now */
+#define MADV_DONTNEED   4    /* Drop the pages; refill them on next use */
+
+/* Page state (the bits of each byte mincore fills in) */
+#define MINCORE_INCORE     0x1    /* Resident in memory */
+#define MINCORE_REFERENCED 0x2    /* Used since it was brought in */
+#define MINCORE_MODIFIED   0x4    /* Written through a shared mapping */
+
+/* Returned by mmap on failure */
+#define MAP_FAILED    ((void *)-1)
+
+
+#endif /* _KERN_MMAN_H_ */
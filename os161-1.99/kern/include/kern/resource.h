@@ -67,6 +67,8 @@ struct rusage {
 	__counter_t ru_nsignals;	/* signals delivered (count) */
 	__counter_t ru_nvcsw;		/* voluntary context switches (count)*/
 	__counter_t ru_nivcsw;		/* involuntary ditto (count) */
+	__size_t ru_rss;		/* current RSS (kb) */
+	__size_t ru_vsize;		/* current virtual size (kb) */
 };
 
 /* limit codes for getrusage/setrusage */
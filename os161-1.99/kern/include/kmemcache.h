@@ -0,0 +1,48 @@
+#ifndef _KMEMCACHE_H_
+#define _KMEMCACHE_H_
+
+/*
+ * Object caches for fixed-size kernel objects.
+ *
+ * A cache hands out objects of one exact size, carved from one-page
+ * slabs, so hot structures (threads, procs, locks, ...) don't pay for
+ * kmalloc's power-of-two rounding or its size-class search. A cache
+ * can also keep its free objects constructed: CTOR is run on each
+ * object when its slab is created and DTOR when the slab is given
+ * back, not on every alloc and free, so whatever CTOR sets up (a wait
+ * channel, say) survives from one use of the object to the next.
+ * kmem_cache_free must therefore be handed objects in their
+ * constructed state.
+ *
+ *    kmem_cache_create  - make a cache of SIZE-byte objects called NAME
+ *                         (which should be a string constant). CTOR
+ *                         returns 0 or an error code; either hook may
+ *                         be NULL. Caches are never destroyed. Returns
+ *                         NULL if out of memory.
+ *
+ *    kmem_cache_alloc   - get an object, or NULL if out of memory.
+ *
+ *    kmem_cache_free    - give back an object from the same cache.
+ *
+ *    kmem_cache_reclaim - give back all caches' empty slabs. For the
+ *                         reclaim callback table (reclaim.h); doesn't
+ *                         sleep, so neither may any DTOR.
+ *
+ *    kmem_cache_printstats - print each cache's size and use (kernel
+ *                         menu "kh").
+ *
+ * CTOR and DTOR are called without any of the cache's locks held and
+ * may kmalloc and kfree.
+ */
+
+struct kmem_cache;
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+int kmem_cache_reclaim(void);
+void kmem_cache_printstats(void);
+
+#endif /* _KMEMCACHE_H_ */
@@ -122,10 +122,18 @@ uint32_t random(void);
 /*
  * Kernel heap memory allocation. Like malloc/free.
  * If out of memory, kmalloc returns NULL.
+ *
+ * kvmalloc is for big buffers that needn't be physically contiguous;
+ * see kmalloc.c for what that memory can't be used for. Its blocks
+ * are freed with kvfree, which may wait, so not with a spinlock held.
  */
 void *kmalloc(size_t size);
+void *kvmalloc(size_t size);
 void kfree(void *ptr);
+void kvfree(void *ptr);
 void kheap_printstats(void);
+void kheap_printprofile(unsigned nsites);	/* options kheapprof only */
+int kheap_reclaim(void);
 
 /*
  * C string functions. 
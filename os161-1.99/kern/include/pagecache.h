@@ -0,0 +1,103 @@
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+/*
+ * Page cache for mapped files.
+ *
+ * Each vnode that is mapped into some address space has a pcfile
+ * holding the pages of it that have been read so far, hashed by file
+ * offset. Every mapping of the file maps the cached frames directly,
+ * so a page is read from disk once no matter how many processes use
+ * it, and never copied. The cache holds one coremap reference on each
+ * of its frames and each page table entry mapping one holds another.
+ * When memory runs short the pager drops mappings of cached pages
+ * (vm_evict_shared in dumbvm.c), and pagecache_reclaim then frees the
+ * pages nothing maps any more, so a mapping can be bigger than memory.
+ *
+ * When the last mapping goes away the pcfile is kept, idle, so that
+ * running the same program again (see as_define_file) finds its text
+ * already in memory. Up to PC_MAXIDLE files are kept that way; past
+ * that, or when memory runs short, the file that has been idle longest
+ * is dropped as a whole. Since an idle file keeps a reference to its
+ * vnode, the filesystem it lives on can't be unmounted until then.
+ *
+ * The cache does not track dirty pages itself. Mappings do, in their
+ * page tables, and write pages back with pagecache_writeback when they
+ * are synced or unmapped.
+ *
+ * All of these but pagecache_read and pagecache_writeback are called
+ * with vm_pagelock (dumbvm.c) held. Those two do the disk I/O, and are
+ * called without it.
+ *
+ *    pagecache_get     - find or create the pcfile for VN and add a
+ *                        mapping reference to it.
+ *
+ *    pagecache_incref  - add a mapping reference (for fork).
+ *
+ *    pagecache_put     - drop a mapping reference; after the last one
+ *                        the file is idle.
+ *
+ *    pagecache_reclaim - free the pages of the file that has been idle
+ *                        longest, or if no file is idle, the pages of
+ *                        files in use that no mapping maps. Returns
+ *                        ENOMEM if there were none. Registered as a
+ *                        reclaim callback (reclaim.h).
+ *
+ *    pagecache_forget  - drop the cached pages of VN that no mapping
+ *                        maps, after it has been written other than
+ *                        through a mapping, so that the next mapping
+ *                        reads it afresh. Pages still mapped keep what
+ *                        they held.
+ *
+ *    pagecache_lookup  - hand back in PADDR the frame caching the page
+ *                        at OFFSET, with a new reference for the
+ *                        caller. Returns ENOENT if the page is not
+ *                        cached, or EBUSY if somebody is still reading
+ *                        it in (see pagecache_add).
+ *
+ *    pagecache_peek    - return the frame caching the page at OFFSET,
+ *                        without adding a reference, or 0 if it isn't
+ *                        cached or is still being read in.
+ *
+ *    pagecache_add     - add the frame at PADDR to the cache as the
+ *                        page at OFFSET, which must not be cached. The
+ *                        caller's reference to the frame becomes the
+ *                        mapping's; the cache takes one of its own. The
+ *                        page is busy until the caller has filled the
+ *                        frame with pagecache_read and reported how
+ *                        that went with pagecache_done; lookups return
+ *                        EBUSY meanwhile.
+ *
+ *    pagecache_read    - read the page at OFFSET into the frame at
+ *                        PADDR, zero-filling past end of file.
+ *
+ *    pagecache_done    - finish adding the page at OFFSET. If RESULT
+ *                        is 0 it is ready; otherwise the read failed,
+ *                        and the page is taken out of the cache again.
+ *
+ *    pagecache_writeback - write the page at OFFSET from PADDR back to
+ *                        the file. Nothing past end of file is written,
+ *                        so a mapping never makes a file longer.
+ *
+ *    pagecache_vnode   - the vnode a pcfile caches.
+ */
+
+struct vnode;
+struct pcfile;
+
+struct pcfile *pagecache_get(struct vnode *vn);
+void pagecache_incref(struct pcfile *pf);
+void pagecache_put(struct pcfile *pf);
+int pagecache_reclaim(void);
+void pagecache_forget(struct vnode *vn);
+
+int pagecache_lookup(struct pcfile *pf, off_t offset, paddr_t *paddr);
+paddr_t pagecache_peek(struct pcfile *pf, off_t offset);
+int pagecache_add(struct pcfile *pf, off_t offset, paddr_t paddr);
+int pagecache_read(struct pcfile *pf, off_t offset, paddr_t paddr);
+void pagecache_done(struct pcfile *pf, off_t offset, int result);
+int pagecache_writeback(struct pcfile *pf, off_t offset, paddr_t paddr);
+
+struct vnode *pagecache_vnode(struct pcfile *pf);
+
+#endif /* _PAGECACHE_H_ */
@@ -40,7 +40,10 @@
 #include <synch.h>
 #include <thread.h> /* required for struct threadarray */
 
+#include <limits.h>
+
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 struct addrspace;
 struct vnode;
@@ -81,6 +84,22 @@ struct proc {
     struct lock *proc_lock;
     int exit_status;
 #endif
+#if OPT_A3
+    /*
+     * Open files, indexed by descriptor. Descriptors 0-2 always go to
+     * the console (see sys_write), so those slots stay empty.
+     */
+    struct vnode *p_files[OPEN_MAX];
+    int p_fileflags[OPEN_MAX];		/* open() flags */
+    off_t p_fileoffset[OPEN_MAX];	/* where read/write go next */
+
+    /*
+     * Resource limits, in bytes. The address space enforces them;
+     * these are kept so that exec can give the new one the same.
+     */
+    rlim_t p_rsslimit;			/* RLIMIT_RSS */
+    rlim_t p_stacklimit;		/* RLIMIT_STACK */
+#endif
 };
 
 /* This is the process structure for the kernel and for kernel-only threads. */
@@ -119,5 +138,22 @@ bool is_proc_alive(pid_t pid);
 struct proc *get_proc_by_pid(pid_t pid);
 #endif
 
+#if OPT_A3
+/* Give TO its own reference to each of FROM's open files, for fork. */
+void proc_copyfiles(struct proc *from, struct proc *to);
+
+/* Look up descriptor FD of the current process. */
+int proc_getfile(int fd, struct vnode **vn, int *flags);
+
+/* Give TO FROM's resource limits, for fork. */
+void proc_copylimits(struct proc *from, struct proc *to);
+
+/* Apply the current process's resource limits to AS, for exec. */
+int proc_setaslimits(struct addrspace *as);
+
+/* List user processes by resident set size (kernel menu "ps"). */
+void proc_printmem(void);
+#endif
+
 
 #endif /* _PROC_H_ */
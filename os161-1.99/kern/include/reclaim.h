@@ -0,0 +1,41 @@
+#ifndef _RECLAIM_H_
+#define _RECLAIM_H_
+
+/*
+ * Memory-pressure callbacks.
+ *
+ * Subsystems that hold memory they could give back on demand, such as
+ * caches and pools of free objects, register a callback here. When
+ * the frame allocator can't satisfy a request, alloc_kpages and
+ * vm_evict run the callbacks, cheapest first, before evicting user
+ * pages or failing the allocation.
+ *
+ * A callback gives back what it can, ideally at least a frame, and
+ * returns 0 if it freed anything or ENOMEM if it had nothing to give.
+ * A callback registered with RECLAIM_SLEEPS may block, and is only
+ * called by vm_evict (dumbvm.c), with vm_pagelock held; the others
+ * must not sleep, since they are also called for kernel allocations,
+ * which can't wait for the pager (see alloc_kpages).
+ *
+ *    reclaim_register  - add FN under NAME. COST orders the callbacks:
+ *                        lower costs are tried first. Call only while
+ *                        booting, before anything can run reclaim_run.
+ *
+ *    reclaim_run       - call the callbacks in order of cost until one
+ *                        frees something; if CANSLEEP is false, skip
+ *                        those that sleep. Returns ENOMEM if none did.
+ *
+ *    reclaim_printstats - print how often each callback was called and
+ *                        how often it helped (kernel menu "cm").
+ */
+
+typedef int (*reclaim_fn)(void);
+
+#define RECLAIM_SLEEPS	0x1
+
+void reclaim_register(const char *name, reclaim_fn fn, unsigned cost,
+		      int flags);
+int reclaim_run(bool cansleep);
+void reclaim_printstats(void);
+
+#endif /* _RECLAIM_H_ */
@@ -0,0 +1,41 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space.
+ *
+ * Evicted user pages are written to a dedicated raw disk, divided into
+ * page-sized slots. A bitmap records which slots are in use. If the
+ * disk cannot be opened at boot, swapping is simply turned off and
+ * allocations fail when memory runs out, as they did before.
+ *
+ *    swap_bootstrap - open SWAP_DEVICE and size the slot bitmap.
+ *
+ *    swap_enabled   - true if there is a swap disk.
+ *
+ *    swap_alloc     - reserve a free slot. Returns ENOSPC if the swap
+ *                     disk is full.
+ *
+ *    swap_free      - release a slot.
+ *
+ *    swap_pagein/swap_pageout
+ *                   - copy one page between a physical frame and a
+ *                     slot. These sleep, so no spinlocks may be held.
+ *
+ *    swap_printstats - print slot usage (kernel menu "sw").
+ */
+
+#define SWAP_DEVICE "lhd1raw:"
+
+void swap_bootstrap(void);
+bool swap_enabled(void);
+
+int swap_alloc(unsigned *slot);
+void swap_free(unsigned slot);
+
+int swap_pagein(paddr_t paddr, unsigned slot);
+int swap_pageout(paddr_t paddr, unsigned slot);
+
+void swap_printstats(void);
+
+#endif /* _SWAP_H_ */
@@ -37,6 +37,13 @@
 
 #include <spinlock.h>
 
+/*
+ * Set up the allocators for semaphores, locks, and CVs. Called once,
+ * early in boot, after wchan_bootstrap and before anything creates
+ * one of them.
+ */
+void synch_bootstrap(void);
+
 /*
  * Dijkstra-style semaphore.
  *
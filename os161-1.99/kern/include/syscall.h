@@ -31,6 +31,7 @@
 #define _SYSCALL_H_
 
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 struct trapframe; /* from <machine/trapframe.h> */
 
@@ -65,9 +66,33 @@ void sys__exit(int exitcode);
 int sys_getpid(pid_t *retval);
 int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
 #if OPT_A2
+/*
+ * Make the cache the parent's trapframe is copied into for a forked
+ * child, and free a copy once the child has taken it (for
+ * enter_forked_process).
+ */
+void fork_bootstrap(void);
+void fork_tffree(struct trapframe *tf);
+
 int sys_fork(struct trapframe *tf, pid_t *retval);
 int sys_execv(userptr_t program, userptr_t args);
 #endif
+#if OPT_A3
+int sys_open(userptr_t path, int flags, mode_t mode, int *retval);
+int sys_close(int fd);
+int sys_fsync(int fd);
+int sys_read(int fdesc, userptr_t ubuf, unsigned int nbytes, int *retval);
+int sys_remove(userptr_t path);
+int sys_sbrk(intptr_t amount, vaddr_t *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags,
+             userptr_t usp, vaddr_t *retval);
+int sys_munmap(userptr_t addr, size_t len);
+int sys_madvise(userptr_t addr, size_t len, int advice);
+int sys_mincore(userptr_t addr, size_t len, userptr_t vec);
+int sys_getrusage(int who, userptr_t usage);
+int sys_getrlimit(int resource, userptr_t rlp);
+int sys_setrlimit(int resource, const_userptr_t rlp);
+#endif
 #endif // UW
 
 #endif /* _SYSCALL_H_ */
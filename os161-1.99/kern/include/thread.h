@@ -83,6 +83,8 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	unsigned t_priority;		/* Scheduling level; 0 is highest */
+	unsigned t_ticks;		/* Hardclocks used at this level */
 
 	/*
 	 * Interrupt state fields.
@@ -157,6 +159,18 @@ void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Make the current thread a background thread: one that runs only
+ * when nothing else on its cpu is ready to.
+ */
+void thread_setbackground(void);
+
+/*
+ * Charge a hardclock to the current thread. Returns true if it should
+ * yield. Called from the timer interrupt.
+ */
+bool thread_tick(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
@@ -39,6 +39,8 @@
 
 #include <machine/vm.h>
 
+struct vnode;
+
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
 #define VM_FAULT_WRITE       1    /* A write was attempted */
@@ -55,6 +57,30 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/*
+ * Allocate/free kernel pages that are contiguous only virtually, in
+ * kseg2 (called by kvmalloc/kvfree), and print how much is mapped.
+ */
+vaddr_t alloc_kvpages(unsigned npages);
+void free_kvpages(vaddr_t addr);
+void kvpages_printstats(void);
+
+/*
+ * Forget what the page cache holds of VN after write() changed it
+ * (called by sys_write). Mappings that already map a page keep seeing
+ * the old contents until they are remade.
+ */
+void vm_filewritten(struct vnode *vn);
+
+/* Choose the TLB replacement policy by name (kernel menu "tlbpolicy") */
+int vm_set_tlbpolicy(const char *name);
+
+/* Turn fault-around prefetching on or off (kernel menu "faultaround") */
+void vm_set_faultaround(bool on);
+
+/* Print per-cpu TLB shootdown counters (kernel menu "ts") */
+void vm_tlbprintstats(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
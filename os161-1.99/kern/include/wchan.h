@@ -37,6 +37,12 @@
 
 struct wchan; /* Opaque */
 
+/*
+ * Set up the allocator wait channels come from. Called once, early
+ * in boot, before any wchan_create.
+ */
+void wchan_bootstrap(void);
+
 /*
  * Create a wait channel. Use NAME as a symbolic name for the channel.
  * NAME should be a string constant; if not, the caller is responsible
@@ -49,6 +55,12 @@ struct wchan *wchan_create(const char *name);
  */
 void wchan_destroy(struct wchan *wc);
 
+/*
+ * Rename a wait channel. NAME is subject to the same rules as in
+ * wchan_create.
+ */
+void wchan_setname(struct wchan *wc, const char *name);
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
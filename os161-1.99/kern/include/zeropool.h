@@ -0,0 +1,38 @@
+#ifndef _ZEROPOOL_H_
+#define _ZEROPOOL_H_
+
+/*
+ * Pool of pre-zeroed frames.
+ *
+ * A page that starts out all zeros needs a frame full of zeros the
+ * first time it is written, and clearing one on the faulting thread
+ * puts 4K of stores on the fault's critical path. Instead a kernel
+ * thread clears free frames ahead of time, whenever its cpu has
+ * nothing else to run, and keeps up to ZP_MAX of them in a pool that
+ * zero-fill faults take from first.
+ *
+ * As far as the coremap is concerned pooled frames are allocated
+ * (one reference, no owner). The thread only takes frames while more
+ * than ZP_RESERVE are free, and zeropool_drain is the first reclaim
+ * callback (see reclaim.h) to run when memory is short, so the pool
+ * never costs anyone memory they would otherwise have had.
+ *
+ *    zeropool_bootstrap - start the zeroing thread.
+ *
+ *    zeropool_alloc     - take a frame of zeros from the pool. Returns
+ *                         0 if the pool is empty; the caller then has
+ *                         to clear a frame itself.
+ *
+ *    zeropool_drain     - free every frame in the pool. Returns ENOMEM
+ *                         if there were none.
+ *
+ *    zeropool_printstats - print the pool size and hit rate (kernel
+ *                         menu "cm").
+ */
+
+void zeropool_bootstrap(void);
+paddr_t zeropool_alloc(void);
+int zeropool_drain(void);
+void zeropool_printstats(void);
+
+#endif /* _ZEROPOOL_H_ */
@@ -49,15 +49,23 @@
 #include <vnode.h>
 #include <vfs.h>
 #include <synch.h>
+#include <kmemcache.h>
 #include <kern/fcntl.h>  
+#include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
  */
 struct proc *kproc;
 
+/* Where proc structures come from. */
+static struct kmem_cache *proc_cache;
+
 /*
  * Mechanism for making the kernel menu thread sleep while processes are running
  */
@@ -77,6 +85,12 @@ struct lock *kernel_lock;
 struct array *proc_table;
 #endif
 
+#if OPT_A3
+/* Every user process, for proc_printmem. */
+static struct array *proc_all;
+static struct lock *proc_all_lock;
+#endif
+
 /*
  * Create a proc structure.
  */
@@ -86,13 +100,13 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(proc_cache, proc);
 		return NULL;
 	}
 
@@ -109,6 +123,16 @@ proc_create(const char *name)
 	proc->console = NULL;
 #endif // UW
 
+#if OPT_A3
+	for (int i = 0; i < OPEN_MAX; ++i) {
+		proc->p_files[i] = NULL;
+		proc->p_fileflags[i] = 0;
+		proc->p_fileoffset[i] = 0;
+	}
+	proc->p_rsslimit = RLIM_INFINITY;
+	proc->p_stacklimit = AS_STACKPAGES * PAGE_SIZE;
+#endif
+
 	return proc;
 }
 
@@ -130,6 +154,17 @@ proc_destroy(struct proc *proc)
 	KASSERT(proc != NULL);
 	KASSERT(proc != kproc);
 
+#if OPT_A3
+	lock_acquire(proc_all_lock);
+	for (unsigned i = 0; i < array_num(proc_all); ++i) {
+		if (array_get(proc_all, i) == proc) {
+			array_remove(proc_all, i);
+			break;
+		}
+	}
+	lock_release(proc_all_lock);
+#endif
+
 	/*
 	 * We don't take p_lock in here because we must have the only
 	 * reference to this structure. (Otherwise it would be
@@ -168,6 +203,15 @@ proc_destroy(struct proc *proc)
 	}
 #endif // UW
 
+#if OPT_A3
+	for (int i = 0; i < OPEN_MAX; ++i) {
+		if (proc->p_files[i] != NULL) {
+			vfs_close(proc->p_files[i]);
+			proc->p_files[i] = NULL;
+		}
+	}
+#endif
+
 	threadarray_cleanup(&proc->p_threads);
 	spinlock_cleanup(&proc->p_lock);
 
@@ -188,7 +232,7 @@ proc_destroy(struct proc *proc)
         } else {
             cv_destroy(child->proc_cv);
             lock_destroy(child->proc_lock);
-            kfree(child);
+            kmem_cache_free(proc_cache, child);
         }
     }
     array_destroy(proc->children);
@@ -196,7 +240,7 @@ proc_destroy(struct proc *proc)
     if (proc->parent_pid == 0) {
         cv_destroy(proc->proc_cv);
         lock_destroy(proc->proc_lock);
-        kfree(proc);
+        kmem_cache_free(proc_cache, proc);
     }
 #endif
 
@@ -224,6 +268,10 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+  proc_cache = kmem_cache_create("proc", sizeof(struct proc), NULL, NULL);
+  if (proc_cache == NULL) {
+    panic("could not create proc cache\n");
+  }
   kproc = proc_create("[kernel]");
   if (kproc == NULL) {
     panic("proc_create for kproc failed\n");
@@ -251,6 +299,13 @@ for(int i = 0; i < 64; ++i) {
     array_set(proc_table, i, NULL);
 }
 #endif
+#if OPT_A3
+  proc_all = array_create();
+  proc_all_lock = lock_create("proc_all");
+  if (proc_all == NULL || proc_all_lock == NULL) {
+    panic("could not create process list\n");
+  }
+#endif
 }
 
 /*
@@ -331,6 +386,15 @@ proc_create_runprogram(const char *name)
 
     spinlock_release(&proc->p_lock);
 #endif    
+
+#if OPT_A3
+	lock_acquire(proc_all_lock);
+	if (array_add(proc_all, proc, NULL)) {
+		/* Only the memory listing would miss it. */
+		kprintf("proc_create_runprogram: %s not listed\n", name);
+	}
+	lock_release(proc_all_lock);
+#endif
 	return proc;
 }
 
@@ -451,3 +515,134 @@ get_proc_by_pid(pid_t pid) {
     return((struct proc *)proc_ptr);
 }
 #endif
+
+#if OPT_A3
+void
+proc_copyfiles(struct proc *from, struct proc *to)
+{
+	for (int i = 0; i < OPEN_MAX; ++i) {
+		KASSERT(to->p_files[i] == NULL);
+		if (from->p_files[i] != NULL) {
+			VOP_INCREF(from->p_files[i]);
+			to->p_files[i] = from->p_files[i];
+			to->p_fileflags[i] = from->p_fileflags[i];
+			to->p_fileoffset[i] = from->p_fileoffset[i];
+		}
+	}
+}
+
+int
+proc_getfile(int fd, struct vnode **vn, int *flags)
+{
+	if (fd < 0 || fd >= OPEN_MAX || curproc->p_files[fd] == NULL) {
+		return EBADF;
+	}
+	*vn = curproc->p_files[fd];
+	*flags = curproc->p_fileflags[fd];
+	return 0;
+}
+
+void
+proc_copylimits(struct proc *from, struct proc *to)
+{
+	to->p_rsslimit = from->p_rsslimit;
+	to->p_stacklimit = from->p_stacklimit;
+}
+
+int
+proc_setaslimits(struct addrspace *as)
+{
+	int result;
+
+	result = as_setlimit(as, RLIMIT_RSS, curproc->p_rsslimit);
+	if (result) {
+		return result;
+	}
+	return as_setlimit(as, RLIMIT_STACK, curproc->p_stacklimit);
+}
+
+/*
+ * A process's memory use, as proc_printmem shows it, in pages.
+ */
+struct procmem {
+	pid_t pm_pid;
+	char pm_name[16];
+	size_t pm_rss;
+	size_t pm_maxrss;
+	size_t pm_vsize;
+	size_t pm_rsslimit;
+};
+
+/*
+ * The counters are read under p_lock: an address space is detached
+ * from its process, under p_lock, before it is destroyed, so one that
+ * is still attached stays valid until the lock is released.
+ */
+void
+proc_printmem(void)
+{
+	struct procmem *pm, tmp;
+	struct proc *proc;
+	struct addrspace *as;
+	unsigned num, n, i, j;
+
+	lock_acquire(proc_all_lock);
+	num = array_num(proc_all);
+	pm = kmalloc((num > 0 ? num : 1) * sizeof(*pm));
+	if (pm == NULL) {
+		lock_release(proc_all_lock);
+		kprintf("proc_printmem: Out of memory\n");
+		return;
+	}
+	n = 0;
+	for (i = 0; i < num; ++i) {
+		proc = array_get(proc_all, i);
+		spinlock_acquire(&proc->p_lock);
+		as = proc->p_addrspace;
+		if (as != NULL) {
+#if OPT_A2
+			pm[n].pm_pid = proc->pid;
+#else
+			pm[n].pm_pid = 0;
+#endif
+			snprintf(pm[n].pm_name, sizeof(pm[n].pm_name), "%s",
+				 proc->p_name);
+			pm[n].pm_rss = as->as_rss;
+			pm[n].pm_maxrss = as->as_maxrss;
+			pm[n].pm_vsize = as->as_vsize;
+			pm[n].pm_rsslimit = as->as_rsslimit;
+			n++;
+		}
+		spinlock_release(&proc->p_lock);
+	}
+	lock_release(proc_all_lock);
+
+	/* Largest resident set first. */
+	for (i = 1; i < n; ++i) {
+		tmp = pm[i];
+		for (j = i; j > 0 && pm[j-1].pm_rss < tmp.pm_rss; --j) {
+			pm[j] = pm[j-1];
+		}
+		pm[j] = tmp;
+	}
+
+	kprintf("%5s %8s %8s %8s %8s  %s\n", "PID", "RSS", "MAXRSS",
+		"VSIZE", "LIMIT", "NAME");
+	for (i = 0; i < n; ++i) {
+		kprintf("%5d %7luK %7luK %7luK ", (int)pm[i].pm_pid,
+			(unsigned long)pm[i].pm_rss * (PAGE_SIZE / 1024),
+			(unsigned long)pm[i].pm_maxrss * (PAGE_SIZE / 1024),
+			(unsigned long)pm[i].pm_vsize * (PAGE_SIZE / 1024));
+		if (pm[i].pm_rsslimit == AS_NOLIMIT) {
+			kprintf("%8s  ", "-");
+		}
+		else {
+			kprintf("%7luK  ", (unsigned long)pm[i].pm_rsslimit *
+				(PAGE_SIZE / 1024));
+		}
+		kprintf("%s\n", pm[i].pm_name);
+	}
+	kprintf("%u processes\n", n);
+	kfree(pm);
+}
+#endif
@@ -42,6 +42,7 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <vm.h>
 #include <mainbus.h>
 #include <vfs.h>
@@ -49,7 +50,10 @@
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
+#include <uw-vmstats.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-A2.h"
+#include "opt-A3.h"
 
 
 /*
@@ -107,7 +111,12 @@ boot(void)
 
 	/* Early initialization. */
 	ram_bootstrap();
+	wchan_bootstrap();
+	synch_bootstrap();
 	proc_bootstrap();
+#if OPT_A2
+	fork_bootstrap();
+#endif
 	thread_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
@@ -146,6 +155,9 @@ shutdown(void)
 {
 
 	kprintf("Shutting down.\n");
+#if OPT_A3
+	vmstats_print();
+#endif
 	
 	vfs_clearbootfs();
 	vfs_clearcurdir();
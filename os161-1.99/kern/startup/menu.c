@@ -41,10 +41,18 @@
 #include <vfs.h>
 #include <sfs.h>
 #include <syscall.h>
+#include <vm.h>
 #include <test.h>
+#include <coremap.h>
+#include <swap.h>
+#include <zeropool.h>
+#include <reclaim.h>
+#include <kmemcache.h>
 #include "opt-synchprobs.h"
+#include "opt-A3.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-kheapprof.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -393,18 +401,126 @@ cmd_bootfs(int nargs, char **args)
 	return vfs_setbootfs(device);
 }
 
+static
+int
+cmd_tlbpolicy(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: tlbpolicy random|rr|lru\n");
+		return EINVAL;
+	}
+
+	return vm_set_tlbpolicy(args[1]);
+}
+
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	if (nargs != 2 || (strcmp(args[1], "on") && strcmp(args[1], "off"))) {
+		kprintf("Usage: faultaround on|off\n");
+		return EINVAL;
+	}
+
+	vm_set_faultaround(!strcmp(args[1], "on"));
+	return 0;
+}
+
+static
+int
+cmd_boost(int nargs, char **args)
+{
+	int hardclocks;
+
+	if (nargs != 2 || (hardclocks = atoi(args[1])) <= 0) {
+		kprintf("Usage: boost hardclocks\n");
+		return EINVAL;
+	}
+
+	hardclock_setschedule(hardclocks);
+	return 0;
+}
+
 static
 int
 cmd_kheapstats(int nargs, char **args)
 {
+#if OPT_KHEAPPROF
+	unsigned nsites = 10;
+
+	if (nargs > 2) {
+		kprintf("Usage: kh [nsites]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		nsites = atoi(args[1]);
+	}
+#else
 	(void)nargs;
 	(void)args;
+#endif
 
 	kheap_printstats();
+	kmem_cache_printstats();
+#if OPT_KHEAPPROF
+	kheap_printprofile(nsites);
+#endif
 	
 	return 0;
 }
 
+static
+int
+cmd_coremapstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	coremap_printstats();
+	zeropool_printstats();
+	reclaim_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_tlbstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_tlbprintstats();
+
+	return 0;
+}
+
+#if OPT_A3
+static
+int
+cmd_procmem(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	proc_printmem();
+
+	return 0;
+}
+#endif
+
+static
+int
+cmd_swapstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	swap_printstats();
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -444,6 +560,9 @@ static const char *opsmenu[] = {
 	"[cd]      Change directory          ",
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
+	"[tlbpolicy] TLB replacement policy  ",
+	"[faultaround] TLB prefetch on|off   ",
+	"[boost]   Priority reset interval   ",
 	"[panic]   Intentional panic         ",
 	"[q]       Quit and shut down        ",
 	NULL
@@ -514,6 +633,12 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[cm] Physical memory stats          ",
+	"[sw] Swap space stats               ",
+	"[ts] TLB shootdown stats            ",
+#if OPT_A3
+	"[ps] Processes by memory use        ",
+#endif
 	"[q] Quit and shut down              ",
 	"[dth] Enable DB_THREADS logs        ",
 	NULL
@@ -555,6 +680,9 @@ static struct {
 	{ "cd",		cmd_chdir },
 	{ "pwd",	cmd_pwd },
 	{ "sync",	cmd_sync },
+	{ "tlbpolicy",	cmd_tlbpolicy },
+	{ "faultaround",	cmd_faultaround },
+	{ "boost",	cmd_boost },
 	{ "panic",	cmd_panic },
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
@@ -572,6 +700,12 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "cm",         cmd_coremapstats },
+	{ "sw",         cmd_swapstats },
+	{ "ts",         cmd_tlbstats },
+#if OPT_A3
+	{ "ps",         cmd_procmem },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -1,5 +1,7 @@
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
 #include <kern/unistd.h>
 #include <lib.h>
 #include <uio.h>
@@ -8,16 +10,25 @@
 #include <vfs.h>
 #include <current.h>
 #include <proc.h>
+#include <limits.h>
+#include <copyinout.h>
+#include <addrspace.h>
+#include <vm.h>
+
+#include "opt-A3.h"
+
+#if OPT_A3
+static int file_io(int fd, userptr_t ubuf, size_t nbytes, enum uio_rw rw,
+                   int *retval);
+#endif
 
 /* handler for write() system call                  */
 /*
  * n.b.
- * This implementation handles only writes to standard output 
- * and standard error, both of which go to the console.
+ * Writes to standard output and standard error go to the console;
+ * other descriptors are files opened with open() (see file_io).
  * Also, it does not provide any synchronization, so writes
  * are not atomic.
- *
- * You will need to improve this implementation
  */
 
 int
@@ -29,9 +40,12 @@ sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
 
   DEBUG(DB_SYSCALL,"Syscall: write(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
   
-  /* only stdout and stderr writes are currently implemented */
   if (!((fdesc==STDOUT_FILENO)||(fdesc==STDERR_FILENO))) {
+#if OPT_A3
+    return file_io(fdesc, ubuf, nbytes, UIO_WRITE, retval);
+#else
     return EUNIMP;
+#endif
   }
   KASSERT(curproc != NULL);
   KASSERT(curproc->console != NULL);
@@ -58,3 +72,243 @@ sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
   KASSERT(*retval >= 0);
   return 0;
 }
+
+#if OPT_A3
+
+/*
+ * Read or write (RW) NBYTES at UBUF from or to open file FD, starting
+ * at the descriptor's offset (or for O_APPEND writes, the end of the
+ * file), and move the offset past what was done. Hands back how many
+ * bytes that was; a failure is only reported if it was none.
+ *
+ * The data goes through a kernel buffer, FILE_IOCHUNK bytes at a
+ * time, so that the filesystem never touches user memory itself: a
+ * fault on it could have to read a page of a mapped file or of the
+ * executable from the same filesystem while its locks are held (see
+ * the lock order in dumbvm.c).
+ */
+#define FILE_IOCHUNK 4096
+
+static
+int
+file_io(int fd, userptr_t ubuf, size_t nbytes, enum uio_rw rw, int *retval)
+{
+  struct vnode *vn;
+  struct stat st;
+  struct iovec iov;
+  struct uio u;
+  char *kbuf;
+  size_t done, chunk, got;
+  off_t offset;
+  int flags, accmode, result;
+
+  result = proc_getfile(fd, &vn, &flags);
+  if (result) {
+    return result;
+  }
+  accmode = flags & O_ACCMODE;
+  if (rw == UIO_READ ? accmode == O_WRONLY : accmode == O_RDONLY) {
+    return EBADF;
+  }
+
+  offset = curproc->p_fileoffset[fd];
+  if (rw == UIO_WRITE && (flags & O_APPEND)) {
+    result = VOP_STAT(vn, &st);
+    if (result) {
+      return result;
+    }
+    offset = st.st_size;
+  }
+
+  kbuf = kmalloc(FILE_IOCHUNK);
+  if (kbuf == NULL) {
+    return ENOMEM;
+  }
+
+  for (done = 0; done < nbytes; done += got) {
+    chunk = nbytes - done < FILE_IOCHUNK ? nbytes - done : FILE_IOCHUNK;
+    if (rw == UIO_WRITE) {
+      result = copyin((userptr_t)((vaddr_t)ubuf + done), kbuf, chunk);
+      if (result) {
+        break;
+      }
+    }
+    uio_kinit(&iov, &u, kbuf, chunk, offset, rw);
+    result = rw == UIO_READ ? VOP_READ(vn, &u) : VOP_WRITE(vn, &u);
+    if (result) {
+      break;
+    }
+    got = chunk - u.uio_resid;
+    if (rw == UIO_READ && got > 0) {
+      result = copyout(kbuf, (userptr_t)((vaddr_t)ubuf + done), got);
+      if (result) {
+        break;
+      }
+    }
+    offset += got;
+    if (got < chunk) {
+      /* End of file, or the disk is full. */
+      done += got;
+      break;
+    }
+  }
+  kfree(kbuf);
+
+  curproc->p_fileoffset[fd] = offset;
+  if (rw == UIO_WRITE && done > 0) {
+    /* Mappings made from now on must see what was written. */
+    vm_filewritten(vn);
+  }
+  if (result && done == 0) {
+    return result;
+  }
+  *retval = done;
+  return 0;
+}
+
+/* handler for read() system call */
+/*
+ * Standard input reads from the console; other descriptors are files
+ * opened with open() (see file_io).
+ */
+
+int
+sys_read(int fdesc, userptr_t ubuf, unsigned int nbytes, int *retval)
+{
+  struct iovec iov;
+  struct uio u;
+  int res;
+
+  if (fdesc != STDIN_FILENO) {
+    return file_io(fdesc, ubuf, nbytes, UIO_READ, retval);
+  }
+  KASSERT(curproc->console != NULL);
+
+  iov.iov_ubase = ubuf;
+  iov.iov_len = nbytes;
+  u.uio_iov = &iov;
+  u.uio_iovcnt = 1;
+  u.uio_offset = 0;  /* not needed for the console */
+  u.uio_resid = nbytes;
+  u.uio_segflg = UIO_USERSPACE;
+  u.uio_rw = UIO_READ;
+  u.uio_space = curproc->p_addrspace;
+
+  res = VOP_READ(curproc->console, &u);
+  if (res) {
+    return res;
+  }
+  *retval = nbytes - u.uio_resid;
+  return 0;
+}
+
+/* handler for open() system call */
+/*
+ * Files opened here can be read and written, mapped with mmap() and
+ * synced with fsync(). Each descriptor has its own offset, starting at
+ * 0; fork copies it, so parent and child don't share it.
+ */
+
+int
+sys_open(userptr_t upath, int flags, mode_t mode, int *retval)
+{
+  char *path;
+  struct vnode *vn;
+  int fd, result;
+
+  for (fd = STDERR_FILENO + 1; fd < OPEN_MAX; fd++) {
+    if (curproc->p_files[fd] == NULL) {
+      break;
+    }
+  }
+  if (fd == OPEN_MAX) {
+    return EMFILE;
+  }
+
+  path = kmalloc(PATH_MAX);
+  if (path == NULL) {
+    return ENOMEM;
+  }
+  result = copyinstr(upath, path, PATH_MAX, NULL);
+  if (result) {
+    kfree(path);
+    return result;
+  }
+
+  result = vfs_open(path, flags, mode, &vn);
+  kfree(path);
+  if (result) {
+    return result;
+  }
+
+  curproc->p_files[fd] = vn;
+  curproc->p_fileflags[fd] = flags;
+  curproc->p_fileoffset[fd] = 0;
+  *retval = fd;
+  return 0;
+}
+
+/* handler for close() system call */
+
+int
+sys_close(int fd)
+{
+  struct vnode *vn;
+  int flags, result;
+
+  result = proc_getfile(fd, &vn, &flags);
+  if (result) {
+    return result;
+  }
+  /* Mappings hold their own reference, so they outlive the descriptor. */
+  curproc->p_files[fd] = NULL;
+  vfs_close(vn);
+  return 0;
+}
+
+/* handler for fsync() system call */
+
+int
+sys_fsync(int fd)
+{
+  struct vnode *vn;
+  struct addrspace *as;
+  int flags, result;
+
+  result = proc_getfile(fd, &vn, &flags);
+  if (result) {
+    return result;
+  }
+
+  /* Push out whatever was written through shared mappings first. */
+  as = curproc_getas();
+  if (as != NULL) {
+    result = as_sync(as, vn);
+    if (result) {
+      return result;
+    }
+  }
+  return VOP_FSYNC(vn);
+}
+
+/* handler for remove() system call */
+
+int
+sys_remove(userptr_t upath)
+{
+  char *path;
+  int result;
+
+  path = kmalloc(PATH_MAX);
+  if (path == NULL) {
+    return ENOMEM;
+  }
+  result = copyinstr(upath, path, PATH_MAX, NULL);
+  if (result == 0) {
+    result = vfs_remove(path);
+  }
+  kfree(path);
+  return result;
+}
+
+#endif /* OPT_A3 */
@@ -59,6 +59,7 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include "opt-A3.h"
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -81,8 +82,10 @@ load_segment(struct addrspace *as, struct vnode *v,
 	     size_t memsize, size_t filesize,
 	     int is_executable)
 {
+#if !OPT_A3
 	struct iovec iov;
 	struct uio u;
+#endif
 	int result;
 
 	if (filesize > memsize) {
@@ -90,6 +93,19 @@ load_segment(struct addrspace *as, struct vnode *v,
 		filesize = memsize;
 	}
 
+#if OPT_A3
+	/*
+	 * Don't read anything now: just tell the VM system where the
+	 * segment's pages come from, and vm_fault will read each one
+	 * on first touch.
+	 */
+	(void)is_executable;
+
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n", 
+	      (unsigned long) filesize, (unsigned long) vaddr);
+
+	return as_define_file(as, v, offset, vaddr, memsize, filesize);
+#else
 	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n", 
 	      (unsigned long) filesize, (unsigned long) vaddr);
 
@@ -113,6 +129,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 		kprintf("ELF: short read on segment - file truncated?\n");
 		return ENOEXEC;
 	}
+#endif /* OPT_A3 */
 
 	/*
 	 * If memsize > filesize, the remaining space should be
@@ -13,8 +13,10 @@
 #include <machine/trapframe.h>
 #include <limits.h>
 #include <vfs.h>
+#include <kmemcache.h>
 
 #include "opt-A2.h"
+#include "opt-A3.h"
 
   /* this implementation of sys__exit does not do anything with the exit code */
   /* this needs to be fixed to get exit() and waitpid() working properly */
@@ -127,6 +129,25 @@ sys_waitpid(pid_t pid,
 }
 
 #if OPT_A2
+/* Copies of the parent's trapframe, handed to enter_forked_process. */
+static struct kmem_cache *forktf_cache;
+
+void
+fork_bootstrap(void)
+{
+    forktf_cache = kmem_cache_create("fork trapframe",
+                                     sizeof(struct trapframe), NULL, NULL);
+    if (forktf_cache == NULL) {
+        panic("could not create fork trapframe cache\n");
+    }
+}
+
+void
+fork_tffree(struct trapframe *tf)
+{
+    kmem_cache_free(forktf_cache, tf);
+}
+
 int
 sys_fork(struct trapframe *tf, pid_t *retval) {
     struct proc *new_proc = proc_create_runprogram("");
@@ -140,6 +161,10 @@ sys_fork(struct trapframe *tf, pid_t *retval) {
         return ENPROC;
     }
     kfree(retval_pid);
+#if OPT_A3
+    proc_copyfiles(curproc, new_proc);
+    proc_copylimits(curproc, new_proc);
+#endif
     // Copy address space
     struct addrspace *new_addrspace;
     int copy_addrspace = as_copy(curproc->p_addrspace, &new_addrspace);
@@ -162,11 +187,15 @@ sys_fork(struct trapframe *tf, pid_t *retval) {
         return ENOMEM;
     }
     // Create thread for child process
-    struct trapframe *parent_tf = kmalloc(sizeof(struct trapframe));
+    struct trapframe *parent_tf = kmem_cache_alloc(forktf_cache);
+    if (parent_tf == NULL) {
+        proc_destroy(new_proc);
+        return ENOMEM;
+    }
     *parent_tf = *tf;
     int fork_thread = thread_fork(new_proc->p_name, new_proc, enter_forked_process, parent_tf, 0);
     if (fork_thread != 0) {
-        kfree(parent_tf);
+        fork_tffree(parent_tf);
         proc_destroy(new_proc);
         return ENOMEM;
     }
@@ -277,6 +306,19 @@ sys_execv(userptr_t program, userptr_t args) {
         vfs_close(v);
         return ENOMEM;
     }
+#if OPT_A3
+    /* The process's limits outlive the old program. */
+    result = proc_setaslimits(as);
+    if (result) {
+        for (int j = 0; j < assigned; ++j) {
+            kfree(argv[j]);
+        }
+        kfree(argv);
+        vfs_close(v);
+        as_destroy(as);
+        return result;
+    }
+#endif
 
     /* Switch to it and activate it. */
     as_deactivate();
@@ -45,6 +45,8 @@
 #include <syscall.h>
 #include <test.h>
 
+#include "opt-A3.h"
+
 /*
  * Load program "progname" and start running it in usermode.
  * Does not return except on error.
@@ -74,6 +76,14 @@ runprogram(char *progname, int argc, char **argv)
 		vfs_close(v);
 		return ENOMEM;
 	}
+#if OPT_A3
+	result = proc_setaslimits(as);
+	if (result) {
+		vfs_close(v);
+		as_destroy(as);
+		return result;
+	}
+#endif
 
 	/* Switch to it and activate it. */
 	curproc_setas(as);
@@ -0,0 +1,256 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <kern/time.h>
+#include <kern/resource.h>
+#include <lib.h>
+#include <syscall.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <vnode.h>
+
+#include "opt-A3.h"
+
+#if OPT_A3
+
+/* handler for sbrk() system call */
+
+int
+sys_sbrk(intptr_t amount, vaddr_t *retval)
+{
+  struct addrspace *as;
+
+  as = curproc_getas();
+  if (as == NULL) {
+    return EFAULT;
+  }
+  return as_sbrk(as, amount, retval);
+}
+
+/* handler for mmap() system call */
+/*
+ * The fd and offset arguments don't fit in registers and are fetched
+ * from the user stack: fd at sp+16, and the 64-bit offset at sp+24,
+ * the next aligned slot. ADDR is only a hint, and is ignored.
+ */
+
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags,
+         userptr_t usp, vaddr_t *retval)
+{
+  struct addrspace *as;
+  struct vnode *vn;
+  int fd, fileflags, accmode;
+  off_t offset;
+  int result;
+
+  (void)addr;
+
+  result = copyin((userptr_t)((vaddr_t)usp + 16), &fd, sizeof(fd));
+  if (result) {
+    return result;
+  }
+  result = copyin((userptr_t)((vaddr_t)usp + 24), &offset, sizeof(offset));
+  if (result) {
+    return result;
+  }
+
+  result = proc_getfile(fd, &vn, &fileflags);
+  if (result) {
+    return result;
+  }
+
+  /* The file must be readable, and writeable for a shared write map. */
+  accmode = fileflags & O_ACCMODE;
+  if (accmode == O_WRONLY) {
+    return EACCES;
+  }
+  if ((prot & PROT_WRITE) && flags == MAP_SHARED && accmode != O_RDWR) {
+    return EACCES;
+  }
+
+  /* Only some kinds of file can be mapped. */
+  result = VOP_MMAP(vn);
+  if (result) {
+    return result;
+  }
+
+  as = curproc_getas();
+  if (as == NULL) {
+    return EFAULT;
+  }
+  return as_mmap(as, vn, offset, len, prot, flags, retval);
+}
+
+/* handler for munmap() system call */
+
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+  struct addrspace *as;
+
+  as = curproc_getas();
+  if (as == NULL) {
+    return EFAULT;
+  }
+  return as_munmap(as, (vaddr_t)addr, len);
+}
+
+/* handler for madvise() system call */
+
+int
+sys_madvise(userptr_t addr, size_t len, int advice)
+{
+  struct addrspace *as;
+
+  as = curproc_getas();
+  if (as == NULL) {
+    return EFAULT;
+  }
+  return as_madvise(as, (vaddr_t)addr, len, advice);
+}
+
+/* handler for mincore() system call */
+/*
+ * The residency vector is built a page's worth at a time, so the
+ * buffer stays small however large the range is.
+ */
+
+int
+sys_mincore(userptr_t addr, size_t len, userptr_t vec)
+{
+  struct addrspace *as;
+  char *kvec;
+  vaddr_t va;
+  size_t npages, n, done;
+  int result;
+
+  va = (vaddr_t)addr;
+  if (va % PAGE_SIZE != 0) {
+    return EINVAL;
+  }
+  if (va >= USERSPACETOP || len > USERSPACETOP - va) {
+    return ENOMEM;
+  }
+  as = curproc_getas();
+  if (as == NULL) {
+    return EFAULT;
+  }
+
+  kvec = kmalloc(PAGE_SIZE);
+  if (kvec == NULL) {
+    return ENOMEM;
+  }
+  npages = ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE;
+  for (done = 0; done < npages; done += n) {
+    n = npages - done;
+    if (n > PAGE_SIZE) {
+      n = PAGE_SIZE;
+    }
+    result = as_mincore(as, va + done * PAGE_SIZE, n, kvec);
+    if (result == 0) {
+      result = copyout(kvec, (userptr_t)((vaddr_t)vec + done), n);
+    }
+    if (result) {
+      kfree(kvec);
+      return result;
+    }
+  }
+  kfree(kvec);
+  return 0;
+}
+
+/* handler for getrusage() system call */
+/*
+ * Only memory use is tracked, and only for the process itself:
+ * RUSAGE_CHILDREN is not supported.
+ */
+
+int
+sys_getrusage(int who, userptr_t usage)
+{
+  struct addrspace *as;
+  struct rusage ru;
+
+  if (who != RUSAGE_SELF) {
+    return EINVAL;
+  }
+  as = curproc_getas();
+  if (as == NULL) {
+    return EFAULT;
+  }
+
+  bzero(&ru, sizeof(ru));
+  ru.ru_maxrss = as->as_maxrss * (PAGE_SIZE / 1024);
+  ru.ru_minflt = as->as_minflt;
+  ru.ru_majflt = as->as_majflt;
+  ru.ru_rss = as->as_rss * (PAGE_SIZE / 1024);
+  ru.ru_vsize = as->as_vsize * (PAGE_SIZE / 1024);
+  return copyout(&ru, usage, sizeof(ru));
+}
+
+/* handler for getrlimit() system call */
+/*
+ * There are no separate hard limits; rlim_max is always RLIM_INFINITY.
+ * Limits belong to the process: fork passes them on, and exec applies
+ * them to the new program's address space (proc_setaslimits).
+ */
+
+int
+sys_getrlimit(int resource, userptr_t rlp)
+{
+  struct rlimit rl;
+
+  switch (resource) {
+    case RLIMIT_RSS:
+      rl.rlim_cur = curproc->p_rsslimit;
+      break;
+    case RLIMIT_STACK:
+      rl.rlim_cur = curproc->p_stacklimit;
+      break;
+    default:
+      return EINVAL;
+  }
+  rl.rlim_max = RLIM_INFINITY;
+  return copyout(&rl, rlp, sizeof(rl));
+}
+
+/* handler for setrlimit() system call */
+
+int
+sys_setrlimit(int resource, const_userptr_t rlp)
+{
+  struct addrspace *as;
+  struct rlimit rl;
+  int result;
+
+  result = copyin(rlp, &rl, sizeof(rl));
+  if (result) {
+    return result;
+  }
+  if (rl.rlim_cur > rl.rlim_max) {
+    return EINVAL;
+  }
+  as = curproc_getas();
+  if (as == NULL) {
+    return EFAULT;
+  }
+  result = as_setlimit(as, resource, rl.rlim_cur);
+  if (result) {
+    return result;
+  }
+
+  /* Keep it as the address space rounded it, for getrlimit and exec. */
+  switch (resource) {
+    case RLIMIT_RSS:
+      return as_getlimit(as, resource, &curproc->p_rsslimit);
+    case RLIMIT_STACK:
+      return as_getlimit(as, resource, &curproc->p_stacklimit);
+  }
+  return 0;
+}
+
+#endif /* OPT_A3 */
@@ -50,10 +50,20 @@
 /*
  * Timing constants. These should be tuned along with any work done on
  * the scheduler.
+ *
+ * schedule() lifts every thread back to the top scheduling level once
+ * every schedule_hardclocks hardclocks. That has to be well over the
+ * 15 hardclocks a CPU-bound thread takes to sink through the levels,
+ * or the levels mean nothing, but short enough that a thread at the
+ * bottom isn't starved for long. Half a second is a guess, not a
+ * measurement; the kernel menu's "boost" command changes it, so that
+ * it can be tuned against real workloads.
  */
-#define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
+#define SCHEDULE_HARDCLOCKS	(HZ / 2)	/* Reset priorities twice a second. */
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
+static volatile unsigned schedule_hardclocks = SCHEDULE_HARDCLOCKS;
+
 /*
  * Once a second, everything waiting on lbolt is awakened by CPU 0.
  */
@@ -108,6 +118,13 @@ timerclock(void)
 	}
 }
 
+void
+hardclock_setschedule(unsigned hardclocks)
+{
+	KASSERT(hardclocks > 0);
+	schedule_hardclocks = hardclocks;
+}
+
 /*
  * This is called HZ times a second (on each processor) by the timer
  * code.
@@ -120,13 +137,15 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
+	if ((curcpu->c_hardclocks % schedule_hardclocks) == 0) {
 		schedule();
 	}
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
-	thread_yield();
+	if (thread_tick()) {
+		thread_yield();
+	}
 }
 
 /*
@@ -33,12 +33,114 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <kmemcache.h>
+
+////////////////////////////////////////////////////////////
+//
+// Object caches.
+//
+// Free semaphores, locks, and CVs are kept with their wait channel
+// (and spinlock) already made, so creating one costs an allocation
+// from its cache and a copy of the name, and destroying one hands it
+// back as is. The wait channel carries a generic name while the
+// object is free.
+
+static struct kmem_cache *sem_cache;
+static struct kmem_cache *lock_cache;
+static struct kmem_cache *cv_cache;
+
+static
+int
+sem_ctor(void *obj)
+{
+    struct semaphore *sem = obj;
+
+    sem->sem_wchan = wchan_create("sem");
+    if (sem->sem_wchan == NULL) {
+        return ENOMEM;
+    }
+    spinlock_init(&sem->sem_lock);
+    return 0;
+}
+
+static
+void
+sem_dtor(void *obj)
+{
+    struct semaphore *sem = obj;
+
+    spinlock_cleanup(&sem->sem_lock);
+    wchan_destroy(sem->sem_wchan);
+}
+
+static
+int
+lock_ctor(void *obj)
+{
+    struct lock *lock = obj;
+
+    lock->lock_wchan = wchan_create("lock");
+    if (lock->lock_wchan == NULL) {
+        return ENOMEM;
+    }
+    spinlock_init(&lock->lock_spin);
+    lock->held = false;
+    lock->owner = NULL;
+    return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+    struct lock *lock = obj;
+
+    spinlock_cleanup(&lock->lock_spin);
+    wchan_destroy(lock->lock_wchan);
+}
+
+static
+int
+cv_ctor(void *obj)
+{
+    struct cv *cv = obj;
+
+    cv->cv_wchan = wchan_create("cv");
+    if (cv->cv_wchan == NULL) {
+        return ENOMEM;
+    }
+    return 0;
+}
+
+static
+void
+cv_dtor(void *obj)
+{
+    struct cv *cv = obj;
+
+    wchan_destroy(cv->cv_wchan);
+}
+
+void
+synch_bootstrap(void)
+{
+    sem_cache = kmem_cache_create("semaphore", sizeof(struct semaphore),
+                                  sem_ctor, sem_dtor);
+    lock_cache = kmem_cache_create("lock", sizeof(struct lock),
+                                   lock_ctor, lock_dtor);
+    cv_cache = kmem_cache_create("cv", sizeof(struct cv),
+                                 cv_ctor, cv_dtor);
+    if (sem_cache == NULL || lock_cache == NULL || cv_cache == NULL) {
+        panic("synch_bootstrap: Out of memory\n");
+    }
+}
 
 ////////////////////////////////////////////////////////////
 //
@@ -51,25 +153,18 @@ sem_create(const char *name, int initial_count)
 
     KASSERT(initial_count >= 0);
 
-    sem = kmalloc(sizeof(struct semaphore));
+    sem = kmem_cache_alloc(sem_cache);
     if (sem == NULL) {
         return NULL;
     }
 
     sem->sem_name = kstrdup(name);
     if (sem->sem_name == NULL) {
-        kfree(sem);
-        return NULL;
-    }
-
-    sem->sem_wchan = wchan_create(sem->sem_name);
-    if (sem->sem_wchan == NULL) {
-        kfree(sem->sem_name);
-        kfree(sem);
+        kmem_cache_free(sem_cache, sem);
         return NULL;
     }
 
-    spinlock_init(&sem->sem_lock);
+    wchan_setname(sem->sem_wchan, sem->sem_name);
     sem->sem_count = initial_count;
 
     return sem;
@@ -80,11 +175,12 @@ sem_destroy(struct semaphore *sem)
 {
     KASSERT(sem != NULL);
 
-    /* wchan_cleanup will assert if anyone's waiting on it */
-    spinlock_cleanup(&sem->sem_lock);
-    wchan_destroy(sem->sem_wchan);
+    /* nobody may be waiting on it */
+    KASSERT(wchan_isempty(sem->sem_wchan));
+    KASSERT(!spinlock_do_i_hold(&sem->sem_lock));
+    wchan_setname(sem->sem_wchan, "sem");
     kfree(sem->sem_name);
-    kfree(sem);
+    kmem_cache_free(sem_cache, sem);
 }
 
 void 
@@ -151,28 +247,19 @@ lock_create(const char *name)
 {
     struct lock *lock;
 
-    lock = kmalloc(sizeof(struct lock));
+    lock = kmem_cache_alloc(lock_cache);
     if (lock == NULL) {
         return NULL;
     }
 
     lock->lk_name = kstrdup(name);
     if (lock->lk_name == NULL) {
-        kfree(lock);
-        return NULL;
-    }
-
-    lock->lock_wchan = wchan_create(lock->lk_name);
-    if (lock->lock_wchan == NULL) {
-        kfree(lock->lk_name);
-        kfree(lock);
+        kmem_cache_free(lock_cache, lock);
         return NULL;
     }
 
-    lock->held = false;
-    lock->owner = NULL;
-
-    spinlock_init(&lock->lock_spin);
+    wchan_setname(lock->lock_wchan, lock->lk_name);
+    KASSERT(!lock->held && lock->owner == NULL);
 
     return lock;
 }
@@ -183,10 +270,11 @@ lock_destroy(struct lock *lock)
     KASSERT(lock != NULL);
     KASSERT(lock->owner == NULL);
 
-	spinlock_cleanup(&lock->lock_spin);
-	wchan_destroy(lock->lock_wchan);
+    KASSERT(wchan_isempty(lock->lock_wchan));
+    KASSERT(!spinlock_do_i_hold(&lock->lock_spin));
+    wchan_setname(lock->lock_wchan, "lock");
     kfree(lock->lk_name);
-    kfree(lock);
+    kmem_cache_free(lock_cache, lock);
 }
 
 void
@@ -237,23 +325,18 @@ cv_create(const char *name)
 {
     struct cv *cv;
 
-    cv = kmalloc(sizeof(struct cv));
+    cv = kmem_cache_alloc(cv_cache);
     if (cv == NULL) {
         return NULL;
     }
 
     cv->cv_name = kstrdup(name);
     if (cv->cv_name==NULL) {
-        kfree(cv);
+        kmem_cache_free(cv_cache, cv);
         return NULL;
     }
 
-    cv->cv_wchan = wchan_create(cv->cv_name);
-    if (cv->cv_wchan == NULL) {
-        kfree(cv->cv_name);
-        kfree(cv);
-        return NULL;
-    }
+    wchan_setname(cv->cv_wchan, cv->cv_name);
 
     return cv;
 }
@@ -263,9 +346,10 @@ cv_destroy(struct cv *cv)
 {
     KASSERT(cv != NULL);
 
-	wchan_destroy(cv->cv_wchan);
+    KASSERT(wchan_isempty(cv->cv_wchan));
+    wchan_setname(cv->cv_wchan, "cv");
     kfree(cv->cv_name);
-    kfree(cv);
+    kmem_cache_free(cv_cache, cv);
 }
 
 void
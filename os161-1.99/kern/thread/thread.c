@@ -50,6 +50,7 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <kmemcache.h>
 
 #include "opt-synchprobs.h"
 
@@ -72,6 +73,19 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/*
+ * Scheduling levels (see schedule()). Threads at level L run for
+ * SCHED_QUANTUM(L) hardclocks before being moved down a level. Level
+ * SCHED_BACKGROUND is below all of them and never changes.
+ */
+#define SCHED_NLEVELS		4
+#define SCHED_BACKGROUND	SCHED_NLEVELS
+#define SCHED_QUANTUM(lvl)	(1U << (lvl))
+
+/* Where thread and wchan structures come from. */
+static struct kmem_cache *thread_cache;
+static struct kmem_cache *wchan_cache;
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -123,14 +137,14 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -143,6 +157,8 @@ thread_create(const char *name)
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -168,6 +184,7 @@ cpu_create(unsigned hardware_number)
 	struct cpu *c;
 	int result;
 	char namebuf[16];
+	unsigned i;
 
 	c = kmalloc(sizeof(*c));
 	if (c == NULL) {
@@ -181,13 +198,40 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 
+	c->c_framecache_count = 0;
+	c->c_framecache_hits = 0;
+	c->c_framecache_misses = 0;
+
+	for (i=0; i<CPU_KMCACHE_CLASSES; i++) {
+		c->c_kmcache_count[i] = 0;
+	}
+	c->c_kmcache_hits = 0;
+	c->c_kmcache_misses = 0;
+	c->c_kmcache_flushreq = false;
+
+	for (i=0; i<NUM_ASID; i++) {
+		c->c_asid_owner[i] = 0;
+	}
+	c->c_asid = 0;
+	c->c_asid_next = 1;
+	c->c_tlb_hand = 0;
+	for (i=0; i<NUM_TLB; i++) {
+		c->c_tlb_ref[i] = false;
+	}
+
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_ticket = 0;
+	c->c_shootdown_done = 0;
 	spinlock_init(&c->c_ipi_lock);
+	c->c_ipi_tlbsent = 0;
+	c->c_ipi_tlbtaken = 0;
+	c->c_ipi_tlbentries = 0;
+	c->c_ipi_tlbflushall = 0;
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
 	if (result != 0) {
@@ -227,6 +271,21 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Number of cpus, and the cpu with a given software number.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+struct cpu *
+cpu_get(unsigned software_number)
+{
+	return cpuarray_get(&allcpus, software_number);
+}
+
 /*
  * Destroy a thread.
  *
@@ -259,7 +318,7 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(thread_cache, thread);
 }
 
 /*
@@ -351,6 +410,12 @@ thread_bootstrap(void)
 
 	cpuarray_init(&allcpus);
 
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+					 NULL, NULL);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -426,6 +491,28 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Put a thread on a cpu's run queue, which is kept in order of
+ * priority: behind every thread at the same level or a better one,
+ * ahead of the rest. The run queue must be locked.
+ */
+static
+void
+runqueue_insert(struct cpu *c, struct thread *t)
+{
+	struct thread *t2;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	THREADLIST_FORALL_REV(t2, c->c_runqueue) {
+		if (t2->t_priority <= t->t_priority) {
+			threadlist_insertafter(&c->c_runqueue, t2, t);
+			return;
+		}
+	}
+	threadlist_addhead(&c->c_runqueue, t);
+}
+
 /*
  * Make a thread runnable.
  *
@@ -450,7 +537,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_insert(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -822,17 +909,96 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multi-level feedback queue. Each thread has a level,
+ * t_priority, and each cpu's run queue is kept sorted by level, so
+ * the best thread ready is always at the head, and threads at the
+ * same level take turns. Threads start at level 0. A thread that uses
+ * up its time slice at a level (thread_tick) moves down one, where
+ * the slices are longer; one woken up from a wait channel moves up
+ * one. So threads that compute sink, and ones that mostly wait for
+ * input stay near the top and get the cpu as soon as they want it: a
+ * thread that becomes ready ahead of the running one preempts it at
+ * the next hardclock.
+ *
+ * To keep threads at the bottom from starving, schedule() puts every
+ * thread on the run queue back at level 0 from time to time.
  */
 
 void
+thread_setbackground(void)
+{
+	curthread->t_priority = SCHED_BACKGROUND;
+}
+
+/*
+ * Move T up a level, as it has just been woken.
+ */
+static
+void
+thread_wakeboost(struct thread *t)
+{
+	if (t->t_priority > 0 && t->t_priority != SCHED_BACKGROUND) {
+		t->t_priority--;
+		t->t_ticks = 0;
+	}
+}
+
+bool
+thread_tick(void)
+{
+	struct thread *cur = curthread;
+	struct thread *next;
+	struct threadlist *rq;
+	bool preempt;
+
+	if (curcpu->c_isidle) {
+		return false;
+	}
+	if (cur->t_priority == SCHED_BACKGROUND) {
+		return true;
+	}
+
+	cur->t_ticks++;
+	if (cur->t_ticks >= SCHED_QUANTUM(cur->t_priority)) {
+		if (cur->t_priority < SCHED_NLEVELS - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+		return true;
+	}
+
+	/* Time left; give way only to a better thread. */
+	rq = &curcpu->c_runqueue;
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	next = threadlist_peekhead(rq);
+	preempt = next != NULL && next->t_priority < cur->t_priority;
+	spinlock_release(&curcpu->c_runqueue_lock);
+	return preempt;
+}
+
+/*
+ * This is called periodically from hardclock(). Put the current
+ * thread, and every thread on this cpu's run queue, back at the top
+ * level, background threads aside. That leaves the run queue in order.
+ */
+void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct thread *t;
+
+	if (curthread->t_priority != SCHED_BACKGROUND) {
+		curthread->t_priority = 0;
+		curthread->t_ticks = 0;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	THREADLIST_FORALL(t, curcpu->c_runqueue) {
+		if (t->t_priority != SCHED_BACKGROUND) {
+			t->t_priority = 0;
+			t->t_ticks = 0;
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
 }
 
 /*
@@ -924,7 +1090,7 @@ thread_consider_migration(void)
 			}
 
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			runqueue_insert(c, t);
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -948,7 +1114,7 @@ thread_consider_migration(void)
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			runqueue_insert(curcpu->c_self, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
@@ -963,6 +1129,48 @@ thread_consider_migration(void)
  * Wait channel functions
  */
 
+/*
+ * Wait channels are kept with their spinlock and thread list set up,
+ * so that creating one (which every semaphore, lock, and CV does) is
+ * just a matter of naming it.
+ */
+static
+int
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_init(&wc->wc_lock);
+	threadlist_init(&wc->wc_threads);
+	wc->wc_name = "FREE";
+	return 0;
+}
+
+static
+void
+wchan_dtor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_cleanup(&wc->wc_lock);
+	threadlist_cleanup(&wc->wc_threads);
+}
+
+/*
+ * Set up the wait channel cache. This has to happen before anything
+ * makes a semaphore or lock, which proc_bootstrap does, so it's called
+ * from boot() ahead of the other bootstraps.
+ */
+void
+wchan_bootstrap(void)
+{
+	wchan_cache = kmem_cache_create("wchan", sizeof(struct wchan),
+					wchan_ctor, wchan_dtor);
+	if (wchan_cache == NULL) {
+		panic("wchan_bootstrap: Out of memory\n");
+	}
+}
+
 /*
  * Create a wait channel. NAME is a symbolic string name for it.
  * This is what's displayed by ps -alx in Unix.
@@ -976,26 +1184,36 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = kmem_cache_alloc(wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	spinlock_init(&wc->wc_lock);
-	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
 	return wc;
 }
 
 /*
  * Destroy a wait channel. Must be empty and unlocked.
- * (The corresponding cleanup functions require this.)
+ * (It goes back to the cache still constructed, so check here what
+ * the cleanup functions would.)
  */
 void
 wchan_destroy(struct wchan *wc)
 {
-	spinlock_cleanup(&wc->wc_lock);
-	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	KASSERT(threadlist_isempty(&wc->wc_threads));
+	KASSERT(!spinlock_do_i_hold(&wc->wc_lock));
+	wc->wc_name = "FREE";
+	kmem_cache_free(wchan_cache, wc);
+}
+
+/*
+ * Change the name of a wait channel, for objects that keep theirs
+ * from one use to the next. NAME is treated as in wchan_create.
+ */
+void
+wchan_setname(struct wchan *wc, const char *name)
+{
+	wc->wc_name = name;
 }
 
 /*
@@ -1050,6 +1268,7 @@ wchan_wakeone(struct wchan *wc)
 		return;
 	}
 
+	thread_wakeboost(target);
 	thread_make_runnable(target, false);
 }
 
@@ -1084,6 +1303,7 @@ wchan_wakeall(struct wchan *wc)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
+		thread_wakeboost(target);
 		thread_make_runnable(target, false);
 	}
 
@@ -1143,23 +1363,54 @@ ipi_broadcast(int code)
 void
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
-	int n;
+	(void)ipi_tlbshootdown_batch(target, mapping, 1);
+}
+
+unsigned
+ipi_tlbshootdown_batch(struct cpu *target,
+		       const struct tlbshootdown *mappings, unsigned n)
+{
+	unsigned ticket, i;
+	int num;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		target->c_numshootdown = TLBSHOOTDOWN_ALL;
-	}
-	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+	num = target->c_numshootdown;
+	if (num != TLBSHOOTDOWN_ALL) {
+		if (n > TLBSHOOTDOWN_MAX - (unsigned)num) {
+			target->c_numshootdown = TLBSHOOTDOWN_ALL;
+		}
+		else {
+			for (i=0; i<n; i++) {
+				target->c_shootdown[num + i] = mappings[i];
+			}
+			target->c_numshootdown = num + n;
+		}
 	}
+	ticket = ++target->c_shootdown_ticket;
+	curcpu->c_ipi_tlbsent++;
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
 
 	spinlock_release(&target->c_ipi_lock);
+
+	return ticket;
+}
+
+void
+ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket)
+{
+	bool done;
+
+	/* We may be a target ourselves meanwhile. */
+	KASSERT(curthread->t_curspl == 0);
+
+	do {
+		spinlock_acquire(&target->c_ipi_lock);
+		done = (int)(target->c_shootdown_done - ticket) >= 0;
+		spinlock_release(&target->c_ipi_lock);
+	} while (!done);
 }
 
 void
@@ -1195,13 +1446,17 @@ interprocessor_interrupt(void)
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
 		if (curcpu->c_numshootdown == TLBSHOOTDOWN_ALL) {
 			vm_tlbshootdown_all();
+			curcpu->c_ipi_tlbflushall++;
 		}
 		else {
 			for (i=0; i<curcpu->c_numshootdown; i++) {
 				vm_tlbshootdown(&curcpu->c_shootdown[i]);
 			}
+			curcpu->c_ipi_tlbentries += curcpu->c_numshootdown;
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_done = curcpu->c_shootdown_ticket;
+		curcpu->c_ipi_tlbtaken++;
 	}
 
 	curcpu->c_ipi_pending = 0;
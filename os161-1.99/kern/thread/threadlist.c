@@ -96,6 +96,21 @@ threadlist_isempty(struct threadlist *tl)
 	return (tl->tl_count == 0);
 }
 
+struct thread *
+threadlist_peekhead(struct threadlist *tl)
+{
+	struct threadlistnode *tln;
+
+	DEBUGASSERT(tl != NULL);
+
+	tln = tl->tl_head.tln_next;
+	if (tln->tln_next == NULL) {
+		/* list is empty */
+		return NULL;
+	}
+	return tln->tln_self;
+}
+
 ////////////////////////////////////////////////////////////
 // internal
 
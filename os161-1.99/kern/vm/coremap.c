@@ -0,0 +1,650 @@
+/*
+ * Physical frame allocator: coremap plus binary buddy free lists.
+ * See coremap.h for the interface.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <vm.h>
+#include <coremap.h>
+
+/*
+ * Number of free lists. 2^17 frames is 512M, more than a MIPS kernel
+ * can address through kseg0 anyway.
+ */
+#define CM_NORDERS 18
+
+#define CM_NONE (-1)		/* end of a free list */
+
+/* Values for cme_state. */
+#define CME_USED 0		/* allocated, or inside a larger free block */
+#define CME_FREE 1		/* first frame of a block on a free list */
+
+struct coremap_entry {
+	int32_t cme_next;	/* free list links (frame indexes) */
+	int32_t cme_prev;
+	uint32_t cme_npages;	/* run length, on the first frame of a run */
+	uint32_t cme_refcount;	/* page tables mapping this frame */
+	uint8_t cme_state;	/* CME_USED or CME_FREE */
+	uint8_t cme_order;	/* block order, if CME_FREE */
+	bool cme_referenced;	/* second chance for the clock */
+	struct addrspace *cme_as;	/* owner of an evictable user page */
+	vaddr_t cme_vaddr;	/* where cme_as maps it */
+	uint32_t cme_tag;	/* the owner's, see coremap_settag */
+};
+
+/*
+ * Wrap ram_stealmem in a spinlock until the coremap takes over; after
+ * that coremap_lock protects everything below.
+ */
+static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+static bool coremap_ready = false;
+static struct coremap_entry *coremap;
+static paddr_t coremap_base;		/* physical address of frame 0 */
+static unsigned coremap_nframes;	/* number of frames managed */
+static unsigned coremap_nfree;		/* number of those that are free */
+
+static unsigned coremap_clockhand;	/* next frame the clock looks at */
+
+static int32_t freelist[CM_NORDERS];	/* first free block of each order */
+static unsigned freecount[CM_NORDERS];	/* length of each free list */
+
+#define CM_INDEX(paddr) ((unsigned)(((paddr) - coremap_base) / PAGE_SIZE))
+#define CM_PADDR(index) (coremap_base + (paddr_t)(index) * PAGE_SIZE)
+
+////////////////////////////////////////////////////////////
+//
+// Free lists
+
+static
+void
+freelist_insert(unsigned index, unsigned order)
+{
+	struct coremap_entry *cme = &coremap[index];
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(order < CM_NORDERS);
+	KASSERT(cme->cme_state == CME_USED);
+
+	cme->cme_state = CME_FREE;
+	cme->cme_order = order;
+	cme->cme_prev = CM_NONE;
+	cme->cme_next = freelist[order];
+	if (freelist[order] != CM_NONE) {
+		coremap[freelist[order]].cme_prev = index;
+	}
+	freelist[order] = index;
+	freecount[order]++;
+}
+
+static
+void
+freelist_remove(unsigned index)
+{
+	struct coremap_entry *cme = &coremap[index];
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(cme->cme_state == CME_FREE);
+
+	if (cme->cme_prev != CM_NONE) {
+		coremap[cme->cme_prev].cme_next = cme->cme_next;
+	}
+	else {
+		freelist[cme->cme_order] = cme->cme_next;
+	}
+	if (cme->cme_next != CM_NONE) {
+		coremap[cme->cme_next].cme_prev = cme->cme_prev;
+	}
+	freecount[cme->cme_order]--;
+	cme->cme_state = CME_USED;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Buddy allocator
+
+/*
+ * Smallest order whose blocks hold NPAGES frames.
+ */
+static
+unsigned
+buddy_order(unsigned long npages)
+{
+	unsigned order = 0;
+
+	while ((1UL << order) < npages) {
+		order++;
+	}
+	return order;
+}
+
+/*
+ * Free the block of 2^ORDER frames at INDEX, merging it with its buddy
+ * for as long as the buddy is a free block of the same order.
+ */
+static
+void
+buddy_free_block(unsigned index, unsigned order)
+{
+	unsigned buddy;
+
+	while (order + 1 < CM_NORDERS) {
+		buddy = index ^ (1U << order);
+		if (buddy + (1U << order) > coremap_nframes ||
+		    coremap[buddy].cme_state != CME_FREE ||
+		    coremap[buddy].cme_order != order) {
+			break;
+		}
+		freelist_remove(buddy);
+		if (buddy < index) {
+			index = buddy;
+		}
+		order++;
+	}
+	freelist_insert(index, order);
+}
+
+/*
+ * Free frames [FIRST, LIMIT), which need not be a power of two long,
+ * by splitting them into the largest aligned blocks that fit.
+ */
+static
+void
+buddy_free_range(unsigned first, unsigned limit)
+{
+	unsigned order;
+
+	while (first < limit) {
+		order = 0;
+		while (order + 1 < CM_NORDERS &&
+		       (first & ((1U << (order + 1)) - 1)) == 0 &&
+		       first + (1U << (order + 1)) <= limit) {
+			order++;
+		}
+		buddy_free_block(first, order);
+		first += 1U << order;
+	}
+}
+
+/*
+ * Allocate NPAGES contiguous frames. The smallest free block that is
+ * big enough is split down to the power of two covering NPAGES, and
+ * whatever is left over past NPAGES goes straight back on the free
+ * lists, so odd-sized requests don't waste the rest of their block.
+ * Returns the index of the first frame, or CM_NONE.
+ */
+static
+int32_t
+buddy_alloc(unsigned long npages)
+{
+	unsigned order, j;
+	unsigned index, i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	order = buddy_order(npages);
+	for (j = order; j < CM_NORDERS; j++) {
+		if (freelist[j] != CM_NONE) {
+			break;
+		}
+	}
+	if (j == CM_NORDERS) {
+		return CM_NONE;
+	}
+
+	index = freelist[j];
+	freelist_remove(index);
+	while (j > order) {
+		j--;
+		freelist_insert(index + (1U << j), j);
+	}
+	buddy_free_range(index + npages, index + (1U << order));
+
+	for (i = index; i < index + npages; i++) {
+		coremap[i].cme_npages = 0;
+		coremap[i].cme_refcount = 1;
+		coremap[i].cme_as = NULL;
+	}
+	coremap[index].cme_npages = npages;
+	coremap_nfree -= npages;
+
+	return index;
+}
+
+/*
+ * Free the run starting at INDEX.
+ */
+static
+void
+buddy_free(unsigned index)
+{
+	unsigned npages, i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(index < coremap_nframes);
+	KASSERT(coremap[index].cme_state == CME_USED);
+
+	npages = coremap[index].cme_npages;
+	if (npages == 0) {
+		panic("coremap: free of 0x%x, which does not start a run\n",
+		      CM_PADDR(index));
+	}
+	for (i = index; i < index + npages; i++) {
+		coremap[i].cme_npages = 0;
+		coremap[i].cme_refcount = 0;
+	}
+	buddy_free_range(index, index + npages);
+	coremap_nfree += npages;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Per-cpu frame cache
+//
+// Each cpu keeps a few free single frames in c_framecache. They
+// look allocated to the buddy allocator (refcount 1, run length 1)
+// and belong to that cpu alone, so they can be handed out and taken
+// back with interrupts off instead of under coremap_lock. Refills and
+// drains move CPU_FRAMECACHE_BATCH frames at a time.
+
+/*
+ * Move up to CPU_FRAMECACHE_BATCH free frames from the buddy allocator
+ * into C's cache.
+ */
+static
+void
+framecache_refill(struct cpu *c)
+{
+	int32_t index;
+	unsigned i;
+
+	spinlock_acquire(&coremap_lock);
+	for (i = 0; i < CPU_FRAMECACHE_BATCH; i++) {
+		index = buddy_alloc(1);
+		if (index == CM_NONE) {
+			break;
+		}
+		c->c_framecache[c->c_framecache_count++] = CM_PADDR(index);
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Give up to NFRAMES frames from C's cache back to the buddy allocator.
+ */
+static
+void
+framecache_drain(struct cpu *c, unsigned nframes)
+{
+	spinlock_acquire(&coremap_lock);
+	while (nframes > 0 && c->c_framecache_count > 0) {
+		c->c_framecache_count--;
+		buddy_free(CM_INDEX(c->c_framecache[c->c_framecache_count]));
+		nframes--;
+	}
+	spinlock_release(&coremap_lock);
+}
+
+static
+paddr_t
+framecache_alloc(void)
+{
+	struct cpu *c;
+	paddr_t paddr;
+	int spl;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	if (c->c_framecache_count > 0) {
+		c->c_framecache_hits++;
+	}
+	else {
+		c->c_framecache_misses++;
+		framecache_refill(c);
+	}
+	if (c->c_framecache_count == 0) {
+		splx(spl);
+		return 0;
+	}
+	paddr = c->c_framecache[--c->c_framecache_count];
+	splx(spl);
+
+	return paddr;
+}
+
+/*
+ * Put the single frame at INDEX, which nobody else references any
+ * more, in this cpu's cache. It must have no owner already, or the
+ * clock could take it while its refcount is being reset here.
+ */
+static
+void
+framecache_free(unsigned index)
+{
+	struct cpu *c;
+	int spl;
+
+	KASSERT(coremap[index].cme_as == NULL);
+	coremap[index].cme_npages = 1;
+	coremap[index].cme_refcount = 1;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	if (c->c_framecache_count == CPU_FRAMECACHE_SIZE) {
+		framecache_drain(c, CPU_FRAMECACHE_BATCH);
+	}
+	c->c_framecache[c->c_framecache_count++] = CM_PADDR(index);
+	splx(spl);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+void
+coremap_bootstrap(void)
+{
+	paddr_t lo, hi;
+	unsigned npages, cmpages, i;
+
+	ram_getsize(&lo, &hi);
+
+	/* The coremap itself lives in the first frames of free memory. */
+	npages = (hi - lo) / PAGE_SIZE;
+	cmpages = DIVROUNDUP(npages * sizeof(struct coremap_entry), PAGE_SIZE);
+	KASSERT(cmpages < npages);
+
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(lo);
+	coremap_base = lo + cmpages * PAGE_SIZE;
+	coremap_nframes = npages - cmpages;
+
+	spinlock_acquire(&coremap_lock);
+	for (i = 0; i < CM_NORDERS; i++) {
+		freelist[i] = CM_NONE;
+		freecount[i] = 0;
+	}
+	for (i = 0; i < coremap_nframes; i++) {
+		coremap[i].cme_next = CM_NONE;
+		coremap[i].cme_prev = CM_NONE;
+		coremap[i].cme_npages = 0;
+		coremap[i].cme_refcount = 0;
+		coremap[i].cme_state = CME_USED;
+		coremap[i].cme_order = 0;
+		coremap[i].cme_as = NULL;
+		coremap[i].cme_vaddr = 0;
+		coremap[i].cme_referenced = false;
+		coremap[i].cme_tag = 0;
+	}
+	coremap_clockhand = 0;
+	buddy_free_range(0, coremap_nframes);
+	coremap_nfree = coremap_nframes;
+	coremap_ready = true;
+	spinlock_release(&coremap_lock);
+}
+
+paddr_t
+coremap_alloc(unsigned long npages)
+{
+	paddr_t addr;
+	int32_t index;
+	int spl;
+
+	KASSERT(npages > 0);
+
+	if (!coremap_ready) {
+		spinlock_acquire(&stealmem_lock);
+		addr = ram_stealmem(npages);
+		spinlock_release(&stealmem_lock);
+		return addr;
+	}
+
+	if (npages == 1) {
+		return framecache_alloc();
+	}
+
+	spinlock_acquire(&coremap_lock);
+	index = buddy_alloc(npages);
+	spinlock_release(&coremap_lock);
+
+	if (index == CM_NONE) {
+		/*
+		 * Frames sitting in this cpu's cache may be all that
+		 * stands between two free buddies; put them back and
+		 * try once more.
+		 */
+		spl = splhigh();
+		framecache_drain(curcpu->c_self, CPU_FRAMECACHE_SIZE);
+		splx(spl);
+
+		spinlock_acquire(&coremap_lock);
+		index = buddy_alloc(npages);
+		spinlock_release(&coremap_lock);
+	}
+
+	if (index == CM_NONE) {
+		return 0;
+	}
+	return CM_PADDR(index);
+}
+
+void
+coremap_free(paddr_t paddr)
+{
+	unsigned index;
+
+	KASSERT(paddr % PAGE_SIZE == 0);
+
+	if (paddr < coremap_base) {
+		/* Stolen before the coremap existed; leak it. */
+		return;
+	}
+
+	/* The caller owns the run, so its length can be read unlocked. */
+	index = CM_INDEX(paddr);
+	KASSERT(coremap[index].cme_tag == 0);
+	if (coremap[index].cme_npages == 1) {
+		framecache_free(index);
+		return;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	buddy_free(index);
+	spinlock_release(&coremap_lock);
+}
+
+unsigned
+coremap_freeframes(void)
+{
+	return coremap_nfree;
+}
+
+void
+coremap_incref(paddr_t paddr)
+{
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[CM_INDEX(paddr)].cme_refcount > 0);
+	coremap[CM_INDEX(paddr)].cme_refcount++;
+	/* Shared frames have no single owner to evict them from. */
+	coremap[CM_INDEX(paddr)].cme_as = NULL;
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_decref(paddr_t paddr)
+{
+	unsigned index = CM_INDEX(paddr);
+	unsigned refs;
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[index].cme_refcount > 0);
+	refs = --coremap[index].cme_refcount;
+	if (refs == 0) {
+		/* Before the lock goes, so coremap_victim can't pick it. */
+		coremap[index].cme_as = NULL;
+	}
+	spinlock_release(&coremap_lock);
+
+	if (refs == 0) {
+		framecache_free(index);
+	}
+}
+
+unsigned
+coremap_refcount(paddr_t paddr)
+{
+	unsigned refs;
+
+	spinlock_acquire(&coremap_lock);
+	refs = coremap[CM_INDEX(paddr)].cme_refcount;
+	spinlock_release(&coremap_lock);
+	return refs;
+}
+
+void
+coremap_claim(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *cme = &coremap[CM_INDEX(paddr)];
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(cme->cme_refcount > 0);
+	if (cme->cme_refcount == 1) {
+		cme->cme_as = as;
+		cme->cme_vaddr = vaddr;
+	}
+	cme->cme_referenced = true;
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_unreference(paddr_t paddr)
+{
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[CM_INDEX(paddr)].cme_refcount > 0);
+	coremap[CM_INDEX(paddr)].cme_referenced = false;
+	spinlock_release(&coremap_lock);
+}
+
+bool
+coremap_settag(paddr_t paddr, unsigned npages, unsigned tag)
+{
+	unsigned index, i;
+
+	KASSERT(paddr % PAGE_SIZE == 0);
+
+	if (!coremap_ready || paddr < coremap_base) {
+		return false;
+	}
+	index = CM_INDEX(paddr);
+	KASSERT(index + npages <= coremap_nframes);
+	for (i = index; i < index + npages; i++) {
+		coremap[i].cme_tag = tag;
+	}
+	return true;
+}
+
+unsigned
+coremap_gettag(paddr_t paddr)
+{
+	if (!coremap_ready || paddr < coremap_base) {
+		return 0;
+	}
+	return coremap[CM_INDEX(paddr)].cme_tag;
+}
+
+/*
+ * Second-chance clock over the coremap. Frames referenced since the
+ * hand last passed get their bit cleared and are skipped; the first
+ * unreferenced user page with a single owner is the victim, and loses
+ * its owner. Two full sweeps are enough to find one if any exists.
+ */
+paddr_t
+coremap_victim(struct addrspace **as, vaddr_t *vaddr)
+{
+	struct coremap_entry *cme;
+	unsigned n, index;
+
+	spinlock_acquire(&coremap_lock);
+	for (n = 0; n < 2 * coremap_nframes; n++) {
+		index = coremap_clockhand;
+		coremap_clockhand = (coremap_clockhand + 1) % coremap_nframes;
+
+		cme = &coremap[index];
+		if (cme->cme_as == NULL || cme->cme_refcount != 1) {
+			continue;
+		}
+		if (cme->cme_referenced) {
+			cme->cme_referenced = false;
+			continue;
+		}
+		*as = cme->cme_as;
+		*vaddr = cme->cme_vaddr;
+		/* Don't pick it twice while it is on its way out. */
+		cme->cme_as = NULL;
+		spinlock_release(&coremap_lock);
+		return CM_PADDR(index);
+	}
+	spinlock_release(&coremap_lock);
+	return 0;
+}
+
+/*
+ * Print the free lists. The numbers are copied out under the lock and
+ * printed afterwards, because kprintf may sleep. The per-cpu cache
+ * counters are read without any lock and may be slightly stale.
+ */
+void
+coremap_printstats(void)
+{
+	unsigned counts[CM_NORDERS];
+	unsigned nframes, nfree, largest, i;
+	unsigned hits, misses;
+	struct cpu *c;
+
+	spinlock_acquire(&coremap_lock);
+	for (i = 0; i < CM_NORDERS; i++) {
+		counts[i] = freecount[i];
+	}
+	nframes = coremap_nframes;
+	nfree = coremap_nfree;
+	spinlock_release(&coremap_lock);
+
+	kprintf("Coremap: %u frames, %u free (%uk)\n",
+		nframes, nfree, nfree * PAGE_SIZE / 1024);
+	kprintf("    order  pages  free blocks\n");
+	largest = 0;
+	for (i = 0; i < CM_NORDERS; i++) {
+		if (counts[i] == 0) {
+			continue;
+		}
+		kprintf("    %5u  %5u  %u\n", i, 1U << i, counts[i]);
+		largest = 1U << i;
+	}
+
+	/*
+	 * Fragmentation: the share of free memory that is not in the
+	 * largest free block, i.e. 0% when all free memory is one block.
+	 */
+	if (nfree > 0) {
+		kprintf("Largest free block: %u pages; fragmentation %u%%\n",
+			largest, 100 - (100 * largest) / nfree);
+	}
+
+	for (i = 0; i < cpu_count(); i++) {
+		c = cpu_get(i);
+		hits = c->c_framecache_hits;
+		misses = c->c_framecache_misses;
+		kprintf("cpu%u frame cache: %u cached, %u hits, %u misses",
+			c->c_number, c->c_framecache_count, hits, misses);
+		if (hits + misses > 0) {
+			kprintf(" (%u%% hit rate)",
+				(100 * hits) / (hits + misses));
+		}
+		kprintf("\n");
+	}
+}
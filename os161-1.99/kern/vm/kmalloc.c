@@ -28,9 +28,15 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <coremap.h>
+#include "opt-kheapprof.h"
 
 /*
  * Kernel malloc.
@@ -70,10 +76,24 @@ fill_deadbeef(void *vptr, size_t len)
 //    more blocks would fit on a page than with the existing block
 //    sizes, and large numbers of items of the new size are allocated.
 //
+//    Blocks bigger than half a page would waste the rest of a page,
+//    so those sizes are carved from runs of several pages instead
+//    (runpages[]): four 3k blocks fit exactly in three pages, and two
+//    6k ones. From here on "page" means one such run.
+//
 //    The free counts and addresses of the pages are maintained in
 //    another list.  Maintaining this table is a nuisance, because it
 //    cannot recursively use the subpage allocator. (We could probably
-//    make that work, but it would be painful.)
+//    make that work, but it would be painful.) Each frame of a page
+//    carries the index of its entry as its coremap tag, which is how
+//    kfree gets from a block to its page.
+//
+//    In front of the pages, each cpu keeps a small cache of free
+//    blocks of each size (c_kmcache in struct cpu). Blocks in a cache
+//    count as allocated as far as their pages are concerned. Most
+//    kmallocs and kfrees only touch the current cpu's cache, with
+//    interrupts off; the pages, under kmalloc_spinlock, are only
+//    visited to refill or flush a cache, a batch of blocks at a time.
 //
 
 #undef  SLOW	/* consistency checks */
@@ -83,11 +103,14 @@ fill_deadbeef(void *vptr, size_t len)
 
 #if PAGE_SIZE == 4096
 
-#define NSIZES 8
-static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+#define NSIZES 10
+static const size_t sizes[NSIZES] =
+	{ 16, 32, 64, 128, 256, 512, 1024, 2048, 3072, 6144 };
+static const unsigned runpages[NSIZES] =
+	{ 1,  1,  1,   1,   1,   1,   1,    1,    3,    3 };
 
 #define SMALLEST_SUBPAGE_SIZE 16
-#define LARGEST_SUBPAGE_SIZE 2048
+#define LARGEST_SUBPAGE_SIZE 6144
 
 #elif PAGE_SIZE == 8192
 #error "No support for 8k pages (yet?)"
@@ -95,6 +118,10 @@ static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
 #error "Odd page size"
 #endif
 
+#if NSIZES > CPU_KMCACHE_CLASSES
+#error "More size classes than the per-cpu caches have room for"
+#endif
+
 ////////////////////////////////////////
 
 struct freelist {
@@ -115,6 +142,10 @@ struct pageref {
 #define PR_BLOCKTYPE(pr) ((pr)->pageaddr_and_blocktype & ~PAGE_FRAME)
 #define MKPAB(pa, blk)   (((pa)&PAGE_FRAME) | ((blk) & ~PAGE_FRAME))
 
+/* Size of the run of pages blocks of type BLK come in, and its blocks */
+#define RUNSIZE(blk)     (runpages[blk] * PAGE_SIZE)
+#define RUNBLOCKS(blk)   (RUNSIZE(blk) / sizes[blk])
+
 ////////////////////////////////////////
 
 /*
@@ -140,6 +171,8 @@ static struct pageref pagerefs[NPAGEREFS];
 
 #define INUSE_WORDS (NPAGEREFS/32)
 static uint32_t pagerefs_inuse[INUSE_WORDS];
+static unsigned pagerefs_top;	/* no pageref past here has been used */
+static unsigned pagerefs_untagged; /* pages from before the coremap */
 
 static
 struct pageref *
@@ -156,6 +189,9 @@ allocpageref(void)
 		for (k=1,j=0; k!=0; k<<=1,j++) {
 			if ((pagerefs_inuse[i] & k)==0) {
 				pagerefs_inuse[i] |= k;
+				if (i*32 + j >= pagerefs_top) {
+					pagerefs_top = i*32 + j + 1;
+				}
 				return &pagerefs[i*32 + j];
 			}
 		}
@@ -178,6 +214,8 @@ freepageref(struct pageref *p)
 	i = j/32;
 	k = ((uint32_t)1) << (j%32);
 	KASSERT((pagerefs_inuse[i] & k) != 0);
+	/* So that subpage_lookup never matches a stale entry. */
+	p->pageaddr_and_blocktype = 0;
 	pagerefs_inuse[i] &= ~k;
 }
 
@@ -189,10 +227,8 @@ static struct pageref *allbase;
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * One spinlock protects the pages and their lists. The per-cpu caches
+ * in front of them keep most allocations from taking it at all.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -226,7 +262,7 @@ checksubpage(struct pageref *pr)
 	prpage = PR_PAGEADDR(pr);
 	blktype = PR_BLOCKTYPE(pr);
 
-	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	KASSERT(pr->freelist_offset < RUNSIZE(blktype));
 	KASSERT(pr->freelist_offset % sizes[blktype] == 0);
 
 	fla = prpage + pr->freelist_offset;
@@ -234,7 +270,7 @@ checksubpage(struct pageref *pr)
 
 	for (; fl != NULL; fl = fl->next) {
 		fla = (vaddr_t)fl;
-		KASSERT(fla >= prpage && fla < prpage + PAGE_SIZE);
+		KASSERT(fla >= prpage && fla < prpage + RUNSIZE(blktype));
 		KASSERT((fla-prpage) % sizes[blktype] == 0);
 		KASSERT(fla >= MIPS_KSEG0);
 		KASSERT(fla < MIPS_KSEG1);
@@ -301,7 +337,7 @@ dumpsubpage(struct pageref *pr)
 	blktype = PR_BLOCKTYPE(pr);
 
 	/* compute how many bits we need in freemap and assert we fit */
-	n = PAGE_SIZE / sizes[blktype];
+	n = RUNBLOCKS(blktype);
 	KASSERT(n <= 32*sizeof(freemap)/sizeof(freemap[0]));
 
 	if (pr->freelist_offset != INVALID_OFFSET) {
@@ -334,6 +370,8 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	struct cpu *c;
+	unsigned i, j, cached, hits, misses;
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -345,6 +383,27 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	/* Other cpus' counters are read without stopping them. */
+	kprintf("Per-cpu caches (cached blocks show as in use above):\n");
+	for (i=0; i<cpu_count(); i++) {
+		c = cpu_get(i);
+		cached = 0;
+		for (j=0; j<NSIZES; j++) {
+			cached += c->c_kmcache_count[j];
+		}
+		hits = c->c_kmcache_hits;
+		misses = c->c_kmcache_misses;
+		kprintf("cpu%u: %u blocks cached; %u hits, %u misses",
+			c->c_number, cached, hits, misses);
+		if (hits + misses > 0) {
+			kprintf(" (%u%% hit rate)",
+				(100 * hits) / (hits + misses));
+		}
+		kprintf("\n");
+	}
+
+	kvpages_printstats();
 }
 
 ////////////////////////////////////////
@@ -392,24 +451,62 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Find the pageref for the page the block at PTRADDR is in, or NULL if
+ * it isn't a subpage block. This runs without kmalloc_spinlock: the
+ * page of a block that is allocated, or in a cache, can't be freed
+ * meanwhile, so its frames' tags and its pageref stay put.
+ *
+ * Pages taken before the coremap existed can't be tagged, and are
+ * found by searching the table instead. freepageref clears an entry's
+ * page address and block type (read together, in one word), so no
+ * stale entry can match.
+ */
+static
+struct pageref *
+subpage_lookup(vaddr_t ptraddr)
+{
+	struct pageref *pr;
+	unsigned i, top, tag;
+	vaddr_t pab;
+
+	tag = coremap_gettag(KVADDR_TO_PADDR(ptraddr & PAGE_FRAME));
+	if (tag != 0) {
+		pr = &pagerefs[tag - 1];
+		KASSERT(ptraddr - PR_PAGEADDR(pr) <
+			RUNSIZE(PR_BLOCKTYPE(pr)));
+		return pr;
+	}
+	if (pagerefs_untagged == 0) {
+		return NULL;
+	}
+
+	top = pagerefs_top;
+	for (i=0; i<top; i++) {
+		pab = pagerefs[i].pageaddr_and_blocktype;
+		if (ptraddr - (pab & PAGE_FRAME) <
+		    RUNSIZE(pab & ~PAGE_FRAME)) {
+			return &pagerefs[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take a block of type BLKTYPE from the first page that has one free,
+ * or return NULL if none does.
+ */
 static
 void *
-subpage_kmalloc(size_t sz)
+subpage_take(unsigned blktype)
 {
-	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
-	struct freelist *volatile fl;	// free list entry
+	struct freelist *fl;	// free list entry
 	void *retptr;		// our result
 
-	volatile int i;
-
-
-	blktype = blocktype(sz);
-	sz = sizes[blktype];
-
-	spinlock_acquire(&kmalloc_spinlock);
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	checksubpages();
 
@@ -420,10 +517,7 @@ subpage_kmalloc(size_t sz)
 		checksubpage(pr);
 
 		if (pr->nfree > 0) {
-
-		doalloc: /* comes here after getting a whole fresh page */
-
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
+			KASSERT(pr->freelist_offset < RUNSIZE(blktype));
 			prpage = PR_PAGEADDR(pr);
 			fla = prpage + pr->freelist_offset;
 			fl = (struct freelist *)fla;
@@ -435,7 +529,7 @@ subpage_kmalloc(size_t sz)
 			if (fl != NULL) {
 				KASSERT(pr->nfree > 0);
 				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
+				KASSERT(fla - prpage < RUNSIZE(blktype));
 				pr->freelist_offset = fla - prpage;
 			}
 			else {
@@ -444,41 +538,96 @@ subpage_kmalloc(size_t sz)
 			}
 
 			checksubpages();
-
-			spinlock_release(&kmalloc_spinlock);
 			return retptr;
 		}
 	}
+	return NULL;
+}
+
+/*
+ * Put the block at PTR back on the free list of its page PR. If that
+ * leaves the whole page free, take the page off the lists and return
+ * its address, for the caller to free once it has let go of
+ * kmalloc_spinlock; otherwise return 0.
+ */
+static
+vaddr_t
+subpage_give(struct pageref *pr, void *ptr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	checksubpages();
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	offset = (vaddr_t)ptr - prpage;
 
 	/*
-	 * No page of the right size available.
-	 * Make a new one.
-	 *
-	 * We release the spinlock while calling alloc_kpages. This
-	 * avoids deadlock if alloc_kpages needs to come back here.
-	 * Note that this means things can change behind our back...
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
 	 */
 
-	spinlock_release(&kmalloc_spinlock);
-	prpage = alloc_kpages(1);
-	if (prpage==0) {
-		/* Out of memory. */
-		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
-		return NULL;
+	fla = prpage + offset;
+	fl = (struct freelist *)fla;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
 	}
-	spinlock_acquire(&kmalloc_spinlock);
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= RUNBLOCKS(blktype));
+	if (pr->nfree == RUNBLOCKS(blktype)) {
+		/* Whole page is free. */
+		remove_lists(pr, blktype);
+		if (!coremap_settag(KVADDR_TO_PADDR(prpage),
+				    runpages[blktype], 0)) {
+			KASSERT(pagerefs_untagged > 0);
+			pagerefs_untagged--;
+		}
+		freepageref(pr);
+		return prpage;
+	}
+
+	checksubpages();
+	return 0;
+}
+
+/*
+ * Carve the fresh page at PRPAGE into blocks of type BLKTYPE and add
+ * it to the lists.
+ */
+static
+int
+subpage_addpage(vaddr_t prpage, unsigned blktype)
+{
+	struct pageref *pr;	// pageref for the new page
+	vaddr_t fla;		// free list entry address
+	struct freelist *volatile fl;	// free list entry
+
+	volatile int i;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	pr = allocpageref();
 	if (pr==NULL) {
 		/* Couldn't allocate accounting space for the new page. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
-		return NULL;
+		return ENOMEM;
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
-	pr->nfree = PAGE_SIZE / sizes[blktype];
+	pr->nfree = RUNBLOCKS(blktype);
+	if (!coremap_settag(KVADDR_TO_PADDR(prpage), runpages[blktype],
+			    pr - pagerefs + 1)) {
+		pagerefs_untagged++;
+	}
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -504,51 +653,254 @@ subpage_kmalloc(size_t sz)
 	pr->next_all = allbase;
 	allbase = pr;
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	checksubpages();
+	return 0;
 }
 
+////////////////////////////////////////
+//
+// Per-cpu caches
+
+/*
+ * How many free blocks of type BLKTYPE a cpu may cache: no more than
+ * half a run's worth, so that the big sizes don't pin whole runs.
+ * Refills and flushes move half of that.
+ */
 static
-int
-subpage_kfree(void *ptr)
+unsigned
+kmcache_size(unsigned blktype)
 {
-	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
-	struct pageref *pr;	// pageref for page we're freeing in
-	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
-	vaddr_t offset;		// offset into page
+	unsigned n;
 
-	ptraddr = (vaddr_t)ptr;
+	n = RUNBLOCKS(blktype) / 2;
+	if (n > CPU_KMCACHE_SIZE) {
+		n = CPU_KMCACHE_SIZE;
+	}
+	return n;
+}
 
+static
+unsigned
+kmcache_batch(unsigned blktype)
+{
+	unsigned n;
+
+	n = kmcache_size(blktype) / 2;
+	return n > 0 ? n : 1;
+}
+
+/*
+ * Move up to a batch of free blocks of type BLKTYPE from the pages into
+ * C's cache. Interrupts are off.
+ */
+static
+void
+kmcache_refill(struct cpu *c, unsigned blktype)
+{
+	unsigned i, n;
+	void *ptr;
+
+	n = kmcache_batch(blktype);
 	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<n; i++) {
+		ptr = subpage_take(blktype);
+		if (ptr == NULL) {
+			break;
+		}
+		c->c_kmcache[blktype][c->c_kmcache_count[blktype]++] = ptr;
+	}
+	spinlock_release(&kmalloc_spinlock);
+}
 
-	checksubpages();
+/*
+ * Give up to NBLOCKS blocks of type BLKTYPE from C's cache back to
+ * their pages, and free any pages that leaves empty. Returns the number
+ * of pages freed. Interrupts are off.
+ */
+static
+unsigned
+kmcache_flush(struct cpu *c, unsigned blktype, unsigned nblocks)
+{
+	vaddr_t freepages[CPU_KMCACHE_SIZE];
+	struct pageref *pr;
+	unsigned i, nfreed;
+	void *ptr;
 
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
+	KASSERT(nblocks <= CPU_KMCACHE_SIZE);
 
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
+	nfreed = 0;
+	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<nblocks && c->c_kmcache_count[blktype] > 0; i++) {
+		ptr = c->c_kmcache[blktype][--c->c_kmcache_count[blktype]];
+		pr = subpage_lookup((vaddr_t)ptr);
+		KASSERT(pr != NULL && PR_BLOCKTYPE(pr) == blktype);
+		freepages[nfreed] = subpage_give(pr, ptr);
+		if (freepages[nfreed] != 0) {
+			nfreed++;
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
 
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
+	/* Call free_kpages without kmalloc_spinlock. */
+	for (i=0; i<nfreed; i++) {
+		free_kpages(freepages[i]);
+	}
+	return nfreed;
+}
+
+/*
+ * Flush every block in C's caches back to the pages, and return the
+ * number of pages freed. C is the current cpu; interrupts are off.
+ */
+static
+unsigned
+kmcache_flushall(struct cpu *c)
+{
+	unsigned i, nfreed;
+
+	c->c_kmcache_flushreq = false;
+	nfreed = 0;
+	for (i=0; i<NSIZES; i++) {
+		nfreed += kmcache_flush(c, i, c->c_kmcache_count[i]);
+	}
+	return nfreed;
+}
+
+/*
+ * Flush this cpu's caches, and ask every other cpu to flush its own at
+ * its next kmalloc or kfree (c_kmcache_flushreq); a cpu that does
+ * neither keeps its blocks, at most half a run of each size, until it
+ * does. This is a reclaim callback (reclaim.h), registered in
+ * vm_bootstrap. Returns ENOMEM if no page was freed here.
+ */
+int
+kheap_reclaim(void)
+{
+	struct cpu *c;
+	unsigned i, nfreed;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return ENOMEM;
+	}
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	for (i=0; i<cpu_count(); i++) {
+		if (cpu_get(i) != c) {
+			cpu_get(i)->c_kmcache_flushreq = true;
 		}
 	}
+	nfreed = kmcache_flushall(c);
+	splx(spl);
+
+	return nfreed > 0 ? 0 : ENOMEM;
+}
+
+////////////////////////////////////////
+
+static
+void *
+subpage_kmalloc(size_t sz)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	vaddr_t prpage;		// a fresh page
+	struct cpu *c;
+	void *retptr;		// our result
+	int spl, result;
+
+	blktype = blocktype(sz);
 
+	while (1) {
+		if (CURCPU_EXISTS()) {
+			spl = splhigh();
+			c = curcpu->c_self;
+			if (c->c_kmcache_flushreq) {
+				kmcache_flushall(c);
+			}
+			if (c->c_kmcache_count[blktype] > 0) {
+				c->c_kmcache_hits++;
+			}
+			else {
+				c->c_kmcache_misses++;
+				kmcache_refill(c, blktype);
+			}
+			if (c->c_kmcache_count[blktype] > 0) {
+				retptr = c->c_kmcache[blktype]
+					[--c->c_kmcache_count[blktype]];
+				splx(spl);
+				return retptr;
+			}
+			splx(spl);
+		}
+		else {
+			/* Too early in boot for the per-cpu caches. */
+			spinlock_acquire(&kmalloc_spinlock);
+			retptr = subpage_take(blktype);
+			spinlock_release(&kmalloc_spinlock);
+			if (retptr != NULL) {
+				return retptr;
+			}
+		}
+
+		/*
+		 * No page of the right size available.
+		 * Make a new one.
+		 *
+		 * We don't hold the spinlock, or have interrupts off,
+		 * while calling alloc_kpages. This avoids deadlock if
+		 * alloc_kpages needs to come back here, and lets it
+		 * evict if it has to. Another cpu may take the new
+		 * page's blocks before we get back; then we go round
+		 * again.
+		 */
+		prpage = alloc_kpages(runpages[blktype]);
+		if (prpage==0) {
+			/* Out of memory, or for a run, out of contiguous memory. */
+			if (runpages[blktype] == 1) {
+				kprintf("kmalloc: Subpage allocator couldn't "
+					"get a page\n");
+			}
+			return NULL;
+		}
+		spinlock_acquire(&kmalloc_spinlock);
+		result = subpage_addpage(prpage, blktype);
+		spinlock_release(&kmalloc_spinlock);
+		if (result) {
+			free_kpages(prpage);
+			kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
+			return NULL;
+		}
+	}
+}
+
+static
+int
+subpage_kfree(void *ptr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t ptraddr;	// same as ptr
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t offset;		// offset into page
+	struct cpu *c;
+	int spl;
+
+	ptraddr = (vaddr_t)ptr;
+
+	pr = subpage_lookup(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype>=0 && blktype<NSIZES);
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
+	if (offset >= RUNSIZE(blktype) || offset % sizes[blktype] != 0) {
 		panic("kfree: subpage free of invalid addr %p\n", ptr);
 	}
 
@@ -558,33 +910,27 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef(ptr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
-
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	if (CURCPU_EXISTS()) {
+		spl = splhigh();
+		c = curcpu->c_self;
+		if (c->c_kmcache_flushreq) {
+			kmcache_flushall(c);
+		}
+		if (c->c_kmcache_count[blktype] == kmcache_size(blktype)) {
+			kmcache_flush(c, blktype, kmcache_batch(blktype));
+		}
+		c->c_kmcache[blktype][c->c_kmcache_count[blktype]++] = ptr;
+		splx(spl);
+		return 0;
 	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
+	/* Too early in boot for the per-cpu caches. */
+	spinlock_acquire(&kmalloc_spinlock);
+	prpage = subpage_give(pr, ptr);
+	spinlock_release(&kmalloc_spinlock);
+	if (prpage != 0) {
 		free_kpages(prpage);
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
-	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -597,25 +943,308 @@ subpage_kfree(void *ptr)
 
 //
 ////////////////////////////////////////////////////////////
+//
+// Heap profiling (options kheapprof).
+//
+// Each kmalloc is charged to the address it was called from. Live
+// blocks are kept in khp_blocks, a hash table keyed by block address,
+// so that kfree can find the call site and size to credit. The call
+// sites, with their live bytes, peak, and counts, are in khp_sites,
+// hashed by caller. Both tables are fixed in size: a block that finds
+// khp_blocks too full is counted as dropped and not tracked (so its
+// free isn't either), and once khp_sites fills up, new callers are
+// lumped together in its last entry.
+//
+// "kh N" prints the N sites with the most bytes live, by address. To
+// put names to them, run the addresses through
+//    os161-addr2line -f -e kernel
+// (mips-harvard-os161-addr2line) against the kernel that was booted.
+// Blocks kstrdup allocates are charged to kstrdup.
+//
+
+#if OPT_KHEAPPROF
 
+#define KHP_SITEBITS	8
+#define KHP_NSITES	(1 << KHP_SITEBITS)
+#define KHP_OTHER	KHP_NSITES	/* callers that didn't fit */
+#define KHP_BLOCKBITS	11
+#define KHP_NBLOCKS	(1 << KHP_BLOCKBITS)
+#define KHP_MAXBLOCKS	(KHP_NBLOCKS / 4 * 3)	/* keep probing short */
+#define KHP_MAXSHOW	32	/* most sites kheap_printprofile shows */
+
+#define KHP_HASH(x, bits) (((uint32_t)(x) * 2654435761U) >> (32 - (bits)))
+
+struct khp_site {
+	vaddr_t ks_caller;	/* 0 if unused */
+	size_t ks_live;		/* bytes allocated and not yet freed */
+	size_t ks_peak;		/* most ks_live has been */
+	unsigned ks_allocs;
+	unsigned ks_frees;
+};
+
+struct khp_block {
+	vaddr_t kb_addr;	/* 0 if unused */
+	size_t kb_size;
+	unsigned kb_site;	/* index into khp_sites */
+};
+
+static struct spinlock khp_lock = SPINLOCK_INITIALIZER;
+static struct khp_site khp_sites[KHP_NSITES + 1];
+static struct khp_block khp_blocks[KHP_NBLOCKS];
+static unsigned khp_nblocks;	/* entries in use in khp_blocks */
+static unsigned khp_dropped;	/* blocks that couldn't be tracked */
+
+/* Find or make the entry for CALLER. */
+static
+unsigned
+khp_site(vaddr_t caller)
+{
+	unsigned i, n;
+
+	KASSERT(spinlock_do_i_hold(&khp_lock));
+
+	i = KHP_HASH(caller, KHP_SITEBITS);
+	for (n=0; n<KHP_NSITES; n++, i = (i + 1) % KHP_NSITES) {
+		if (khp_sites[i].ks_caller == caller) {
+			return i;
+		}
+		if (khp_sites[i].ks_caller == 0) {
+			khp_sites[i].ks_caller = caller;
+			return i;
+		}
+	}
+	return KHP_OTHER;
+}
+
+static
+void
+khp_alloc(void *ptr, size_t sz, vaddr_t caller)
+{
+	struct khp_site *ks;
+	unsigned s, i;
+
+	if (ptr == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&khp_lock);
+	s = khp_site(caller);
+	ks = &khp_sites[s];
+	ks->ks_allocs++;
+	if (khp_nblocks >= KHP_MAXBLOCKS) {
+		khp_dropped++;
+		spinlock_release(&khp_lock);
+		return;
+	}
+
+	i = KHP_HASH(ptr, KHP_BLOCKBITS);
+	while (khp_blocks[i].kb_addr != 0) {
+		i = (i + 1) % KHP_NBLOCKS;
+	}
+	khp_blocks[i].kb_addr = (vaddr_t)ptr;
+	khp_blocks[i].kb_size = sz;
+	khp_blocks[i].kb_site = s;
+	khp_nblocks++;
+
+	ks->ks_live += sz;
+	if (ks->ks_live > ks->ks_peak) {
+		ks->ks_peak = ks->ks_live;
+	}
+	spinlock_release(&khp_lock);
+}
+
+static
+void
+khp_free(void *ptr)
+{
+	struct khp_site *ks;
+	unsigned i, j, home;
+
+	spinlock_acquire(&khp_lock);
+	i = KHP_HASH(ptr, KHP_BLOCKBITS);
+	while (khp_blocks[i].kb_addr != (vaddr_t)ptr) {
+		if (khp_blocks[i].kb_addr == 0) {
+			/* one of the dropped ones */
+			spinlock_release(&khp_lock);
+			return;
+		}
+		i = (i + 1) % KHP_NBLOCKS;
+	}
+
+	ks = &khp_sites[khp_blocks[i].kb_site];
+	KASSERT(ks->ks_live >= khp_blocks[i].kb_size);
+	ks->ks_live -= khp_blocks[i].kb_size;
+	ks->ks_frees++;
+
+	/*
+	 * Close up the hole at I, so that lookups never need to look past
+	 * an empty entry: move back each later entry in the same cluster
+	 * whose home slot isn't cyclically in (I, J].
+	 */
+	for (j = (i + 1) % KHP_NBLOCKS; khp_blocks[j].kb_addr != 0;
+	     j = (j + 1) % KHP_NBLOCKS) {
+		home = KHP_HASH(khp_blocks[j].kb_addr, KHP_BLOCKBITS);
+		if (i < j ? (home <= i || home > j) : (home <= i && home > j)) {
+			khp_blocks[i] = khp_blocks[j];
+			i = j;
+		}
+	}
+	khp_blocks[i].kb_addr = 0;
+	khp_nblocks--;
+	spinlock_release(&khp_lock);
+}
+
+/*
+ * Print the NSITES (at most KHP_MAXSHOW) call sites with the most bytes
+ * live (kernel menu "kh"), largest first. The sites are copied out
+ * under the lock and printed afterwards, because kprintf may sleep.
+ */
+void
+kheap_printprofile(unsigned nsites)
+{
+	bool shown[KHP_NSITES + 1];
+	struct khp_site top[KHP_MAXSHOW];
+	struct khp_site *ks;
+	unsigned i, n, best, nblocks, dropped;
+
+	if (nsites > KHP_MAXSHOW) {
+		nsites = KHP_MAXSHOW;
+	}
+	for (i=0; i<=KHP_NSITES; i++) {
+		shown[i] = false;
+	}
+
+	spinlock_acquire(&khp_lock);
+	nblocks = khp_nblocks;
+	dropped = khp_dropped;
+	for (n=0; n<nsites; n++) {
+		best = KHP_NSITES + 1;
+		for (i=0; i<=KHP_NSITES; i++) {
+			if (shown[i] || khp_sites[i].ks_allocs == 0) {
+				continue;
+			}
+			if (best > KHP_NSITES ||
+			    khp_sites[i].ks_live > khp_sites[best].ks_live) {
+				best = i;
+			}
+		}
+		if (best > KHP_NSITES) {
+			break;
+		}
+		shown[best] = true;
+		/* KHP_OTHER's caller stays 0, which marks it below. */
+		top[n] = khp_sites[best];
+	}
+	spinlock_release(&khp_lock);
+
+	kprintf("Heap profile: %u blocks tracked, %u dropped\n",
+		nblocks, dropped);
+	kprintf("  %-10s %8s %8s %8s %8s\n",
+		"caller", "live", "peak", "allocs", "frees");
+	for (i=0; i<n; i++) {
+		ks = &top[i];
+		if (ks->ks_caller == 0) {
+			kprintf("  %-10s", "(others)");
+		}
+		else {
+			kprintf("  0x%08lx", (unsigned long)ks->ks_caller);
+		}
+		kprintf(" %8lu %8lu %8u %8u\n", (unsigned long)ks->ks_live,
+			(unsigned long)ks->ks_peak, ks->ks_allocs,
+			ks->ks_frees);
+	}
+}
+
+#endif /* OPT_KHEAPPROF */
+
+//
+////////////////////////////////////////////////////////////
+
+/*
+ * Whether SZ bytes are better off in whole pages than in a block: if
+ * no block is big enough, or if rounding up to pages wastes no more
+ * than rounding up to a block. (So a 4k thread stack gets a page to
+ * itself, not a 6k block.)
+ */
+static
+bool
+kmalloc_usepages(size_t sz)
+{
+	if (sz > LARGEST_SUBPAGE_SIZE) {
+		return true;
+	}
+	if (sz <= PAGE_SIZE / 2) {
+		return false;
+	}
+	return ROUNDUP(sz, PAGE_SIZE) <= sizes[blocktype(sz)];
+}
+
+/*
+ * kmalloc proper; kmalloc and kvmalloc wrap it to do the profiling.
+ */
+static
 void *
-kmalloc(size_t sz)
+kmalloc_raw(size_t sz)
 {
-	if (sz>=LARGEST_SUBPAGE_SIZE) {
-		unsigned long npages;
-		vaddr_t address;
-
-		/* Round up to a whole number of pages. */
-		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
-		address = alloc_kpages(npages);
-		if (address==0) {
-			return NULL;
+	unsigned long npages;
+	vaddr_t address;
+	void *ptr;
+
+	if (!kmalloc_usepages(sz)) {
+		ptr = subpage_kmalloc(sz);
+		if (ptr != NULL || runpages[blocktype(sz)] == 1) {
+			return ptr;
 		}
+		/* No run of pages to be had; whole pages may still do. */
+	}
 
-		return (void *)address;
+	/* Round up to a whole number of pages. */
+	npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
+	address = alloc_kpages(npages);
+	if (address==0) {
+		return NULL;
 	}
 
-	return subpage_kmalloc(sz);
+	return (void *)address;
+}
+
+void *
+kmalloc(size_t sz)
+{
+#if OPT_KHEAPPROF
+	void *ptr;
+
+	ptr = kmalloc_raw(sz);
+	khp_alloc(ptr, sz, (vaddr_t)__builtin_return_address(0));
+	return ptr;
+#else
+	return kmalloc_raw(sz);
+#endif
+}
+
+/*
+ * Allocate a big buffer that needn't be physically contiguous. Up to a
+ * page this is just kmalloc; past that the pages are mapped one by one
+ * in kseg2 (see alloc_kvpages), so the allocation doesn't depend on
+ * finding a run of free frames. The memory goes through the TLB, so it
+ * is no good for thread stacks, which mustn't take TLB faults, or for
+ * anything that needs its physical address. Free it with kvfree.
+ */
+void *
+kvmalloc(size_t sz)
+{
+	void *ptr;
+
+	if (sz <= PAGE_SIZE) {
+		ptr = kmalloc_raw(sz);
+	}
+	else {
+		ptr = (void *)alloc_kvpages(DIVROUNDUP(sz, PAGE_SIZE));
+	}
+#if OPT_KHEAPPROF
+	khp_alloc(ptr, sz, (vaddr_t)__builtin_return_address(0));
+#endif
+	return ptr;
 }
 
 void
@@ -626,9 +1255,36 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+	if ((vaddr_t)ptr >= MIPS_KSEG2) {
+		panic("kfree: %p is kvmalloc memory; use kvfree\n", ptr);
+	}
+#if OPT_KHEAPPROF
+	khp_free(ptr);
+#endif
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
 }
 
+/*
+ * Free a block from kvmalloc. Unmapping pages of kseg2 means a TLB
+ * shootdown, which waits for the other cpus, so no spinlock may be
+ * held; kfree, which never waits, can't be used for these blocks.
+ */
+void
+kvfree(void *ptr)
+{
+	if ((vaddr_t)ptr < MIPS_KSEG2) {
+		/* Small enough to have come from kmalloc. */
+		kfree(ptr);
+		return;
+	}
+	KASSERT(curthread->t_iplhigh_count == 0);
+#if OPT_KHEAPPROF
+	khp_free(ptr);
+#endif
+	free_kvpages((vaddr_t)ptr);
+}
+
@@ -0,0 +1,347 @@
+/*
+ * Object caches. See kmemcache.h for the interface.
+ *
+ * Each slab is one page: a struct kmem_slab header, then the stack of
+ * the indexes of the slab's free objects, then the objects. Keeping
+ * the free list out of the objects themselves is what lets free
+ * objects stay constructed. An object's slab is found by masking off
+ * its page offset.
+ *
+ * A cache keeps its slabs on three lists: partial (some objects in
+ * use), full, and empty. Allocation prefers partial slabs, so that
+ * empty ones stay empty and can be given back. Frees keep up to
+ * KMEM_MAXEMPTY empty slabs per cache and release the rest;
+ * kmem_cache_reclaim releases those as well.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmemcache.h>
+
+#define KMEM_ALIGN	8	/* alignment of objects */
+#define KMEM_MAXEMPTY	1	/* empty slabs a cache holds on to */
+
+struct kmem_slab {
+	struct kmem_slab *sl_next;
+	struct kmem_slab *sl_prev;
+	struct kmem_cache *sl_cache;
+	unsigned sl_nfree;		/* entries in sl_free */
+	uint16_t sl_free[];		/* indexes of free objects */
+};
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_objsize;		/* size asked for */
+	size_t kc_size;			/* kc_objsize rounded to KMEM_ALIGN */
+	unsigned kc_perslab;		/* objects per slab */
+	size_t kc_offset;		/* offset of the first object */
+	int (*kc_ctor)(void *);
+	void (*kc_dtor)(void *);
+
+	struct spinlock kc_lock;	/* protects the rest */
+	struct kmem_slab *kc_partial;
+	struct kmem_slab *kc_full;
+	struct kmem_slab *kc_empty;
+	unsigned kc_nempty;		/* slabs on kc_empty */
+	unsigned kc_nslabs;		/* slabs on all three lists */
+	unsigned kc_inuse;		/* objects allocated */
+	unsigned kc_allocs;		/* calls to kmem_cache_alloc */
+	unsigned kc_failed;		/* ...that returned NULL */
+	unsigned kc_grows;		/* slabs created */
+	unsigned kc_shrinks;		/* slabs given back */
+
+	struct kmem_cache *kc_next;	/* on kmem_caches */
+};
+
+/*
+ * All caches, newest first. Caches are never destroyed, so once the
+ * head has been read the list can be walked without the lock.
+ */
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+static struct kmem_cache *kmem_caches;
+
+/* Offset of the first object in a slab holding N objects. */
+static
+size_t
+kmem_offset(unsigned n)
+{
+	return ROUNDUP(sizeof(struct kmem_slab) + n * sizeof(uint16_t),
+		       KMEM_ALIGN);
+}
+
+static
+void *
+slab_obj(struct kmem_cache *kc, struct kmem_slab *sl, unsigned index)
+{
+	return (void *)((vaddr_t)sl + kc->kc_offset + index * kc->kc_size);
+}
+
+static
+void
+slab_insert(struct kmem_slab **list, struct kmem_slab *sl)
+{
+	sl->sl_prev = NULL;
+	sl->sl_next = *list;
+	if (*list != NULL) {
+		(*list)->sl_prev = sl;
+	}
+	*list = sl;
+}
+
+static
+void
+slab_remove(struct kmem_slab **list, struct kmem_slab *sl)
+{
+	if (sl->sl_prev != NULL) {
+		sl->sl_prev->sl_next = sl->sl_next;
+	}
+	else {
+		KASSERT(*list == sl);
+		*list = sl->sl_next;
+	}
+	if (sl->sl_next != NULL) {
+		sl->sl_next->sl_prev = sl->sl_prev;
+	}
+	sl->sl_next = sl->sl_prev = NULL;
+}
+
+/*
+ * Destruct the free objects of a slab that is on no list and free its
+ * page. Called without kc_lock.
+ */
+static
+void
+slab_destroy(struct kmem_cache *kc, struct kmem_slab *sl)
+{
+	unsigned i;
+
+	KASSERT(sl->sl_cache == kc);
+
+	if (kc->kc_dtor != NULL) {
+		for (i = 0; i < sl->sl_nfree; i++) {
+			kc->kc_dtor(slab_obj(kc, sl, sl->sl_free[i]));
+		}
+	}
+	sl->sl_cache = NULL;
+	free_kpages((vaddr_t)sl);
+}
+
+/*
+ * Make a slab and construct its objects. Called without kc_lock:
+ * alloc_kpages may run kmem_cache_reclaim, and constructors may
+ * allocate from other caches.
+ */
+static
+struct kmem_slab *
+slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *sl;
+	vaddr_t page;
+	unsigned i;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+	sl = (struct kmem_slab *)page;
+	sl->sl_next = sl->sl_prev = NULL;
+	sl->sl_cache = kc;
+	sl->sl_nfree = 0;
+
+	/* Last first, so objects are handed out in address order. */
+	for (i = kc->kc_perslab; i-- > 0; ) {
+		if (kc->kc_ctor != NULL && kc->kc_ctor(slab_obj(kc, sl, i))) {
+			/* destructs just the ones already pushed */
+			slab_destroy(kc, sl);
+			return NULL;
+		}
+		sl->sl_free[sl->sl_nfree++] = i;
+	}
+	return sl;
+}
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  int (*ctor)(void *), void (*dtor)(void *))
+{
+	struct kmem_cache *kc;
+	unsigned n;
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = name;
+	kc->kc_objsize = size;
+	kc->kc_size = ROUNDUP(size > 0 ? size : 1, KMEM_ALIGN);
+
+	/* As many objects as fit behind the header and free stack. */
+	n = (PAGE_SIZE - sizeof(struct kmem_slab)) /
+		(kc->kc_size + sizeof(uint16_t));
+	while (n > 0 && kmem_offset(n) + n * kc->kc_size > PAGE_SIZE) {
+		n--;
+	}
+	KASSERT(n > 0);
+	kc->kc_perslab = n;
+	kc->kc_offset = kmem_offset(n);
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+
+	spinlock_init(&kc->kc_lock);
+	kc->kc_partial = kc->kc_full = kc->kc_empty = NULL;
+	kc->kc_nempty = 0;
+	kc->kc_nslabs = 0;
+	kc->kc_inuse = 0;
+	kc->kc_allocs = 0;
+	kc->kc_failed = 0;
+	kc->kc_grows = 0;
+	kc->kc_shrinks = 0;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_caches_lock);
+
+	return kc;
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *sl;
+	void *obj;
+
+	spinlock_acquire(&kc->kc_lock);
+	while (kc->kc_partial == NULL && kc->kc_empty == NULL) {
+		spinlock_release(&kc->kc_lock);
+		sl = slab_create(kc);
+		spinlock_acquire(&kc->kc_lock);
+		if (sl == NULL) {
+			kc->kc_failed++;
+			spinlock_release(&kc->kc_lock);
+			return NULL;
+		}
+		slab_insert(&kc->kc_empty, sl);
+		kc->kc_nempty++;
+		kc->kc_nslabs++;
+		kc->kc_grows++;
+	}
+
+	sl = kc->kc_partial;
+	if (sl == NULL) {
+		sl = kc->kc_empty;
+		slab_remove(&kc->kc_empty, sl);
+		kc->kc_nempty--;
+		slab_insert(&kc->kc_partial, sl);
+	}
+	KASSERT(sl->sl_nfree > 0);
+	obj = slab_obj(kc, sl, sl->sl_free[--sl->sl_nfree]);
+	if (sl->sl_nfree == 0) {
+		slab_remove(&kc->kc_partial, sl);
+		slab_insert(&kc->kc_full, sl);
+	}
+	kc->kc_inuse++;
+	kc->kc_allocs++;
+	spinlock_release(&kc->kc_lock);
+
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *sl, *victim;
+	vaddr_t first;
+	unsigned index;
+
+	sl = (struct kmem_slab *)((vaddr_t)obj & PAGE_FRAME);
+	first = (vaddr_t)sl + kc->kc_offset;
+	if (sl->sl_cache != kc || (vaddr_t)obj < first ||
+	    ((vaddr_t)obj - first) % kc->kc_size != 0) {
+		panic("kmem_cache_free: %p is not from cache %s\n",
+		      obj, kc->kc_name);
+	}
+	index = ((vaddr_t)obj - first) / kc->kc_size;
+	KASSERT(index < kc->kc_perslab);
+
+	victim = NULL;
+	spinlock_acquire(&kc->kc_lock);
+	KASSERT(sl->sl_nfree < kc->kc_perslab);
+	sl->sl_free[sl->sl_nfree++] = index;
+	if (sl->sl_nfree == 1) {
+		slab_remove(&kc->kc_full, sl);
+		slab_insert(&kc->kc_partial, sl);
+	}
+	if (sl->sl_nfree == kc->kc_perslab) {
+		slab_remove(&kc->kc_partial, sl);
+		if (kc->kc_nempty < KMEM_MAXEMPTY) {
+			slab_insert(&kc->kc_empty, sl);
+			kc->kc_nempty++;
+		}
+		else {
+			victim = sl;
+			kc->kc_nslabs--;
+			kc->kc_shrinks++;
+		}
+	}
+	kc->kc_inuse--;
+	spinlock_release(&kc->kc_lock);
+
+	if (victim != NULL) {
+		slab_destroy(kc, victim);
+	}
+}
+
+int
+kmem_cache_reclaim(void)
+{
+	struct kmem_cache *kc;
+	struct kmem_slab *sl, *list;
+	int result;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc = kmem_caches;
+	spinlock_release(&kmem_caches_lock);
+
+	result = ENOMEM;
+	for (; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		list = kc->kc_empty;
+		kc->kc_empty = NULL;
+		kc->kc_nslabs -= kc->kc_nempty;
+		kc->kc_shrinks += kc->kc_nempty;
+		kc->kc_nempty = 0;
+		spinlock_release(&kc->kc_lock);
+
+		while (list != NULL) {
+			sl = list;
+			list = sl->sl_next;
+			slab_destroy(kc, sl);
+			result = 0;
+		}
+	}
+	return result;
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc = kmem_caches;
+	spinlock_release(&kmem_caches_lock);
+
+	/* The counters are read without locking; they're only statistics. */
+	kprintf("Object caches:\n");
+	for (; kc != NULL; kc = kc->kc_next) {
+		kprintf("  %-12s %4u bytes, %3u/slab: %u slabs, %u in use, "
+			"%u allocs (%u failed), %u slabs made, %u freed\n",
+			kc->kc_name, (unsigned)kc->kc_objsize, kc->kc_perslab,
+			kc->kc_nslabs, kc->kc_inuse, kc->kc_allocs,
+			kc->kc_failed, kc->kc_grows, kc->kc_shrinks);
+	}
+}
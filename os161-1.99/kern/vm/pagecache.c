@@ -0,0 +1,391 @@
+/*
+ * Page cache for mapped files. See pagecache.h for the interface.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagecache.h>
+
+#define PC_NBUCKETS 32
+#define PC_MAXIDLE  16
+#define PC_HASH(offset) ((unsigned)((offset) / PAGE_SIZE) % PC_NBUCKETS)
+
+struct pcpage {
+	off_t pp_offset;		/* page-aligned file offset */
+	paddr_t pp_paddr;		/* frame holding it */
+	bool pp_busy;			/* still being read in */
+	struct pcpage *pp_next;		/* hash chain */
+};
+
+struct pcfile {
+	struct vnode *pf_vnode;
+	unsigned pf_refcount;		/* regions mapping the file */
+	unsigned pf_npages;
+	struct pcpage *pf_buckets[PC_NBUCKETS];
+	struct pcfile *pf_next;		/* list of all pcfiles */
+};
+
+/*
+ * Every pcfile, in use or idle. There are only ever a handful, so a
+ * list does. A file goes to the front when it becomes idle, so the
+ * idle file nearest the back has been idle longest. Like the pcfiles
+ * themselves it is protected by vm_pagelock.
+ */
+static struct pcfile *pc_files;
+static unsigned pc_nidle;
+
+/*
+ * Unlink PF from pc_files.
+ */
+static
+void
+pagecache_unlink(struct pcfile *pf)
+{
+	struct pcfile **pfp;
+
+	for (pfp = &pc_files; *pfp != pf; pfp = &(*pfp)->pf_next) {
+		KASSERT(*pfp != NULL);
+	}
+	*pfp = pf->pf_next;
+}
+
+/*
+ * Free the idle file PF and its pages.
+ */
+static
+void
+pagecache_free(struct pcfile *pf)
+{
+	struct pcpage *pp;
+	unsigned i;
+
+	KASSERT(pf->pf_refcount == 0);
+
+	pagecache_unlink(pf);
+	pc_nidle--;
+	for (i=0; i<PC_NBUCKETS; i++) {
+		while ((pp = pf->pf_buckets[i]) != NULL) {
+			/* Only a file in use can have a page being read. */
+			KASSERT(!pp->pp_busy);
+			pf->pf_buckets[i] = pp->pp_next;
+			coremap_decref(pp->pp_paddr);
+			kfree(pp);
+		}
+	}
+	VOP_DECREF(pf->pf_vnode);
+	kfree(pf);
+}
+
+struct pcfile *
+pagecache_get(struct vnode *vn)
+{
+	struct pcfile *pf;
+	unsigned i;
+
+	for (pf = pc_files; pf != NULL; pf = pf->pf_next) {
+		if (pf->pf_vnode == vn) {
+			if (pf->pf_refcount == 0) {
+				pc_nidle--;
+			}
+			pf->pf_refcount++;
+			return pf;
+		}
+	}
+
+	pf = kmalloc(sizeof(struct pcfile));
+	if (pf == NULL) {
+		return NULL;
+	}
+	VOP_INCREF(vn);
+	pf->pf_vnode = vn;
+	pf->pf_refcount = 1;
+	pf->pf_npages = 0;
+	for (i=0; i<PC_NBUCKETS; i++) {
+		pf->pf_buckets[i] = NULL;
+	}
+	pf->pf_next = pc_files;
+	pc_files = pf;
+	return pf;
+}
+
+void
+pagecache_incref(struct pcfile *pf)
+{
+	KASSERT(pf->pf_refcount > 0);
+	pf->pf_refcount++;
+}
+
+void
+pagecache_put(struct pcfile *pf)
+{
+	KASSERT(pf->pf_refcount > 0);
+	pf->pf_refcount--;
+	if (pf->pf_refcount > 0) {
+		return;
+	}
+
+	/* Keep the pages for the next user, at the front of the list. */
+	pagecache_unlink(pf);
+	pf->pf_next = pc_files;
+	pc_files = pf;
+	pc_nidle++;
+	if (pc_nidle > PC_MAXIDLE) {
+		(void)pagecache_reclaim();
+	}
+}
+
+/*
+ * Free the pages of PF that only the cache holds on to. Returns ENOMEM
+ * if there were none.
+ */
+static
+int
+pagecache_trimfile(struct pcfile *pf)
+{
+	struct pcpage *pp, **ppp;
+	unsigned i;
+	int result = ENOMEM;
+
+	for (i=0; i<PC_NBUCKETS; i++) {
+		ppp = &pf->pf_buckets[i];
+		while ((pp = *ppp) != NULL) {
+			if (pp->pp_busy ||
+			    coremap_refcount(pp->pp_paddr) > 1) {
+				ppp = &pp->pp_next;
+				continue;
+			}
+			*ppp = pp->pp_next;
+			pf->pf_npages--;
+			coremap_decref(pp->pp_paddr);
+			kfree(pp);
+			result = 0;
+		}
+	}
+	return result;
+}
+
+/*
+ * Free the pages of files in use that only the cache holds on to. The
+ * pager unmaps cached pages to make room, and this is what frees them.
+ * Returns ENOMEM if there were none.
+ */
+static
+int
+pagecache_trim(void)
+{
+	struct pcfile *pf;
+	int result = ENOMEM;
+
+	for (pf = pc_files; pf != NULL; pf = pf->pf_next) {
+		if (pagecache_trimfile(pf) == 0) {
+			result = 0;
+		}
+	}
+	return result;
+}
+
+int
+pagecache_reclaim(void)
+{
+	struct pcfile *pf, *victim;
+
+	victim = NULL;
+	for (pf = pc_files; pf != NULL; pf = pf->pf_next) {
+		if (pf->pf_refcount == 0) {
+			victim = pf;
+		}
+	}
+	if (victim == NULL) {
+		return pagecache_trim();
+	}
+	pagecache_free(victim);
+	return 0;
+}
+
+void
+pagecache_forget(struct vnode *vn)
+{
+	struct pcfile *pf;
+
+	for (pf = pc_files; pf != NULL; pf = pf->pf_next) {
+		if (pf->pf_vnode == vn) {
+			break;
+		}
+	}
+	if (pf == NULL) {
+		return;
+	}
+	if (pf->pf_refcount == 0) {
+		pagecache_free(pf);
+	}
+	else {
+		(void)pagecache_trimfile(pf);
+	}
+}
+
+/*
+ * Find the page at OFFSET in PF, or return NULL.
+ */
+static
+struct pcpage *
+pagecache_find(struct pcfile *pf, off_t offset)
+{
+	struct pcpage *pp;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	for (pp = pf->pf_buckets[PC_HASH(offset)]; pp != NULL;
+	     pp = pp->pp_next) {
+		if (pp->pp_offset == offset) {
+			return pp;
+		}
+	}
+	return NULL;
+}
+
+paddr_t
+pagecache_peek(struct pcfile *pf, off_t offset)
+{
+	struct pcpage *pp;
+
+	pp = pagecache_find(pf, offset);
+	if (pp == NULL || pp->pp_busy) {
+		return 0;
+	}
+	return pp->pp_paddr;
+}
+
+int
+pagecache_lookup(struct pcfile *pf, off_t offset, paddr_t *paddr)
+{
+	struct pcpage *pp;
+
+	pp = pagecache_find(pf, offset);
+	if (pp == NULL) {
+		return ENOENT;
+	}
+	if (pp->pp_busy) {
+		return EBUSY;
+	}
+	coremap_incref(pp->pp_paddr);
+	*paddr = pp->pp_paddr;
+	return 0;
+}
+
+/*
+ * Move the part of the page at OFFSET that lies inside the file
+ * between the frame at PADDR and the disk.
+ */
+static
+int
+pagecache_io(struct pcfile *pf, off_t offset, paddr_t paddr,
+	     enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	struct stat st;
+	size_t len;
+	int result;
+
+	result = VOP_STAT(pf->pf_vnode, &st);
+	if (result) {
+		return result;
+	}
+	if (offset >= st.st_size) {
+		return 0;
+	}
+	len = PAGE_SIZE;
+	if (st.st_size - offset < PAGE_SIZE) {
+		len = st.st_size - offset;
+	}
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), len, offset, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(pf->pf_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(pf->pf_vnode, &ku);
+	}
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+int
+pagecache_add(struct pcfile *pf, off_t offset, paddr_t paddr)
+{
+	struct pcpage *pp;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+	KASSERT(pagecache_find(pf, offset) == NULL);
+
+	pp = kmalloc(sizeof(struct pcpage));
+	if (pp == NULL) {
+		return ENOMEM;
+	}
+
+	coremap_incref(paddr);
+	pp->pp_offset = offset;
+	pp->pp_paddr = paddr;
+	pp->pp_busy = true;
+	pp->pp_next = pf->pf_buckets[PC_HASH(offset)];
+	pf->pf_buckets[PC_HASH(offset)] = pp;
+	pf->pf_npages++;
+	return 0;
+}
+
+int
+pagecache_read(struct pcfile *pf, off_t offset, paddr_t paddr)
+{
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+	return pagecache_io(pf, offset, paddr, UIO_READ);
+}
+
+void
+pagecache_done(struct pcfile *pf, off_t offset, int result)
+{
+	struct pcpage *pp, **ppp;
+
+	for (ppp = &pf->pf_buckets[PC_HASH(offset)]; *ppp != NULL;
+	     ppp = &(*ppp)->pp_next) {
+		if ((*ppp)->pp_offset == offset) {
+			break;
+		}
+	}
+	pp = *ppp;
+	KASSERT(pp != NULL && pp->pp_busy);
+
+	if (result == 0) {
+		pp->pp_busy = false;
+		return;
+	}
+	*ppp = pp->pp_next;
+	pf->pf_npages--;
+	coremap_decref(pp->pp_paddr);
+	kfree(pp);
+}
+
+int
+pagecache_writeback(struct pcfile *pf, off_t offset, paddr_t paddr)
+{
+	KASSERT(offset % PAGE_SIZE == 0);
+	return pagecache_io(pf, offset, paddr, UIO_WRITE);
+}
+
+struct vnode *
+pagecache_vnode(struct pcfile *pf)
+{
+	return pf->pf_vnode;
+}
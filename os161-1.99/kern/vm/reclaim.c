@@ -0,0 +1,81 @@
+/*
+ * Memory-pressure callbacks. See reclaim.h for the interface.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <reclaim.h>
+
+#define RECLAIM_MAX	8	/* callbacks that can be registered */
+
+/*
+ * The table is kept sorted by cost. It only changes while booting, so
+ * reclaim_run reads it without locking. The counters are statistics
+ * only and are updated without locking too.
+ */
+static struct reclaimer {
+	const char *rc_name;
+	reclaim_fn rc_fn;
+	unsigned rc_cost;
+	int rc_flags;
+	unsigned rc_calls;	/* times called */
+	unsigned rc_freed;	/* times it freed something */
+} reclaimers[RECLAIM_MAX];
+static unsigned nreclaimers;
+
+void
+reclaim_register(const char *name, reclaim_fn fn, unsigned cost, int flags)
+{
+	unsigned i;
+
+	if (nreclaimers == RECLAIM_MAX) {
+		panic("reclaim_register: too many callbacks (%s)\n", name);
+	}
+
+	for (i = nreclaimers; i > 0 && reclaimers[i-1].rc_cost > cost; i--) {
+		reclaimers[i] = reclaimers[i-1];
+	}
+	reclaimers[i].rc_name = name;
+	reclaimers[i].rc_fn = fn;
+	reclaimers[i].rc_cost = cost;
+	reclaimers[i].rc_flags = flags;
+	reclaimers[i].rc_calls = 0;
+	reclaimers[i].rc_freed = 0;
+	nreclaimers++;
+}
+
+int
+reclaim_run(bool cansleep)
+{
+	struct reclaimer *rc;
+	unsigned i;
+
+	for (i = 0; i < nreclaimers; i++) {
+		rc = &reclaimers[i];
+		if (!cansleep && (rc->rc_flags & RECLAIM_SLEEPS)) {
+			continue;
+		}
+		rc->rc_calls++;
+		if (rc->rc_fn() == 0) {
+			rc->rc_freed++;
+			return 0;
+		}
+	}
+	return ENOMEM;
+}
+
+void
+reclaim_printstats(void)
+{
+	unsigned i;
+
+	kprintf("Reclaim callbacks:\n");
+	for (i = 0; i < nreclaimers; i++) {
+		kprintf("  %-12s cost %3u%s: %u calls, %u freed memory\n",
+			reclaimers[i].rc_name, reclaimers[i].rc_cost,
+			(reclaimers[i].rc_flags & RECLAIM_SLEEPS) ?
+			" (sleeps)" : "",
+			reclaimers[i].rc_calls, reclaimers[i].rc_freed);
+	}
+}
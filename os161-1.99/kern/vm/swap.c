@@ -0,0 +1,179 @@
+/*
+ * Swap space on a raw disk. See swap.h for the interface.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <uw-vmstats.h>
+#include <swap.h>
+
+/*
+ * The bitmap is protected by swap_lock. The disk does its own locking,
+ * so page I/O happens without it.
+ */
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+static struct vnode *swap_vnode;
+static struct bitmap *swap_map;
+static unsigned swap_nslots;
+static unsigned swap_nused;
+
+void
+swap_bootstrap(void)
+{
+	struct stat st;
+	char *path;
+	int result;
+
+	path = kstrdup(SWAP_DEVICE);
+	if (path == NULL) {
+		panic("swap_bootstrap: Out of memory\n");
+	}
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	kfree(path);
+	if (result) {
+		kprintf("swap: %s: %s; swapping disabled\n", SWAP_DEVICE,
+			strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result) {
+		panic("swap_bootstrap: stat %s: %s\n", SWAP_DEVICE,
+		      strerror(result));
+	}
+	swap_nslots = st.st_size / PAGE_SIZE;
+	if (swap_nslots == 0) {
+		kprintf("swap: %s is too small; swapping disabled\n",
+			SWAP_DEVICE);
+		vfs_close(swap_vnode);
+		swap_vnode = NULL;
+		return;
+	}
+
+	swap_map = bitmap_create(swap_nslots);
+	if (swap_map == NULL) {
+		panic("swap_bootstrap: Out of memory\n");
+	}
+	swap_nused = 0;
+
+	kprintf("swap: %u pages on %s\n", swap_nslots, SWAP_DEVICE);
+}
+
+bool
+swap_enabled(void)
+{
+	return swap_vnode != NULL;
+}
+
+int
+swap_alloc(unsigned *slot)
+{
+	int result;
+
+	KASSERT(swap_enabled());
+
+	spinlock_acquire(&swap_lock);
+	result = bitmap_alloc(swap_map, slot);
+	if (result == 0) {
+		swap_nused++;
+	}
+	spinlock_release(&swap_lock);
+
+	return result ? ENOSPC : 0;
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(bitmap_isset(swap_map, slot));
+	bitmap_unmark(swap_map, slot);
+	swap_nused--;
+	spinlock_release(&swap_lock);
+}
+
+/*
+ * Move one page between PADDR and SLOT.
+ */
+static
+int
+swap_io(paddr_t paddr, unsigned slot, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(slot < swap_nslots);
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+int
+swap_pagein(paddr_t paddr, unsigned slot)
+{
+	int result;
+
+	result = swap_io(paddr, slot, UIO_READ);
+	if (result == 0) {
+		vmstats_inc(VMSTAT_SWAP_FILE_READ);
+	}
+	return result;
+}
+
+int
+swap_pageout(paddr_t paddr, unsigned slot)
+{
+	int result;
+
+	result = swap_io(paddr, slot, UIO_WRITE);
+	if (result == 0) {
+		vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+	}
+	return result;
+}
+
+void
+swap_printstats(void)
+{
+	unsigned nslots, nused;
+
+	if (!swap_enabled()) {
+		kprintf("Swap: disabled\n");
+		return;
+	}
+
+	spinlock_acquire(&swap_lock);
+	nslots = swap_nslots;
+	nused = swap_nused;
+	spinlock_release(&swap_lock);
+
+	kprintf("Swap: %u of %u pages in use (%uk of %uk) on %s\n",
+		nused, nslots, nused * PAGE_SIZE / 1024,
+		nslots * PAGE_SIZE / 1024, SWAP_DEVICE);
+}
@@ -0,0 +1,164 @@
+/*
+ * Pool of pre-zeroed frames. See zeropool.h for the interface.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <clock.h>
+#include <cpu.h>
+#include <current.h>
+#include <thread.h>
+#include <threadlist.h>
+#include <vm.h>
+#include <coremap.h>
+#include <zeropool.h>
+#include <reclaim.h>
+
+#define ZP_MAX     32		/* frames kept zeroed */
+#define ZP_RESERVE 64		/* free frames left alone */
+
+/*
+ * The pool is a stack of frames, protected by zp_lock. The zeroing
+ * thread sleeps on zp_wchan while the pool is full.
+ */
+static struct spinlock zp_lock = SPINLOCK_INITIALIZER;
+static struct wchan *zp_wchan;
+static paddr_t zp_frames[ZP_MAX];
+static unsigned zp_count;
+
+static unsigned zp_hits;	/* faults served from the pool */
+static unsigned zp_misses;	/* faults that found it empty */
+static unsigned zp_zeroed;	/* frames the thread has cleared */
+
+/*
+ * The zeroing thread. It only works while nothing else on its cpu is
+ * ready to run, and backs off for a while when memory is short.
+ */
+static
+void
+zeropool_thread(void *data1, unsigned long data2)
+{
+	paddr_t paddr;
+
+	(void)data1;
+	(void)data2;
+
+	thread_setbackground();
+
+	while (1) {
+		spinlock_acquire(&zp_lock);
+		while (zp_count >= ZP_MAX) {
+			wchan_lock(zp_wchan);
+			spinlock_release(&zp_lock);
+			wchan_sleep(zp_wchan);
+			spinlock_acquire(&zp_lock);
+		}
+		spinlock_release(&zp_lock);
+
+		if (!threadlist_isempty(&curcpu->c_runqueue)) {
+			thread_yield();
+			continue;
+		}
+		if (coremap_freeframes() <= ZP_RESERVE) {
+			clocksleep(1);
+			continue;
+		}
+		paddr = coremap_alloc(1);
+		if (paddr == 0) {
+			clocksleep(1);
+			continue;
+		}
+
+		bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+
+		spinlock_acquire(&zp_lock);
+		if (zp_count < ZP_MAX) {
+			zp_frames[zp_count++] = paddr;
+			zp_zeroed++;
+			paddr = 0;
+		}
+		spinlock_release(&zp_lock);
+
+		if (paddr != 0) {
+			coremap_free(paddr);
+		}
+	}
+}
+
+void
+zeropool_bootstrap(void)
+{
+	int result;
+
+	zp_wchan = wchan_create("zeropool");
+	if (zp_wchan == NULL) {
+		panic("zeropool_bootstrap: Out of memory\n");
+	}
+	/* The frames are free for the taking; the thread refills it. */
+	reclaim_register("zeropool", zeropool_drain, 0, 0);
+	result = thread_fork("zeroer", NULL, zeropool_thread, NULL, 0);
+	if (result) {
+		panic("zeropool_bootstrap: thread_fork: %s\n",
+		      strerror(result));
+	}
+}
+
+paddr_t
+zeropool_alloc(void)
+{
+	paddr_t paddr = 0;
+
+	spinlock_acquire(&zp_lock);
+	if (zp_count > 0) {
+		paddr = zp_frames[--zp_count];
+		zp_hits++;
+	}
+	else {
+		zp_misses++;
+	}
+	spinlock_release(&zp_lock);
+
+	/* Either way the pool isn't full now. */
+	if (zp_wchan != NULL) {
+		wchan_wakeone(zp_wchan);
+	}
+	return paddr;
+}
+
+int
+zeropool_drain(void)
+{
+	unsigned n;
+
+	spinlock_acquire(&zp_lock);
+	n = zp_count;
+	while (zp_count > 0) {
+		coremap_free(zp_frames[--zp_count]);
+	}
+	spinlock_release(&zp_lock);
+
+	return n > 0 ? 0 : ENOMEM;
+}
+
+void
+zeropool_printstats(void)
+{
+	unsigned count, hits, misses, zeroed;
+
+	spinlock_acquire(&zp_lock);
+	count = zp_count;
+	hits = zp_hits;
+	misses = zp_misses;
+	zeroed = zp_zeroed;
+	spinlock_release(&zp_lock);
+
+	kprintf("Zero pool: %u of %u frames, %u zeroed; %u hits, %u misses",
+		count, ZP_MAX, zeroed, hits, misses);
+	if (hits + misses > 0) {
+		kprintf(" (%u%% hit rate)", (100 * hits) / (hits + misses));
+	}
+	kprintf("\n");
+}
@@ -0,0 +1,185 @@
+/*
+ * madvtest - test madvise and mincore.
+ *
+ * Works on a few pages of heap got from sbrk, and checks that:
+ *    - untouched pages aren't resident, and touched ones are;
+ *    - MADV_DONTNEED drops pages, which read back as zeros, and
+ *      leaves the others alone;
+ *    - MADV_WILLNEED brings pages in;
+ *    - the access pattern advice is accepted;
+ *    - bad arguments fail with the right error: EINVAL for an
+ *      unaligned address or unknown advice, ENOMEM for a range that
+ *      isn't all mapped.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#define PAGE_SIZE	4096
+#define NPAGES		8
+
+static char *base;
+static char vec[NPAGES];
+
+/* Get NPAGES fresh, page-aligned pages of heap. */
+static
+void
+getpages(void)
+{
+	uintptr_t brk, start;
+
+	brk = (uintptr_t)sbrk(0);
+	start = (brk + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+	if (sbrk(start - brk + NPAGES * PAGE_SIZE) == (void *)-1) {
+		err(1, "sbrk");
+	}
+	base = (char *)start;
+}
+
+/*
+ * Check with mincore that page I is resident if bit I of RESIDENT is
+ * set, and not otherwise.
+ */
+static
+void
+checkcore(unsigned resident, const char *when)
+{
+	unsigned i, incore;
+
+	if (mincore(base, NPAGES * PAGE_SIZE, vec)) {
+		err(1, "mincore");
+	}
+	for (i=0; i<NPAGES; i++) {
+		incore = (vec[i] & MINCORE_INCORE) != 0;
+		if (incore != ((resident >> i) & 1)) {
+			errx(1, "FAILED: %s: page %u is %sresident", when,
+			     i, incore ? "" : "not ");
+		}
+	}
+}
+
+/* Check page I is filled with VAL. */
+static
+void
+checkpage(unsigned i, char val, const char *when)
+{
+	unsigned j;
+
+	for (j=0; j<PAGE_SIZE; j++) {
+		if (base[i * PAGE_SIZE + j] != val) {
+			errx(1, "FAILED: %s: byte %u of page %u is 0x%x, "
+			     "expected 0x%x", when, j, i,
+			     (unsigned char)base[i * PAGE_SIZE + j],
+			     (unsigned char)val);
+		}
+	}
+}
+
+static
+void
+expect_fail(int result, int experr, const char *what)
+{
+	if (result == 0) {
+		errx(1, "FAILED: %s succeeded", what);
+	}
+	if (errno != experr) {
+		errx(1, "FAILED: %s: got error %d (%s), expected %d (%s)",
+		     what, errno, strerror(errno), experr, strerror(experr));
+	}
+}
+
+static
+void
+test_advice(void)
+{
+	unsigned i;
+
+	printf("madvtest: mincore before and after touching pages\n");
+	checkcore(0, "before touching");
+	for (i=0; i<NPAGES; i++) {
+		memset(base + i * PAGE_SIZE, 'a' + i, PAGE_SIZE);
+	}
+	checkcore(0xff, "after touching");
+
+	printf("madvtest: MADV_DONTNEED\n");
+	if (madvise(base + 2 * PAGE_SIZE, 2 * PAGE_SIZE, MADV_DONTNEED)) {
+		err(1, "madvise MADV_DONTNEED");
+	}
+	checkcore(0xf3, "after MADV_DONTNEED of pages 2-3");
+	for (i=0; i<NPAGES; i++) {
+		checkpage(i, (i == 2 || i == 3) ? 0 : 'a' + i,
+			  "after MADV_DONTNEED of pages 2-3");
+	}
+
+	/* A length that isn't a whole number of pages is rounded up. */
+	if (madvise(base + 4 * PAGE_SIZE, 3 * PAGE_SIZE + 1, MADV_DONTNEED)) {
+		err(1, "madvise MADV_DONTNEED");
+	}
+	/* Pages 2-3 were read back in by checkpage. */
+	checkcore(0x0f, "after MADV_DONTNEED of pages 4-7");
+
+	printf("madvtest: MADV_WILLNEED\n");
+	if (madvise(base + 4 * PAGE_SIZE, 2 * PAGE_SIZE, MADV_WILLNEED)) {
+		err(1, "madvise MADV_WILLNEED");
+	}
+	checkcore(0x3f, "after MADV_WILLNEED of pages 4-5");
+	checkpage(4, 0, "after MADV_WILLNEED");
+	checkpage(0, 'a', "after MADV_WILLNEED");
+
+	printf("madvtest: access pattern advice\n");
+	if (madvise(base, NPAGES * PAGE_SIZE, MADV_SEQUENTIAL)) {
+		err(1, "madvise MADV_SEQUENTIAL");
+	}
+	if (madvise(base, NPAGES * PAGE_SIZE, MADV_RANDOM)) {
+		err(1, "madvise MADV_RANDOM");
+	}
+	if (madvise(base, NPAGES * PAGE_SIZE, MADV_NORMAL)) {
+		err(1, "madvise MADV_NORMAL");
+	}
+	checkpage(1, 'b', "after access pattern advice");
+}
+
+static
+void
+test_errors(void)
+{
+	char *end = base + NPAGES * PAGE_SIZE;	/* the break; unmapped */
+
+	printf("madvtest: error cases\n");
+
+	expect_fail(madvise(base + 1, PAGE_SIZE, MADV_NORMAL), EINVAL,
+		    "madvise at an unaligned address");
+	expect_fail(madvise(base, PAGE_SIZE, 99), EINVAL,
+		    "madvise with unknown advice");
+	expect_fail(madvise(end, PAGE_SIZE, MADV_DONTNEED), ENOMEM,
+		    "madvise of an unmapped page");
+	expect_fail(madvise(end - PAGE_SIZE, 2 * PAGE_SIZE, MADV_WILLNEED),
+		    ENOMEM, "madvise of a range running off the heap");
+	expect_fail(madvise((void *)0x80000000, PAGE_SIZE, MADV_NORMAL),
+		    ENOMEM, "madvise of kernel memory");
+
+	expect_fail(mincore(base + 1, PAGE_SIZE, vec), EINVAL,
+		    "mincore at an unaligned address");
+	expect_fail(mincore(end, PAGE_SIZE, vec), ENOMEM,
+		    "mincore of an unmapped page");
+	expect_fail(mincore((void *)0x80000000, PAGE_SIZE, vec), ENOMEM,
+		    "mincore of kernel memory");
+	expect_fail(mincore(base, PAGE_SIZE, NULL), EFAULT,
+		    "mincore with a bad vector");
+}
+
+int
+main(void)
+{
+	getpages();
+	test_advice();
+	test_errors();
+	printf("madvtest: passed\n");
+	return 0;
+}
@@ -0,0 +1,323 @@
+/*
+ * mmaptest - test mmap and munmap.
+ *
+ * Writes a file of a few pages, then checks that:
+ *    - a MAP_PRIVATE mapping reads the file, and writes to it stay
+ *      private to the process;
+ *    - writes to a MAP_SHARED mapping reach the file, as seen by read()
+ *      after the mapping is gone;
+ *    - part of a mapping can be unmapped, leaving the rest;
+ *    - bad arguments fail with the right error.
+ *
+ * The file is created in the current directory, which must be on a
+ * filesystem that supports mmap (emufs or sfs).
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+
+#define PAGE_SIZE	4096
+#define NPAGES		3
+#define FILESIZE	(NPAGES * PAGE_SIZE)
+#define TESTFILE	"mmaptest.dat"
+
+static char buf[FILESIZE];
+
+/* The byte at OFFSET in the file as first written. */
+static
+char
+pattern(unsigned offset)
+{
+	return 'a' + (offset / PAGE_SIZE + offset * 7) % 26;
+}
+
+static
+void
+makefile(void)
+{
+	unsigned i;
+	ssize_t r;
+	int fd;
+
+	for (i=0; i<FILESIZE; i++) {
+		buf[i] = pattern(i);
+	}
+	fd = open(TESTFILE, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: open for write", TESTFILE);
+	}
+	r = write(fd, buf, FILESIZE);
+	if (r < 0) {
+		err(1, "%s: write", TESTFILE);
+	}
+	if (r != FILESIZE) {
+		errx(1, "%s: short write (%ld bytes)", TESTFILE, (long)r);
+	}
+	close(fd);
+}
+
+/* Read the whole file back into buf. */
+static
+void
+readfile(void)
+{
+	ssize_t r;
+	int fd;
+
+	fd = open(TESTFILE, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open for read", TESTFILE);
+	}
+	r = read(fd, buf, FILESIZE);
+	if (r < 0) {
+		err(1, "%s: read", TESTFILE);
+	}
+	if (r != FILESIZE) {
+		errx(1, "%s: short read (%ld bytes)", TESTFILE, (long)r);
+	}
+	close(fd);
+}
+
+static
+void
+expect_fail(void *result, int experr, const char *what)
+{
+	if (result != MAP_FAILED) {
+		errx(1, "FAILED: %s succeeded", what);
+	}
+	if (errno != experr) {
+		errx(1, "FAILED: %s: got error %d (%s), expected %d (%s)",
+		     what, errno, strerror(errno), experr, strerror(experr));
+	}
+}
+
+static
+void
+expect_unmapfail(int result, int experr, const char *what)
+{
+	if (result == 0) {
+		errx(1, "FAILED: %s succeeded", what);
+	}
+	if (errno != experr) {
+		errx(1, "FAILED: %s: got error %d (%s), expected %d (%s)",
+		     what, errno, strerror(errno), experr, strerror(experr));
+	}
+}
+
+static
+void
+test_private(void)
+{
+	char *p;
+	unsigned i;
+	int fd;
+
+	printf("mmaptest: MAP_PRIVATE\n");
+
+	fd = open(TESTFILE, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", TESTFILE);
+	}
+	p = mmap(NULL, FILESIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap MAP_PRIVATE");
+	}
+	/* The mapping holds the file; the descriptor isn't needed. */
+	close(fd);
+
+	for (i=0; i<FILESIZE; i++) {
+		if (p[i] != pattern(i)) {
+			errx(1, "FAILED: byte %u of private map is 0x%x, "
+			     "expected 0x%x", i, (unsigned char)p[i],
+			     (unsigned char)pattern(i));
+		}
+	}
+	for (i=0; i<FILESIZE; i += PAGE_SIZE / 2) {
+		p[i] = '*';
+	}
+	if (munmap(p, FILESIZE)) {
+		err(1, "munmap MAP_PRIVATE");
+	}
+
+	readfile();
+	for (i=0; i<FILESIZE; i++) {
+		if (buf[i] != pattern(i)) {
+			errx(1, "FAILED: private write reached the file "
+			     "at offset %u", i);
+		}
+	}
+}
+
+static
+void
+test_shared(void)
+{
+	char *p;
+	unsigned i;
+	int fd;
+
+	printf("mmaptest: MAP_SHARED\n");
+
+	fd = open(TESTFILE, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s: open", TESTFILE);
+	}
+	/* Map the last two pages only, to check the offset. */
+	p = mmap(NULL, FILESIZE - PAGE_SIZE, PROT_READ|PROT_WRITE,
+		 MAP_SHARED, fd, PAGE_SIZE);
+	if (p == MAP_FAILED) {
+		err(1, "mmap MAP_SHARED");
+	}
+	close(fd);
+
+	if (p[0] != pattern(PAGE_SIZE)) {
+		errx(1, "FAILED: shared map at offset %u starts with 0x%x, "
+		     "expected 0x%x", PAGE_SIZE, (unsigned char)p[0],
+		     (unsigned char)pattern(PAGE_SIZE));
+	}
+	for (i=0; i<FILESIZE - PAGE_SIZE; i += 100) {
+		p[i] = '#';
+	}
+	if (munmap(p, FILESIZE - PAGE_SIZE)) {
+		err(1, "munmap MAP_SHARED");
+	}
+
+	readfile();
+	for (i=0; i<FILESIZE; i++) {
+		if (i >= PAGE_SIZE && (i - PAGE_SIZE) % 100 == 0) {
+			if (buf[i] != '#') {
+				errx(1, "FAILED: shared write at offset %u "
+				     "didn't reach the file", i);
+			}
+		}
+		else if (buf[i] != pattern(i)) {
+			errx(1, "FAILED: file changed at offset %u, "
+			     "which wasn't written", i);
+		}
+	}
+}
+
+static
+void
+test_partial(void)
+{
+	char *p;
+	unsigned i;
+	int fd;
+
+	printf("mmaptest: partial munmap\n");
+
+	fd = open(TESTFILE, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", TESTFILE);
+	}
+	p = mmap(NULL, FILESIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	close(fd);
+
+	/* Punch out the middle page; the pages either side stay. */
+	if (munmap(p + PAGE_SIZE, PAGE_SIZE)) {
+		err(1, "munmap of the middle page");
+	}
+	for (i=0; i<FILESIZE; i++) {
+		if (i / PAGE_SIZE == 1) {
+			continue;
+		}
+		if (p[i] != buf[i]) {
+			errx(1, "FAILED: byte %u is 0x%x after unmapping the "
+			     "middle page, expected 0x%x", i,
+			     (unsigned char)p[i], (unsigned char)buf[i]);
+		}
+	}
+
+	/* A range may span the hole; the pages in it are skipped. */
+	if (munmap(p, FILESIZE)) {
+		err(1, "munmap across the hole");
+	}
+	/* Unmapping what is already gone does nothing. */
+	if (munmap(p, FILESIZE)) {
+		err(1, "munmap of a mapping already gone");
+	}
+}
+
+static
+void
+test_errors(void)
+{
+	char *p;
+	int fd, wfd, con;
+
+	printf("mmaptest: error cases\n");
+
+	fd = open(TESTFILE, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", TESTFILE);
+	}
+	wfd = open(TESTFILE, O_WRONLY);
+	if (wfd < 0) {
+		err(1, "%s: open for write", TESTFILE);
+	}
+	con = open("con:", O_RDWR);
+	if (con < 0) {
+		err(1, "con:");
+	}
+
+	expect_fail(mmap(NULL, FILESIZE, PROT_READ, MAP_PRIVATE, -1, 0),
+		    EBADF, "mmap of fd -1");
+	expect_fail(mmap(NULL, 0, PROT_READ, MAP_PRIVATE, fd, 0),
+		    EINVAL, "mmap of length 0");
+	expect_fail(mmap(NULL, FILESIZE, PROT_READ, MAP_PRIVATE, fd, 1),
+		    EINVAL, "mmap at an unaligned offset");
+	expect_fail(mmap(NULL, FILESIZE, PROT_READ, MAP_SHARED|MAP_PRIVATE,
+			 fd, 0),
+		    EINVAL, "mmap with MAP_SHARED|MAP_PRIVATE");
+	expect_fail(mmap(NULL, FILESIZE, PROT_READ, 0, fd, 0),
+		    EINVAL, "mmap with no sharing flag");
+	expect_fail(mmap(NULL, FILESIZE, PROT_READ, MAP_PRIVATE, wfd, 0),
+		    EACCES, "mmap of a write-only file");
+	expect_fail(mmap(NULL, FILESIZE, PROT_READ|PROT_WRITE, MAP_SHARED,
+			 fd, 0),
+		    EACCES, "writeable MAP_SHARED of a read-only file");
+	expect_fail(mmap(NULL, PAGE_SIZE, PROT_READ, MAP_PRIVATE, con, 0),
+		    ENODEV, "mmap of the console");
+
+	p = mmap(NULL, FILESIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	expect_unmapfail(munmap(p + 1, FILESIZE - PAGE_SIZE), EINVAL,
+			 "munmap at an unaligned address");
+	expect_unmapfail(munmap(p, 0), EINVAL, "munmap of length 0");
+	expect_unmapfail(munmap((void *)((uintptr_t)buf & ~(PAGE_SIZE - 1)),
+				PAGE_SIZE), EINVAL,
+			 "munmap of memory that isn't a mapping");
+	if (munmap(p, FILESIZE)) {
+		err(1, "munmap");
+	}
+
+	close(con);
+	close(wfd);
+	close(fd);
+}
+
+int
+main(void)
+{
+	makefile();
+	test_private();
+	test_shared();
+	test_partial();
+	test_errors();
+	remove(TESTFILE);
+	printf("mmaptest: passed\n");
+	return 0;
+}
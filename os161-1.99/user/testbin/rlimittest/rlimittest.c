@@ -0,0 +1,309 @@
+/*
+ * rlimittest - test getrusage, getrlimit and setrlimit.
+ *
+ * Checks that:
+ *    - getrusage reports memory use that grows as pages are touched;
+ *    - RLIMIT_RSS and RLIMIT_STACK can be read and set;
+ *    - with an RSS limit well below the working set, the process keeps
+ *      running, its data stays intact, and its resident size stays
+ *      near the limit (this needs swap configured);
+ *    - the limits are passed on across fork and exec;
+ *    - bad arguments fail with the right error.
+ */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#define PAGE_SIZE	4096
+#define NPAGES		64		/* working set */
+#define LIMITPAGES	16		/* RSS limit */
+
+/*
+ * Pages that may be resident over the limit: the limit is only
+ * enforced for private pages, not for text mapped from the page cache.
+ */
+#define SLACKPAGES	16
+
+/* Where exec finds this program again, to check limits survive exec. */
+#define SELF		"/testbin/rlimittest"
+#define CHILDARG	"-child"
+
+static char *base;
+
+static
+void
+getusage(struct rusage *ru)
+{
+	if (getrusage(RUSAGE_SELF, ru)) {
+		err(1, "getrusage");
+	}
+}
+
+static
+void
+expect_fail(int result, int experr, const char *what)
+{
+	if (result == 0) {
+		errx(1, "FAILED: %s succeeded", what);
+	}
+	if (errno != experr) {
+		errx(1, "FAILED: %s: got error %d (%s), expected %d (%s)",
+		     what, errno, strerror(errno), experr, strerror(experr));
+	}
+}
+
+static
+void
+test_rusage(void)
+{
+	struct rusage before, after;
+	unsigned i;
+
+	printf("rlimittest: getrusage\n");
+
+	base = sbrk(NPAGES * PAGE_SIZE);
+	if (base == (void *)-1) {
+		err(1, "sbrk");
+	}
+
+	getusage(&before);
+	for (i=0; i<NPAGES; i++) {
+		base[i * PAGE_SIZE] = i;
+	}
+	getusage(&after);
+
+	/* The first page may share a page that was resident already. */
+	if (after.ru_rss <
+	    before.ru_rss + (NPAGES - 1) * (PAGE_SIZE / 1024)) {
+		errx(1, "FAILED: touching %u pages took RSS from %lukb "
+		     "only to %lukb", NPAGES, (unsigned long)before.ru_rss,
+		     (unsigned long)after.ru_rss);
+	}
+	if (after.ru_maxrss < after.ru_rss) {
+		errx(1, "FAILED: maximum RSS %lukb is below current RSS %lukb",
+		     (unsigned long)after.ru_maxrss,
+		     (unsigned long)after.ru_rss);
+	}
+	if (after.ru_minflt + after.ru_majflt <
+	    before.ru_minflt + before.ru_majflt + NPAGES - 1) {
+		errx(1, "FAILED: touching %u pages counted only %lu faults",
+		     NPAGES, (unsigned long)(after.ru_minflt + after.ru_majflt
+				       - before.ru_minflt - before.ru_majflt));
+	}
+	if (after.ru_vsize < after.ru_rss) {
+		errx(1, "FAILED: virtual size %lukb is below RSS %lukb",
+		     (unsigned long)after.ru_vsize,
+		     (unsigned long)after.ru_rss);
+	}
+}
+
+static
+void
+test_limits(void)
+{
+	struct rlimit rl, stack;
+
+	printf("rlimittest: getrlimit and setrlimit\n");
+
+	if (getrlimit(RLIMIT_RSS, &rl)) {
+		err(1, "getrlimit RLIMIT_RSS");
+	}
+	if (rl.rlim_cur != RLIM_INFINITY || rl.rlim_max != RLIM_INFINITY) {
+		errx(1, "FAILED: RLIMIT_RSS starts out limited");
+	}
+
+	if (getrlimit(RLIMIT_STACK, &stack)) {
+		err(1, "getrlimit RLIMIT_STACK");
+	}
+	if (stack.rlim_cur == 0 || stack.rlim_cur % PAGE_SIZE != 0) {
+		errx(1, "FAILED: RLIMIT_STACK is %lu",
+		     (unsigned long)stack.rlim_cur);
+	}
+	rl = stack;
+	rl.rlim_cur += 4 * PAGE_SIZE;
+	if (setrlimit(RLIMIT_STACK, &rl)) {
+		err(1, "setrlimit RLIMIT_STACK");
+	}
+	if (getrlimit(RLIMIT_STACK, &rl)) {
+		err(1, "getrlimit RLIMIT_STACK");
+	}
+	if (rl.rlim_cur != stack.rlim_cur + 4 * PAGE_SIZE) {
+		errx(1, "FAILED: RLIMIT_STACK set to %lu, reads back as %lu",
+		     (unsigned long)(stack.rlim_cur + 4 * PAGE_SIZE),
+		     (unsigned long)rl.rlim_cur);
+	}
+
+	printf("rlimittest: error cases\n");
+	expect_fail(getrlimit(99, &rl), EINVAL,
+		    "getrlimit of an unknown resource");
+	rl.rlim_cur = PAGE_SIZE;
+	rl.rlim_max = RLIM_INFINITY;
+	expect_fail(setrlimit(99, &rl), EINVAL,
+		    "setrlimit of an unknown resource");
+	expect_fail(setrlimit(RLIMIT_CPU, &rl), EINVAL,
+		    "setrlimit of an unsupported resource");
+	rl.rlim_cur = 2 * PAGE_SIZE;
+	rl.rlim_max = PAGE_SIZE;
+	expect_fail(setrlimit(RLIMIT_RSS, &rl), EINVAL,
+		    "setrlimit with the soft limit over the hard one");
+	rl.rlim_cur = 0;
+	rl.rlim_max = RLIM_INFINITY;
+	expect_fail(setrlimit(RLIMIT_STACK, &rl), EINVAL,
+		    "setrlimit of a zero stack");
+	expect_fail(getrusage(RUSAGE_CHILDREN, NULL), EINVAL,
+		    "getrusage of RUSAGE_CHILDREN");
+	expect_fail(getrusage(RUSAGE_SELF, NULL), EFAULT,
+		    "getrusage with a bad pointer");
+}
+
+static
+void
+test_rsslimit(void)
+{
+	struct rlimit rl;
+	struct rusage ru;
+	unsigned i, pass;
+
+	printf("rlimittest: RSS limit of %u pages, working set of %u\n",
+	       LIMITPAGES, NPAGES);
+
+	rl.rlim_cur = LIMITPAGES * PAGE_SIZE;
+	rl.rlim_max = RLIM_INFINITY;
+	if (setrlimit(RLIMIT_RSS, &rl)) {
+		err(1, "setrlimit RLIMIT_RSS");
+	}
+	if (getrlimit(RLIMIT_RSS, &rl)) {
+		err(1, "getrlimit RLIMIT_RSS");
+	}
+	if (rl.rlim_cur != LIMITPAGES * PAGE_SIZE) {
+		errx(1, "FAILED: RLIMIT_RSS set to %u, reads back as %lu",
+		     LIMITPAGES * PAGE_SIZE, (unsigned long)rl.rlim_cur);
+	}
+
+	/* Write every page, then check them all, twice over. */
+	for (pass=0; pass<2; pass++) {
+		for (i=0; i<NPAGES; i++) {
+			memset(base + i * PAGE_SIZE, pass * NPAGES + i,
+			       PAGE_SIZE);
+		}
+		for (i=0; i<NPAGES; i++) {
+			if (base[i * PAGE_SIZE + PAGE_SIZE - 1] !=
+			    (char)(pass * NPAGES + i)) {
+				errx(1, "FAILED: pass %u: page %u lost its "
+				     "contents", pass, i);
+			}
+		}
+	}
+
+	getusage(&ru);
+	if (ru.ru_rss > (LIMITPAGES + SLACKPAGES) * (PAGE_SIZE / 1024)) {
+		errx(1, "FAILED: RSS is %lukb with a limit of %ukb "
+		     "(is swap configured?)", (unsigned long)ru.ru_rss,
+		     LIMITPAGES * (PAGE_SIZE / 1024));
+	}
+
+	rl.rlim_cur = RLIM_INFINITY;
+	if (setrlimit(RLIMIT_RSS, &rl)) {
+		err(1, "setrlimit RLIMIT_RSS");
+	}
+}
+
+/*
+ * Run in the process exec'd by test_inherit: check the limits it set
+ * came through.
+ */
+static
+int
+child(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_RSS, &rl)) {
+		err(1, "child: getrlimit RLIMIT_RSS");
+	}
+	if (rl.rlim_cur != LIMITPAGES * PAGE_SIZE) {
+		errx(1, "FAILED: RLIMIT_RSS is %lu after exec, expected %u",
+		     (unsigned long)rl.rlim_cur, LIMITPAGES * PAGE_SIZE);
+	}
+	if (getrlimit(RLIMIT_STACK, &rl)) {
+		err(1, "child: getrlimit RLIMIT_STACK");
+	}
+	if (rl.rlim_cur != 2 * PAGE_SIZE * NPAGES) {
+		errx(1, "FAILED: RLIMIT_STACK is %lu after exec, expected %u",
+		     (unsigned long)rl.rlim_cur, 2 * PAGE_SIZE * NPAGES);
+	}
+	return 0;
+}
+
+static
+void
+test_inherit(void)
+{
+	struct rlimit rl, oldstack;
+	char *args[3];
+	pid_t pid;
+	int status;
+
+	printf("rlimittest: limits across fork and exec\n");
+
+	if (getrlimit(RLIMIT_STACK, &oldstack)) {
+		err(1, "getrlimit RLIMIT_STACK");
+	}
+	rl.rlim_max = RLIM_INFINITY;
+	rl.rlim_cur = LIMITPAGES * PAGE_SIZE;
+	if (setrlimit(RLIMIT_RSS, &rl)) {
+		err(1, "setrlimit RLIMIT_RSS");
+	}
+	rl.rlim_cur = 2 * PAGE_SIZE * NPAGES;
+	if (setrlimit(RLIMIT_STACK, &rl)) {
+		err(1, "setrlimit RLIMIT_STACK");
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		args[0] = (char *)SELF;
+		args[1] = (char *)CHILDARG;
+		args[2] = NULL;
+		execv(SELF, args);
+		err(1, "%s", SELF);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "FAILED: the exec'd child failed");
+	}
+
+	rl.rlim_cur = RLIM_INFINITY;
+	if (setrlimit(RLIMIT_RSS, &rl)) {
+		err(1, "setrlimit RLIMIT_RSS");
+	}
+	if (setrlimit(RLIMIT_STACK, &oldstack)) {
+		err(1, "setrlimit RLIMIT_STACK");
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc == 2 && strcmp(argv[1], CHILDARG) == 0) {
+		return child();
+	}
+
+	test_rusage();
+	test_limits();
+	test_rsslimit();
+	test_inherit();
+	printf("rlimittest: passed\n");
+	return 0;
+}
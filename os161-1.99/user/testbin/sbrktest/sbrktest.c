@@ -0,0 +1,159 @@
+/*
+ * sbrktest - test sbrk.
+ *
+ * Checks that:
+ *    - sbrk(0) reports the break without moving it;
+ *    - growing the heap gives zeroed, writeable memory, and returns
+ *      the old break;
+ *    - shrinking the heap gives pages back, so that growing it again
+ *      gives fresh zeroed pages;
+ *    - bad requests fail, with EINVAL for moving the break below the
+ *      start of the heap and ENOMEM for growing it too far, and leave
+ *      the break where it was.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#define PAGE_SIZE	4096
+#define NPAGES		4
+
+static
+char *
+getbreak(void)
+{
+	return sbrk(0);
+}
+
+/* Check N bytes at P are all VAL. */
+static
+void
+checkmem(const char *p, size_t n, char val, const char *when)
+{
+	size_t i;
+
+	for (i=0; i<n; i++) {
+		if (p[i] != val) {
+			errx(1, "FAILED: %s: byte %lu at %p is 0x%x, "
+			     "expected 0x%x", when, (unsigned long)i, &p[i],
+			     (unsigned char)p[i], (unsigned char)val);
+		}
+	}
+}
+
+static
+void
+expect_fail(int amount, int experr, const char *what)
+{
+	char *before, *p;
+
+	before = getbreak();
+	p = sbrk(amount);
+	if (p != (void *)-1) {
+		errx(1, "FAILED: %s succeeded", what);
+	}
+	if (errno != experr) {
+		errx(1, "FAILED: %s: got error %d (%s), expected %d (%s)",
+		     what, errno, strerror(errno), experr, strerror(experr));
+	}
+	if (getbreak() != before) {
+		errx(1, "FAILED: %s moved the break from %p to %p", what,
+		     before, getbreak());
+	}
+}
+
+static
+void
+test_grow(void)
+{
+	char *brk, *p, *start;
+	uintptr_t pad;
+
+	printf("sbrktest: growing and shrinking\n");
+
+	brk = getbreak();
+	if (getbreak() != brk) {
+		errx(1, "FAILED: sbrk(0) moved the break");
+	}
+
+	/* Start on a page boundary, so whole pages come and go. */
+	pad = (PAGE_SIZE - (uintptr_t)brk % PAGE_SIZE) % PAGE_SIZE;
+	p = sbrk(pad + NPAGES * PAGE_SIZE);
+	if (p == (void *)-1) {
+		err(1, "sbrk");
+	}
+	if (p != brk) {
+		errx(1, "FAILED: sbrk returned %p, not the old break %p",
+		     p, brk);
+	}
+	start = brk + pad;
+	if (getbreak() != start + NPAGES * PAGE_SIZE) {
+		errx(1, "FAILED: break is %p after growing, expected %p",
+		     getbreak(), start + NPAGES * PAGE_SIZE);
+	}
+	checkmem(start, NPAGES * PAGE_SIZE, 0, "new heap");
+	memset(start, 0xa5, NPAGES * PAGE_SIZE);
+	checkmem(start, NPAGES * PAGE_SIZE, (char)0xa5, "after writing");
+
+	/* Give back all but the first page. */
+	p = sbrk(-(NPAGES - 1) * PAGE_SIZE);
+	if (p == (void *)-1) {
+		err(1, "sbrk shrink");
+	}
+	if (p != start + NPAGES * PAGE_SIZE) {
+		errx(1, "FAILED: shrinking sbrk returned %p, not the old "
+		     "break %p", p, start + NPAGES * PAGE_SIZE);
+	}
+	if (getbreak() != start + PAGE_SIZE) {
+		errx(1, "FAILED: break is %p after shrinking, expected %p",
+		     getbreak(), start + PAGE_SIZE);
+	}
+	checkmem(start, PAGE_SIZE, (char)0xa5, "page kept by shrinking");
+
+	/* The pages given back must come back zeroed. */
+	if (sbrk((NPAGES - 1) * PAGE_SIZE) == (void *)-1) {
+		err(1, "sbrk regrow");
+	}
+	checkmem(start, PAGE_SIZE, (char)0xa5, "page kept by shrinking");
+	checkmem(start + PAGE_SIZE, (NPAGES - 1) * PAGE_SIZE, 0,
+		 "regrown heap");
+
+	/* A break that isn't on a page boundary works too. */
+	if (sbrk(-PAGE_SIZE / 2) == (void *)-1) {
+		err(1, "sbrk half a page");
+	}
+	if (getbreak() != start + NPAGES * PAGE_SIZE - PAGE_SIZE / 2) {
+		errx(1, "FAILED: break is %p after shrinking half a page",
+		     getbreak());
+	}
+}
+
+static
+void
+test_errors(void)
+{
+	char *brk;
+
+	printf("sbrktest: error cases\n");
+
+	brk = getbreak();
+	expect_fail(-(int)((uintptr_t)brk - PAGE_SIZE), EINVAL,
+		    "sbrk to below the start of the heap");
+	expect_fail(-0x7fffffff - 1, EINVAL,
+		    "sbrk shrinking past address 0");
+	expect_fail(0x7ffff000, ENOMEM, "sbrk growing into the stack");
+}
+
+int
+main(void)
+{
+	test_grow();
+	test_errors();
+	printf("sbrktest: passed\n");
+	return 0;
+}